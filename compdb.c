@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include "filemapper.h"
 #include "compdb.h"
@@ -30,6 +31,15 @@ struct compdb_vfs {
 
 };
 
+struct compdb_cache_ent {
+	unsigned int			page;	/* 0 == free slot */
+	unsigned long			lru;
+	int				pinned;	/* xFetch references */
+	char				*buf;	/* points into the slab */
+};
+
+#define COMPDB_BUFPOOL_NR	32
+
 struct compdb_file {
 	struct sqlite3_io_methods	methods;
 	struct compdb_vfs		*cvfs;
@@ -37,12 +47,63 @@ struct compdb_file {
 						    int, sqlite3_int64);
 	int				(*old_write)(sqlite3_file*, const void*,
 						    int, sqlite3_int64);
+	int				(*old_close)(sqlite3_file*);
+	int				(*old_truncate)(sqlite3_file*,
+						    sqlite3_int64);
+	int				(*old_sync)(sqlite3_file*, int);
+	int				(*old_filesize)(sqlite3_file*,
+						    sqlite3_int64*);
+	int				(*old_fetch)(sqlite3_file*,
+						    sqlite3_int64, int, void**);
+	int				(*old_unfetch)(sqlite3_file*,
+						    sqlite3_int64, void*);
+	struct compdb_wpool		*wpool;
+	int				wpool_tried;
+	struct compdb_rpool		*rpool;
+	int				rpool_tried;
+	unsigned int			last_page;
+	unsigned int			seq_run;
+	pthread_mutex_t			cache_lock;
+	struct compdb_cache_ent		*cache;
+	char				*cache_slab;
+	int				cache_nr;	/* -1 == not set up */
+	unsigned long			cache_clock;
+	unsigned long			cache_epoch;	/* bumped per write */
+	pthread_mutex_t			buf_lock;
+	char				*bufpool[COMPDB_BUFPOOL_NR];
+	int				nr_bufs;
 	unsigned int			freestart;
 	unsigned int			freelen;
 	int				pagesize;
 	enum compdb_type		db_type;
 };
 
+/*
+ * Aggregate I/O counters, summed over every file opened through the
+ * shim.  Multiple threads (the scan, the write-behind pool, and the
+ * readahead thread) account here, hence the atomic adds.
+ */
+static struct compdb_stats	compdb_io_stats;
+
+static void
+compdb_count_io(
+	unsigned long long	*ctr,
+	unsigned long long	nr)
+{
+	__sync_fetch_and_add(ctr, nr);
+}
+
+/* Sample the aggregate I/O counters. */
+void
+compdb_get_stats(
+	struct compdb_stats	*stats)
+{
+	stats->bytes_read = __sync_fetch_and_add(&compdb_io_stats.bytes_read,
+			0);
+	stats->bytes_decompressed = __sync_fetch_and_add(
+			&compdb_io_stats.bytes_decompressed, 0);
+}
+
 /* Convert a sqlite file into a compdb file */
 static inline struct compdb_file *
 COMPDB_F(
@@ -51,6 +112,43 @@ COMPDB_F(
 	return container_of(file->pMethods, struct compdb_file, methods);
 }
 
+/*
+ * Page-sized scratch buffers.  Every compressed page moving in either
+ * direction needs one or two of these for the (de)compressor to work
+ * in; recycling them through a small pool spares the I/O paths a
+ * malloc and a free per page.
+ */
+static char *
+compdb_buf_get(
+	struct compdb_file	*ff)
+{
+	char			*buf = NULL;
+
+	pthread_mutex_lock(&ff->buf_lock);
+	if (ff->nr_bufs)
+		buf = ff->bufpool[--ff->nr_bufs];
+	pthread_mutex_unlock(&ff->buf_lock);
+	if (!buf)
+		buf = malloc(ff->pagesize);
+	return buf;
+}
+
+static void
+compdb_buf_put(
+	struct compdb_file	*ff,
+	char			*buf)
+{
+	if (!buf)
+		return;
+	pthread_mutex_lock(&ff->buf_lock);
+	if (ff->nr_bufs < COMPDB_BUFPOOL_NR) {
+		ff->bufpool[ff->nr_bufs++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&ff->buf_lock);
+	free(buf);
+}
+
 /* Figure out database parameters. */
 static int
 compdb_sniff(
@@ -84,7 +182,6 @@ compdb_sniff(
 
 	/* Collect some stats. */
 	ff->db_type = DB_COMPRESSED;
-	ff->methods.iVersion = 1;
 	ff->pagesize = ntohs(super->pagesize);
 	if (ff->pagesize == 1)
 		ff->pagesize = 65536;
@@ -97,6 +194,718 @@ compdb_sniff(
 	return SQLITE_OK;
 }
 
+/*
+ * Decompressed page cache.  SQLite's pager caches pages too, but the
+ * GUI's overview and GLOB queries walk the same index interior pages
+ * over and over, and decompressing them from scratch on every xRead
+ * dominates query latency on lzma databases.  Cache the decompression
+ * output in a small LRU keyed by page number, backed by one
+ * preallocated slab of page buffers.
+ */
+#define COMPDB_CACHE_PAGES	64
+
+/* Set up the page cache, or disable it if we can't. */
+static void
+compdb_cache_init(
+	struct compdb_file		*ff)
+{
+	char				*p;
+	long				nr = COMPDB_CACHE_PAGES;
+	int				i;
+
+	ff->cache_nr = 0;
+
+	p = getenv("COMPDB_CACHE_PAGES");
+	if (p)
+		nr = strtol(p, NULL, 0);
+	if (nr <= 0)
+		return;
+
+	ff->cache = calloc(nr, sizeof(struct compdb_cache_ent));
+	ff->cache_slab = malloc(nr * (size_t)ff->pagesize);
+	if (!ff->cache || !ff->cache_slab) {
+		free(ff->cache);
+		free(ff->cache_slab);
+		ff->cache = NULL;
+		ff->cache_slab = NULL;
+		return;
+	}
+	for (i = 0; i < nr; i++)
+		ff->cache[i].buf = ff->cache_slab + (size_t)i * ff->pagesize;
+	ff->cache_nr = nr;
+}
+
+/* Find a cached decompressed page. */
+static struct compdb_cache_ent *
+compdb_cache_lookup(
+	struct compdb_file		*ff,
+	unsigned int			page)
+{
+	int				i;
+
+	for (i = 0; i < ff->cache_nr; i++)
+		if (ff->cache[i].page == page) {
+			ff->cache[i].lru = ++ff->cache_clock;
+			return &ff->cache[i];
+		}
+	return NULL;
+}
+
+/* Remember a decompressed page, recycling the coldest slot. */
+static void
+compdb_cache_store(
+	struct compdb_file		*ff,
+	unsigned int			page,
+	const char			*buf)
+{
+	struct compdb_cache_ent		*ent, *victim;
+	int				i;
+
+	if (!ff->cache_nr)
+		return;
+
+	victim = NULL;
+	for (i = 0; i < ff->cache_nr; i++) {
+		ent = &ff->cache[i];
+		/* SQLite may still hold a fetched pointer to this buffer. */
+		if (ent->pinned)
+			continue;
+		if (ent->page == page || ent->page == 0) {
+			victim = ent;
+			break;
+		}
+		if (!victim || ent->lru < victim->lru)
+			victim = ent;
+	}
+	if (!victim)
+		return;
+
+	victim->page = page;
+	victim->lru = ++ff->cache_clock;
+	memcpy(victim->buf, buf, ff->pagesize);
+}
+
+/* Drop any cached copy of this page. */
+static void
+compdb_cache_forget(
+	struct compdb_file		*ff,
+	unsigned int			page)
+{
+	int				i;
+
+	for (i = 0; i < ff->cache_nr; i++)
+		if (ff->cache[i].page == page) {
+			ff->cache[i].page = 0;
+			ff->cache[i].lru = 0;
+		}
+}
+
+/*
+ * Sequential readahead.  Table scans (cache_overview, the GUI's extent
+ * queries) read compressed pages in ascending order, but each xRead
+ * still paid a cold pread plus a decompression.  When a run of
+ * consecutive page reads is spotted, a prefetch thread reads the next
+ * pages and decompresses them into the page cache before SQLite asks,
+ * overlapping storage latency and decompression with query execution.
+ * The cache is shared with the prefetcher, so all cache access takes
+ * cache_lock, and a page prefetched across a concurrent write is
+ * discarded by comparing cache_epoch.
+ */
+#define COMPDB_PREFETCH_TRIGGER	4	/* consecutive pages to arm */
+#define COMPDB_PREFETCH_NR	32	/* pages read ahead */
+
+struct compdb_rpool {
+	pthread_t			thread;
+	pthread_mutex_t			lock;
+	pthread_cond_t			todo;
+	struct compdb_file		*ff;
+	sqlite3_file			*file;
+	unsigned int			next;	/* next page to read */
+	unsigned int			end;	/* one past the last */
+	unsigned int			nr;	/* readahead window */
+	int				exit;
+};
+
+/* Read and decompress one page into the cache ahead of the scan. */
+static void
+compdb_prefetch_page(
+	struct compdb_file		*ff,
+	sqlite3_file			*file,
+	char				*raw,
+	char				*buf,
+	unsigned int			page)
+{
+	struct compdb_block_head	*bhead = (struct compdb_block_head *)raw;
+	sqlite3_int64			iOfst;
+	unsigned long			epoch;
+	int				clen;
+	int				ret;
+
+	iOfst = (sqlite3_int64)page * ff->pagesize;
+
+	/* Already decompressed? */
+	pthread_mutex_lock(&ff->cache_lock);
+	epoch = ff->cache_epoch;
+	if (ff->cache_nr <= 0 || compdb_cache_lookup(ff, page)) {
+		pthread_mutex_unlock(&ff->cache_lock);
+		return;
+	}
+	pthread_mutex_unlock(&ff->cache_lock);
+
+	ret = ff->old_read(file, raw, ff->pagesize, iOfst);
+	if (ret)
+		return;
+	compdb_count_io(&compdb_io_stats.bytes_read, ff->pagesize);
+
+	/* Raw pages don't need pre-chewing. */
+	if (memcmp(bhead->magic, COMPDB_BLOCK_MAGIC, sizeof(bhead->magic)))
+		return;
+	clen = ntohs(bhead->len);
+	if (clen > ff->pagesize - sizeof(*bhead) ||
+	    (unsigned long long)ntohl(bhead->offset) * ff->pagesize != iOfst)
+		return;
+	ret = ff->cvfs->compressor->decompress(raw + sizeof(*bhead), buf, clen,
+			ff->pagesize);
+	if (ret < 0)
+		return;
+	compdb_count_io(&compdb_io_stats.bytes_decompressed, ret);
+	memset(buf + ret, 0, ff->pagesize - ret);
+
+	dbg_printf("%s(%d) page=%u clen=%d\n", __func__, __LINE__, page, clen);
+	pthread_mutex_lock(&ff->cache_lock);
+	/* Don't cache it if somebody rewrote the page meanwhile. */
+	if (ff->cache_epoch == epoch)
+		compdb_cache_store(ff, page, buf);
+	pthread_mutex_unlock(&ff->cache_lock);
+}
+
+/* Chase the readahead window until told to stop. */
+static void *
+compdb_rpool_thread(
+	void				*arg)
+{
+	struct compdb_rpool		*rp = arg;
+	struct compdb_file		*ff = rp->ff;
+	char				*raw, *buf;
+	unsigned int			page;
+
+	raw = malloc(ff->pagesize);
+	buf = malloc(ff->pagesize);
+	if (!raw || !buf)
+		goto out;
+
+	pthread_mutex_lock(&rp->lock);
+	for (;;) {
+		if (rp->exit)
+			break;
+		if (rp->next >= rp->end) {
+			pthread_cond_wait(&rp->todo, &rp->lock);
+			continue;
+		}
+		page = rp->next++;
+		pthread_mutex_unlock(&rp->lock);
+
+		compdb_prefetch_page(ff, rp->file, raw, buf, page);
+
+		pthread_mutex_lock(&rp->lock);
+	}
+	pthread_mutex_unlock(&rp->lock);
+out:
+	free(raw);
+	free(buf);
+	return NULL;
+}
+
+/* Fire up the prefetch thread, or quietly do without. */
+static void
+compdb_rpool_start(
+	struct compdb_file		*ff,
+	sqlite3_file			*file)
+{
+	struct compdb_rpool		*rp;
+	char				*p;
+	long				nr = COMPDB_PREFETCH_NR;
+
+	p = getenv("COMPDB_PREFETCH_PAGES");
+	if (p)
+		nr = strtol(p, NULL, 0);
+	if (nr <= 0)
+		return;
+
+	rp = calloc(1, sizeof(*rp));
+	if (!rp)
+		return;
+	rp->ff = ff;
+	rp->file = file;
+	rp->nr = nr;
+	pthread_mutex_init(&rp->lock, NULL);
+	pthread_cond_init(&rp->todo, NULL);
+	if (pthread_create(&rp->thread, NULL, compdb_rpool_thread, rp)) {
+		pthread_cond_destroy(&rp->todo);
+		pthread_mutex_destroy(&rp->lock);
+		free(rp);
+		return;
+	}
+	ff->rpool = rp;
+}
+
+/* Reap the prefetch thread. */
+static void
+compdb_rpool_stop(
+	struct compdb_file		*ff)
+{
+	struct compdb_rpool		*rp = ff->rpool;
+
+	if (!rp)
+		return;
+	pthread_mutex_lock(&rp->lock);
+	rp->exit = 1;
+	pthread_cond_signal(&rp->todo);
+	pthread_mutex_unlock(&rp->lock);
+	pthread_join(rp->thread, NULL);
+	pthread_cond_destroy(&rp->todo);
+	pthread_mutex_destroy(&rp->lock);
+	free(rp);
+	ff->rpool = NULL;
+}
+
+/* Watch for ascending page reads and keep the window ahead of them. */
+static void
+compdb_note_read(
+	struct compdb_file		*ff,
+	sqlite3_file			*file,
+	unsigned int			page)
+{
+	struct compdb_rpool		*rp;
+
+	/* An xFetch miss replays the same page through xRead. */
+	if (page == ff->last_page)
+		return;
+	if (page == ff->last_page + 1)
+		ff->seq_run++;
+	else
+		ff->seq_run = 0;
+	ff->last_page = page;
+	if (ff->seq_run < COMPDB_PREFETCH_TRIGGER)
+		return;
+
+	if (!ff->rpool && !ff->rpool_tried) {
+		ff->rpool_tried = 1;
+		compdb_rpool_start(ff, file);
+	}
+	rp = ff->rpool;
+	if (!rp)
+		return;
+
+	pthread_mutex_lock(&rp->lock);
+	if (rp->next <= page || rp->next > page + 1 + rp->nr)
+		rp->next = page + 1;
+	rp->end = page + 1 + rp->nr;
+	pthread_cond_signal(&rp->todo);
+	pthread_mutex_unlock(&rp->lock);
+}
+
+/* Compress one page into buf; returns the on-disk length, 0 if it grew. */
+static int
+compdb_compress_page(
+	struct compdb_file		*ff,
+	const void			*ptr,
+	int				iAmt,
+	sqlite3_int64			iOfst,
+	char				*buf)
+{
+	struct compdb_block_head	*bhead;
+	int				ret;
+
+	ret = ff->cvfs->compressor->compress(ptr, buf + sizeof(*bhead), iAmt,
+			ff->pagesize - sizeof(*bhead));
+	if (ret == 0)
+		return 0;
+
+	/* Attach compression header. */
+	bhead = (struct compdb_block_head *)buf;
+	memcpy(bhead->magic, COMPDB_BLOCK_MAGIC, sizeof(bhead->magic));
+	bhead->len = htons(ret);
+	bhead->offset = htonl(iOfst / ff->pagesize);
+
+	return ret + sizeof(*bhead);
+}
+
+/* Write one compressed page, or the raw page if compression failed. */
+static int
+compdb_write_page(
+	struct compdb_file		*ff,
+	sqlite3_file			*file,
+	const void			*ptr,
+	const char			*cbuf,
+	int				clen,
+	int				iAmt,
+	sqlite3_int64			iOfst)
+{
+	sqlite3_int64			isize;
+	int				ret;
+
+	if (!cbuf || !clen)
+		return ff->old_write(file, ptr, iAmt, iOfst);
+
+	/*
+	 * Truncate to where the end of the compressed block should be
+	 * so that XFS won't do speculative preallocation.
+	 */
+	ret = ff->old_filesize(file, &isize);
+	if (ret)
+		return ret;
+	if (iOfst + clen > isize) {
+		ret = ff->old_truncate(file, iOfst + clen);
+		if (ret)
+			return ret;
+	}
+
+	/* Write compressed data. */
+	dbg_printf("%s(%d) len=%d off=%llu clen=%d\n", __func__, __LINE__,
+			iAmt, iOfst, clen);
+	ret = ff->old_write(file, cbuf, clen, iOfst);
+	if (ret)
+		return ff->old_write(file, ptr, iAmt, iOfst);
+
+	/*
+	 * Truncate to the end of the block to avoid short reads.
+	 */
+	ret = ff->old_filesize(file, &isize);
+	if (ret)
+		return ret;
+	if (iOfst + iAmt > isize)
+		return ff->old_truncate(file, iOfst + iAmt);
+
+	return ret;
+}
+
+/*
+ * Write-behind compression pipeline.  Compressing each page on the
+ * SQLite thread makes the mappers compression-bound with the denser
+ * engines -- e2mapper burns more time in lzma than in libext2fs.  Every
+ * page carries its own compdb_block_head, so the pages are compressed
+ * by a pool of worker threads and the finished pages are written back
+ * in submission order.  Reads are satisfied from the queue until a page
+ * is retired, and anything that needs a coherent file (xSync,
+ * xFileSize, xTruncate, raw page writes) drains the queue first.
+ */
+#define COMPDB_WPOOL_MAX_QUEUE	256
+
+enum wreq_state {
+	WREQ_TODO = 0,
+	WREQ_RUNNING,
+	WREQ_DONE,
+	WREQ_RETIRING,
+};
+
+struct compdb_wreq {
+	struct compdb_wreq		*next;
+	sqlite3_int64			offset;
+	int				len;
+	enum wreq_state			state;
+	int				clen;
+	int				data_pooled;	/* data from bufpool */
+	char				*data;		/* raw page */
+	char				*cdata;		/* compressed page */
+};
+
+struct compdb_wpool {
+	pthread_mutex_t			lock;
+	pthread_cond_t			todo;		/* work queued */
+	pthread_cond_t			retired;	/* page written */
+	struct compdb_wreq		*head;
+	struct compdb_wreq		*tail;
+	struct compdb_wreq		*free_reqs;	/* retired, reusable */
+	struct compdb_file		*ff;
+	sqlite3_file			*file;
+	pthread_t			*threads;
+	int				nr_threads;
+	int				nr_queued;
+	int				retiring;
+	int				exit;
+	int				err;
+};
+
+/* Write out finished pages, oldest first. */
+static void
+compdb_wpool_retire(
+	struct compdb_wpool		*wp)
+{
+	struct compdb_wreq		*req;
+	int				ret;
+
+	while (wp->head && wp->head->state == WREQ_DONE && !wp->retiring) {
+		/*
+		 * Leave the request on the queue while the write is in
+		 * flight so that a concurrent read of this page is
+		 * satisfied from the queue and not from the stale
+		 * on-disk contents; unlink it only once the write lands.
+		 */
+		req = wp->head;
+		req->state = WREQ_RETIRING;
+		wp->retiring = 1;
+		pthread_mutex_unlock(&wp->lock);
+
+		ret = compdb_write_page(wp->ff, wp->file, req->data,
+				req->cdata, req->clen, req->len, req->offset);
+
+		/*
+		 * A prefetch racing with this write may have cached the
+		 * old on-disk contents.  Reads check the queue before the
+		 * cache, so the entry masked that copy until now; throw
+		 * it out before the request leaves the queue.
+		 */
+		pthread_mutex_lock(&wp->ff->cache_lock);
+		wp->ff->cache_epoch++;
+		compdb_cache_forget(wp->ff, req->offset / wp->ff->pagesize);
+		pthread_mutex_unlock(&wp->ff->cache_lock);
+
+		pthread_mutex_lock(&wp->lock);
+		wp->head = req->next;
+		if (!wp->head)
+			wp->tail = NULL;
+		if (req->data_pooled)
+			compdb_buf_put(wp->ff, req->data);
+		else
+			free(req->data);
+		compdb_buf_put(wp->ff, req->cdata);
+		req->next = wp->free_reqs;
+		wp->free_reqs = req;
+		wp->retiring = 0;
+		if (ret && !wp->err)
+			wp->err = ret;
+		wp->nr_queued--;
+		pthread_cond_broadcast(&wp->retired);
+	}
+}
+
+/* Compress queued pages until told to stop. */
+static void *
+compdb_wpool_thread(
+	void				*arg)
+{
+	struct compdb_wpool		*wp = arg;
+	struct compdb_wreq		*req;
+	char				*buf;
+
+	pthread_mutex_lock(&wp->lock);
+	for (;;) {
+		for (req = wp->head; req; req = req->next)
+			if (req->state == WREQ_TODO)
+				break;
+		if (!req) {
+			if (wp->exit)
+				break;
+			pthread_cond_wait(&wp->todo, &wp->lock);
+			continue;
+		}
+
+		req->state = WREQ_RUNNING;
+		pthread_mutex_unlock(&wp->lock);
+
+		buf = compdb_buf_get(wp->ff);
+		if (buf) {
+			req->clen = compdb_compress_page(wp->ff, req->data,
+					req->len, req->offset, buf);
+			req->cdata = buf;
+		} else
+			req->clen = 0;
+
+		pthread_mutex_lock(&wp->lock);
+		req->state = WREQ_DONE;
+		compdb_wpool_retire(wp);
+	}
+	pthread_mutex_unlock(&wp->lock);
+	return NULL;
+}
+
+/* Wait for every queued page to reach the disk. */
+static int
+compdb_wpool_drain(
+	struct compdb_file		*ff)
+{
+	struct compdb_wpool		*wp = ff->wpool;
+	int				err;
+
+	if (!wp)
+		return SQLITE_OK;
+
+	pthread_mutex_lock(&wp->lock);
+	while (wp->nr_queued)
+		pthread_cond_wait(&wp->retired, &wp->lock);
+	err = wp->err;
+	wp->err = 0;
+	pthread_mutex_unlock(&wp->lock);
+
+	return err;
+}
+
+/* Satisfy a page read from the write-behind queue, if we can. */
+static int
+compdb_wpool_read(
+	struct compdb_file		*ff,
+	void				*ptr,
+	int				iAmt,
+	sqlite3_int64			iOfst)
+{
+	struct compdb_wpool		*wp = ff->wpool;
+	struct compdb_wreq		*req, *found = NULL;
+
+	if (!wp)
+		return 0;
+
+	pthread_mutex_lock(&wp->lock);
+	for (req = wp->head; req; req = req->next)
+		if (req->offset == iOfst && req->len == iAmt)
+			found = req;	/* newest write wins */
+	if (found)
+		memcpy(ptr, found->data, iAmt);
+	pthread_mutex_unlock(&wp->lock);
+
+	return found != NULL;
+}
+
+/* Queue one compressible page for the workers. */
+static int
+compdb_wpool_queue(
+	struct compdb_file		*ff,
+	const void			*ptr,
+	int				iAmt,
+	sqlite3_int64			iOfst)
+{
+	struct compdb_wpool		*wp = ff->wpool;
+	struct compdb_wreq		*req;
+	int				err;
+
+	pthread_mutex_lock(&wp->lock);
+	req = wp->free_reqs;
+	if (req)
+		wp->free_reqs = req->next;
+	pthread_mutex_unlock(&wp->lock);
+	if (!req) {
+		req = calloc(1, sizeof(*req));
+		if (!req)
+			return SQLITE_NOMEM;
+	}
+	memset(req, 0, sizeof(*req));
+	if (iAmt <= ff->pagesize) {
+		req->data = compdb_buf_get(ff);
+		req->data_pooled = 1;
+	} else
+		req->data = malloc(iAmt);
+	if (!req->data) {
+		free(req);
+		return SQLITE_NOMEM;
+	}
+	memcpy(req->data, ptr, iAmt);
+	req->offset = iOfst;
+	req->len = iAmt;
+	req->state = WREQ_TODO;
+
+	pthread_mutex_lock(&wp->lock);
+	while (wp->nr_queued >= COMPDB_WPOOL_MAX_QUEUE)
+		pthread_cond_wait(&wp->retired, &wp->lock);
+	if (wp->tail)
+		wp->tail->next = req;
+	else
+		wp->head = req;
+	wp->tail = req;
+	wp->nr_queued++;
+	err = wp->err;
+	wp->err = 0;
+	pthread_cond_signal(&wp->todo);
+	pthread_mutex_unlock(&wp->lock);
+
+	return err;
+}
+
+/* Fire up the compression workers, or quietly stay synchronous. */
+static void
+compdb_wpool_start(
+	struct compdb_file		*ff,
+	sqlite3_file			*file)
+{
+	struct compdb_wpool		*wp;
+	char				*p;
+	long				nr = sysconf(_SC_NPROCESSORS_ONLN);
+	int				i;
+
+	p = getenv("COMPDB_COMPRESS_THREADS");
+	if (p)
+		nr = strtol(p, NULL, 0);
+	if (nr <= 1)
+		return;
+
+	wp = calloc(1, sizeof(*wp));
+	if (!wp)
+		return;
+	wp->threads = calloc(nr, sizeof(pthread_t));
+	if (!wp->threads) {
+		free(wp);
+		return;
+	}
+	wp->ff = ff;
+	wp->file = file;
+	pthread_mutex_init(&wp->lock, NULL);
+	pthread_cond_init(&wp->todo, NULL);
+	pthread_cond_init(&wp->retired, NULL);
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&wp->threads[i], NULL, compdb_wpool_thread,
+				wp))
+			break;
+		wp->nr_threads++;
+	}
+	if (!wp->nr_threads) {
+		pthread_cond_destroy(&wp->retired);
+		pthread_cond_destroy(&wp->todo);
+		pthread_mutex_destroy(&wp->lock);
+		free(wp->threads);
+		free(wp);
+		return;
+	}
+
+	ff->wpool = wp;
+}
+
+/* Drain the pipeline and reap the workers. */
+static int
+compdb_wpool_stop(
+	struct compdb_file		*ff)
+{
+	struct compdb_wpool		*wp = ff->wpool;
+	int				i;
+	int				err;
+
+	if (!wp)
+		return SQLITE_OK;
+
+	err = compdb_wpool_drain(ff);
+
+	pthread_mutex_lock(&wp->lock);
+	wp->exit = 1;
+	pthread_cond_broadcast(&wp->todo);
+	pthread_mutex_unlock(&wp->lock);
+	for (i = 0; i < wp->nr_threads; i++)
+		pthread_join(wp->threads[i], NULL);
+
+	while (wp->free_reqs) {
+		struct compdb_wreq	*req = wp->free_reqs;
+
+		wp->free_reqs = req->next;
+		free(req);
+	}
+	pthread_cond_destroy(&wp->retired);
+	pthread_cond_destroy(&wp->todo);
+	pthread_mutex_destroy(&wp->lock);
+	free(wp->threads);
+	free(wp);
+	ff->wpool = NULL;
+
+	return err;
+}
+
 /* Do some sort of read io. */
 static int
 compdb_read(
@@ -115,11 +924,40 @@ compdb_read(
 	ff = COMPDB_F(file);
 	assert(iOfst == 0 || ff->db_type != DB_UNKNOWN);
 
+	/* Got a decompressed copy of this page already? */
+	if (ff->db_type == DB_COMPRESSED && iAmt == ff->pagesize) {
+		struct compdb_cache_ent	*ent;
+
+		page = iOfst / ff->pagesize;
+		compdb_note_read(ff, file, page);
+
+		/* Still waiting for the compression workers? */
+		if (compdb_wpool_read(ff, ptr, iAmt, iOfst)) {
+			dbg_printf("%s(%d) len=%d off=%llu queued\n", __func__,
+					__LINE__, iAmt, iOfst);
+			return SQLITE_OK;
+		}
+
+		pthread_mutex_lock(&ff->cache_lock);
+		if (ff->cache_nr < 0)
+			compdb_cache_init(ff);
+		ent = page ? compdb_cache_lookup(ff, page) : NULL;
+		if (ent)
+			memcpy(ptr, ent->buf, iAmt);
+		pthread_mutex_unlock(&ff->cache_lock);
+		if (ent) {
+			dbg_printf("%s(%d) len=%d off=%llu cached\n", __func__,
+					__LINE__, iAmt, iOfst);
+			return SQLITE_OK;
+		}
+	}
+
 	ret = ff->old_read(file, ptr, iAmt, iOfst);
 	if (ff->db_type == DB_COMPRESSED && iOfst == 0)
 		memcpy(ptr, SQLITE_FILE_HEADER, sizeof(SQLITE_FILE_HEADER));
 	if (ret)
 		return ret;
+	compdb_count_io(&compdb_io_stats.bytes_read, iAmt);
 
 	/* We don't compress non-btree pages. */
 	bhead = ptr;
@@ -144,7 +982,7 @@ compdb_read(
 	}
 
 	/* Decompress and return. */
-	buf = malloc(ff->pagesize);
+	buf = compdb_buf_get(ff);
 	if (!buf)
 		return SQLITE_NOMEM;
 
@@ -152,14 +990,20 @@ compdb_read(
 			ff->pagesize);
 	if (ret < 0) {
 		dbg_printf("%s(%d) decompress failed\n", __func__, __LINE__);
-		free(buf);
+		compdb_buf_put(ff, buf);
 		return SQLITE_CORRUPT;
 	}
+	compdb_count_io(&compdb_io_stats.bytes_decompressed, ret);
 
 	assert(ret <= ff->pagesize);
 	memcpy(ptr, buf, ret);
 	memset(ptr + ret, 0, ff->pagesize - ret);
-	free(buf);
+	compdb_buf_put(ff, buf);
+	if (iAmt == ff->pagesize) {
+		pthread_mutex_lock(&ff->cache_lock);
+		compdb_cache_store(ff, page, ptr);
+		pthread_mutex_unlock(&ff->cache_lock);
+	}
 
 	dbg_printf("%s(%d) len=%d off=%llu clen=%d\n", __func__, __LINE__,
 				ret, iOfst, clen);
@@ -175,9 +1019,7 @@ compdb_write(
 	sqlite3_int64			iOfst)
 {
 	struct compdb_file		*ff;
-	struct compdb_block_head	*bhead;
 	char				*buf;
-	sqlite3_int64			isize;
 	unsigned int			page;
 	int				clen;
 	int				ret;
@@ -193,77 +1035,206 @@ compdb_write(
 		assert(ff->db_type != DB_UNKNOWN);
 	}
 
+	/* Whatever we cached for this page is stale now. */
+	if (ff->db_type == DB_COMPRESSED) {
+		pthread_mutex_lock(&ff->cache_lock);
+		ff->cache_epoch++;
+		compdb_cache_forget(ff, iOfst / ff->pagesize);
+		pthread_mutex_unlock(&ff->cache_lock);
+	}
+
 	/* We don't compress non-btree pages. */
 	page = iOfst / ff->pagesize;
 	if (ff->db_type == DB_REGULAR || page == 0 ||
 	    (page >= ff->freestart && page < ff->freestart + ff->freelen))
 		goto no_compr;
 
+	/* Hand compressible pages to the worker pool. */
+	if (!ff->wpool && !ff->wpool_tried) {
+		ff->wpool_tried = 1;
+		compdb_wpool_start(ff, file);
+	}
+	if (ff->wpool) {
+		ret = compdb_wpool_queue(ff, ptr, iAmt, iOfst);
+		if (ret != SQLITE_NOMEM)
+			return ret;
+		/* Can't queue it; fall back to compressing it here. */
+	}
+
 	/* Try to compress data. */
-	buf = malloc(ff->pagesize);
+	buf = compdb_buf_get(ff);
 	if (!buf)
 		return SQLITE_NOMEM;
 
-	ret = ff->cvfs->compressor->compress(ptr, buf + sizeof(*bhead), iAmt,
-			ff->pagesize - sizeof(*bhead));
-	if (ret == 0) {
-		free(buf);
+	clen = compdb_compress_page(ff, ptr, iAmt, iOfst, buf);
+	if (clen == 0) {
+		compdb_buf_put(ff, buf);
 		goto no_compr;
 	}
-	clen = ret + sizeof(*bhead);
 
-	/* Attach compression header. */
-	bhead = (struct compdb_block_head *)buf;
-	memcpy(bhead->magic, COMPDB_BLOCK_MAGIC, sizeof(bhead->magic));
-	bhead->len = htons(ret);
-	bhead->offset = htonl(iOfst / ff->pagesize);
+	ret = compdb_write_page(ff, file, ptr, buf, clen, iAmt, iOfst);
+	compdb_buf_put(ff, buf);
+	return ret;
 
+no_compr:
 	/*
-	 * Truncate to where the end of the compressed block should be
-	 * so that XFS won't do speculative preallocation.
+	 * Compression fails, just write it straight -- but not around the
+	 * pipeline, in case a queued page just became uncompressible.
 	 */
-	ret = file->pMethods->xFileSize(file, &isize);
+	ret = compdb_wpool_drain(ff);
 	if (ret)
 		return ret;
-	if (iOfst + clen > isize) {
-		ret = file->pMethods->xTruncate(file, iOfst + clen);
-		if (ret)
-			return ret;
+	dbg_printf("%s(%d) len=%d off=%llu\n", __func__, __LINE__,
+			iAmt, iOfst);
+	ret = ff->old_write(file, ptr, iAmt, iOfst);
+	if (ret || iOfst != 0 || ff->db_type == DB_REGULAR)
+		return ret;
+
+	/* Make sure we write out the compressed magic. */
+	return ff->old_write(file, ff->cvfs->compdb_file_header,
+			sizeof(ff->cvfs->compdb_file_header), 0);
+}
+
+/*
+ * Hand SQLite a page without copying it.  Regular databases forward to
+ * the underlying VFS's real mmap; compressed databases lend out the
+ * cached decompressed buffer, pinned so the LRU can't recycle it while
+ * SQLite holds the pointer.  Returning a null pointer just makes SQLite
+ * fall back to xRead, which fills the cache for the next fetch.
+ */
+static int
+compdb_fetch(
+	sqlite3_file		*file,
+	sqlite3_int64		iOfst,
+	int			iAmt,
+	void			**pp)
+{
+	struct compdb_file	*ff = COMPDB_F(file);
+	struct compdb_cache_ent	*ent;
+	unsigned int		page;
+
+	*pp = NULL;
+	if (ff->db_type == DB_REGULAR)
+		return ff->old_fetch(file, iOfst, iAmt, pp);
+	if (ff->db_type != DB_COMPRESSED || iAmt != ff->pagesize)
+		return SQLITE_OK;
+
+	page = iOfst / ff->pagesize;
+	compdb_note_read(ff, file, page);
+
+	pthread_mutex_lock(&ff->cache_lock);
+	if (ff->cache_nr < 0)
+		compdb_cache_init(ff);
+	ent = page ? compdb_cache_lookup(ff, page) : NULL;
+	if (ent) {
+		ent->pinned++;
+		*pp = ent->buf;
 	}
+	pthread_mutex_unlock(&ff->cache_lock);
+	if (!ent)
+		return SQLITE_OK;
 
-	/* Write compressed data. */
-	dbg_printf("%s(%d) len=%d off=%llu clen=%d\n", __func__, __LINE__,
-			iAmt, iOfst, clen);
-	ret = ff->old_write(file, buf, clen, iOfst);
-	free(buf);
+	dbg_printf("%s(%d) len=%d off=%llu pinned\n", __func__, __LINE__,
+			iAmt, iOfst);
+	return SQLITE_OK;
+}
+
+/* Release a fetched page; a null pointer releases everything. */
+static int
+compdb_unfetch(
+	sqlite3_file		*file,
+	sqlite3_int64		iOfst,
+	void			*p)
+{
+	struct compdb_file	*ff = COMPDB_F(file);
+	int			i;
+
+	if (ff->db_type == DB_REGULAR)
+		return ff->old_unfetch(file, iOfst, p);
+
+	pthread_mutex_lock(&ff->cache_lock);
+	if (!p) {
+		for (i = 0; i < ff->cache_nr; i++)
+			ff->cache[i].pinned = 0;
+	} else {
+		for (i = 0; i < ff->cache_nr; i++)
+			if (ff->cache[i].buf == p && ff->cache[i].pinned) {
+				ff->cache[i].pinned--;
+				break;
+			}
+	}
+	pthread_mutex_unlock(&ff->cache_lock);
+	return SQLITE_OK;
+}
+
+/* Push queued pages out before anyone looks at the file. */
+static int
+compdb_sync(
+	sqlite3_file		*file,
+	int			flags)
+{
+	struct compdb_file	*ff = COMPDB_F(file);
+	int			ret;
+
+	ret = compdb_wpool_drain(ff);
 	if (ret)
-		goto no_compr;
+		return ret;
+	return ff->old_sync(file, flags);
+}
 
-	/*
-	 * Truncate to the end of the block to avoid short reads.
-	 */
-	ret = file->pMethods->xFileSize(file, &isize);
+static int
+compdb_truncate(
+	sqlite3_file		*file,
+	sqlite3_int64		size)
+{
+	struct compdb_file	*ff = COMPDB_F(file);
+	int			ret;
+
+	ret = compdb_wpool_drain(ff);
 	if (ret)
 		return ret;
-	if (iOfst + iAmt > isize) {
-		ret = file->pMethods->xTruncate(file, iOfst + iAmt);
-		if (ret)
-			return ret;
-	}
+	return ff->old_truncate(file, size);
+}
 
-	return ret;
+static int
+compdb_filesize(
+	sqlite3_file		*file,
+	sqlite3_int64		*pSize)
+{
+	struct compdb_file	*ff = COMPDB_F(file);
+	int			ret;
 
-no_compr:
-	/* Compression fails, just write it straight. */
-	dbg_printf("%s(%d) len=%d off=%llu\n", __func__, __LINE__,
-			iAmt, iOfst);
-	ret = ff->old_write(file, ptr, iAmt, iOfst);
-	if (ret || iOfst != 0 || ff->db_type == DB_REGULAR)
+	ret = compdb_wpool_drain(ff);
+	if (ret)
 		return ret;
+	return ff->old_filesize(file, pSize);
+}
 
-	/* Make sure we write out the compressed magic. */
-	return ff->old_write(file, ff->cvfs->compdb_file_header,
-			sizeof(ff->cvfs->compdb_file_header), 0);
+/* Close the file and release the page cache. */
+static int
+compdb_close(
+	sqlite3_file		*file)
+{
+	struct compdb_file	*ff = COMPDB_F(file);
+	int			ret;
+
+	compdb_rpool_stop(ff);
+	ret = compdb_wpool_stop(ff);
+	if (ret) {
+		ff->old_close(file);
+		return ret;
+	}
+
+	pthread_mutex_destroy(&ff->cache_lock);
+	free(ff->cache);
+	free(ff->cache_slab);
+	ff->cache = NULL;
+	ff->cache_slab = NULL;
+	ff->cache_nr = -1;
+	pthread_mutex_destroy(&ff->buf_lock);
+	while (ff->nr_bufs)
+		free(ff->bufpool[--ff->nr_bufs]);
+	return ff->old_close(file);
 }
 
 /*
@@ -298,9 +1269,37 @@ compdb_open(
 	ff->methods = *(file->pMethods);
 	ff->methods.xRead = compdb_read;
 	ff->methods.xWrite = compdb_write;
+	ff->methods.xClose = compdb_close;
+	ff->methods.xSync = compdb_sync;
+	ff->methods.xTruncate = compdb_truncate;
+	ff->methods.xFileSize = compdb_filesize;
 	ff->old_read = file->pMethods->xRead;
 	ff->old_write = file->pMethods->xWrite;
+	ff->old_close = file->pMethods->xClose;
+	ff->old_sync = file->pMethods->xSync;
+	ff->old_truncate = file->pMethods->xTruncate;
+	ff->old_filesize = file->pMethods->xFileSize;
+	if (ff->methods.iVersion >= 3 && file->pMethods->xFetch) {
+		ff->old_fetch = file->pMethods->xFetch;
+		ff->old_unfetch = file->pMethods->xUnfetch;
+		ff->methods.xFetch = compdb_fetch;
+		ff->methods.xUnfetch = compdb_unfetch;
+	}
 	ff->db_type = DB_UNKNOWN;
+	ff->wpool = NULL;
+	ff->wpool_tried = 0;
+	ff->rpool = NULL;
+	ff->rpool_tried = 0;
+	ff->last_page = 0;
+	ff->seq_run = 0;
+	pthread_mutex_init(&ff->cache_lock, NULL);
+	ff->cache = NULL;
+	ff->cache_slab = NULL;
+	ff->cache_nr = -1;
+	ff->cache_clock = 0;
+	ff->cache_epoch = 0;
+	pthread_mutex_init(&ff->buf_lock, NULL);
+	ff->nr_bufs = 0;
 	file->pMethods = &ff->methods;
 
 	/* Read the header so we know a few things. */
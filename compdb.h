@@ -56,4 +56,11 @@ struct sqlite3_super {
 int compdb_register(const char *under_vfs, const char *vfs_name,
 		const char *compressor);
 
+/* Aggregate I/O counters for every file opened through the shim. */
+struct compdb_stats {
+	unsigned long long	bytes_read;
+	unsigned long long	bytes_decompressed;
+};
+void compdb_get_stats(struct compdb_stats *stats);
+
 #endif /* COMPDB_H */
@@ -26,6 +26,7 @@ struct e2map_t {
 	ext2_ino_t ino;
 	struct ext2fs_extent last;
 	int type;
+	int dir_rescan;
 };
 #define wf_db			base.db
 #define wf_db_err		base.db_err
@@ -189,6 +190,336 @@ do {									       \
 		(timespec)->tv_nsec = 0;				       \
 } while (0)
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <fcntl.h>
+
+/*
+ * io_uring block I/O manager.  libext2fs's unix_io issues one
+ * synchronous read at a time, so the scan serializes on I/O latency and
+ * the disk array never sees any queue depth.  This manager stacks on
+ * top of unix_io: ordinary reads and writes pass straight through, but
+ * callers can queue readahead into a pool of preallocated buffers via
+ * ouring_prefetch(), and later reads of those blocks are satisfied from
+ * the pool without touching the disk again.  If the ring can't be set
+ * up, everything quietly passes through.
+ */
+#define OURING_QD		64
+#define OURING_BUF_SIZE		65536
+
+enum ouring_slot_state {
+	OURING_FREE = 0,
+	OURING_INFLIGHT,
+	OURING_FILLED,
+};
+
+struct ouring_slot {
+	unsigned long long	block;
+	int			count;
+	enum ouring_slot_state	state;
+	int			stale;	/* overlapped by a write */
+	char			*buf;
+};
+
+struct ouring_private {
+	io_channel		real;	/* unix_io handles the misses */
+	struct io_uring		ring;
+	struct ouring_slot	slots[OURING_QD];
+	char			*slab;
+	int			fd;
+	int			ring_up;
+};
+
+static struct struct_io_manager struct_ouring_manager;
+static io_manager ouring_manager = &struct_ouring_manager;
+
+/* Collect finished readaheads without blocking. */
+static void ouring_harvest(struct ouring_private *pv)
+{
+	struct io_uring_cqe *cqe;
+	struct ouring_slot *s;
+
+	while (io_uring_peek_cqe(&pv->ring, &cqe) == 0) {
+		s = &pv->slots[(uintptr_t)io_uring_cqe_get_data(cqe)];
+		if (!s->stale && cqe->res ==
+		    s->count * (int)pv->real->block_size)
+			s->state = OURING_FILLED;
+		else
+			s->state = OURING_FREE;
+		s->stale = 0;
+		io_uring_cqe_seen(&pv->ring, cqe);
+	}
+}
+
+/* Find a filled slot covering exactly this read. */
+static struct ouring_slot *ouring_find(struct ouring_private *pv,
+				       unsigned long long block, int count)
+{
+	int i;
+
+	for (i = 0; i < OURING_QD; i++)
+		if (pv->slots[i].state == OURING_FILLED &&
+		    pv->slots[i].block == block && pv->slots[i].count == count)
+			return &pv->slots[i];
+	return NULL;
+}
+
+/* Queue readahead for @count blocks at @block. */
+static void ouring_prefetch(io_channel channel, unsigned long long block,
+			    int count)
+{
+	struct ouring_private *pv;
+	struct io_uring_sqe *sqe;
+	struct ouring_slot *s;
+	size_t size;
+	int i;
+
+	if (channel->manager != ouring_manager)
+		return;
+	pv = channel->private_data;
+	if (!pv->ring_up || count <= 0)
+		return;
+	size = (size_t)count * pv->real->block_size;
+	if (size > OURING_BUF_SIZE)
+		return;
+
+	ouring_harvest(pv);
+
+	/* Already here or on the way? */
+	s = NULL;
+	for (i = 0; i < OURING_QD; i++) {
+		if (pv->slots[i].state != OURING_FREE) {
+			if (pv->slots[i].block == block &&
+			    pv->slots[i].count == count)
+				return;
+			continue;
+		}
+		if (!s)
+			s = &pv->slots[i];
+	}
+	if (!s)
+		return;	/* ring full; the regular read path copes */
+
+	sqe = io_uring_get_sqe(&pv->ring);
+	if (!sqe)
+		return;
+	io_uring_prep_read(sqe, pv->fd, s->buf, size,
+			   block * (unsigned long long)pv->real->block_size);
+	io_uring_sqe_set_data(sqe, (void *)(uintptr_t)(s - pv->slots));
+	s->block = block;
+	s->count = count;
+	s->stale = 0;
+	s->state = OURING_INFLIGHT;
+	io_uring_submit(&pv->ring);
+}
+
+static errcode_t ouring_read_blk64(io_channel channel,
+				   unsigned long long block, int count,
+				   void *data)
+{
+	struct ouring_private *pv = channel->private_data;
+	struct ouring_slot *s;
+
+	if (pv->ring_up && count > 0) {
+		ouring_harvest(pv);
+		s = ouring_find(pv, block, count);
+		if (s) {
+			memcpy(data, s->buf,
+			       (size_t)count * pv->real->block_size);
+			s->state = OURING_FREE;
+			return 0;
+		}
+	}
+	return io_channel_read_blk64(pv->real, block, count, data);
+}
+
+static errcode_t ouring_read_blk(io_channel channel, unsigned long block,
+				 int count, void *data)
+{
+	return ouring_read_blk64(channel, block, count, data);
+}
+
+static errcode_t ouring_write_blk64(io_channel channel,
+				    unsigned long long block, int count,
+				    const void *data)
+{
+	struct ouring_private *pv = channel->private_data;
+	int i;
+
+	/* Anything we've prefetched around a write is suspect. */
+	for (i = 0; i < OURING_QD; i++) {
+		if (pv->slots[i].state == OURING_FILLED)
+			pv->slots[i].state = OURING_FREE;
+		else if (pv->slots[i].state == OURING_INFLIGHT)
+			pv->slots[i].stale = 1;
+	}
+	return io_channel_write_blk64(pv->real, block, count, data);
+}
+
+static errcode_t ouring_write_blk(io_channel channel, unsigned long block,
+				  int count, const void *data)
+{
+	return ouring_write_blk64(channel, block, count, data);
+}
+
+static errcode_t ouring_set_blksize(io_channel channel, int blksize)
+{
+	struct ouring_private *pv = channel->private_data;
+	errcode_t err;
+	int i;
+
+	err = pv->real->manager->set_blksize(pv->real, blksize);
+	if (err)
+		return err;
+	channel->block_size = blksize;
+	for (i = 0; i < OURING_QD; i++)
+		if (pv->slots[i].state == OURING_FILLED)
+			pv->slots[i].state = OURING_FREE;
+		else if (pv->slots[i].state == OURING_INFLIGHT)
+			pv->slots[i].stale = 1;
+	return 0;
+}
+
+static errcode_t ouring_flush(io_channel channel)
+{
+	struct ouring_private *pv = channel->private_data;
+
+	return pv->real->manager->flush(pv->real);
+}
+
+static errcode_t ouring_write_byte(io_channel channel, unsigned long offset,
+				   int size, const void *data)
+{
+	struct ouring_private *pv = channel->private_data;
+
+	if (!pv->real->manager->write_byte)
+		return EXT2_ET_UNIMPLEMENTED;
+	return pv->real->manager->write_byte(pv->real, offset, size, data);
+}
+
+static errcode_t ouring_set_option(io_channel channel, const char *option,
+				   const char *arg)
+{
+	struct ouring_private *pv = channel->private_data;
+
+	if (!pv->real->manager->set_option)
+		return EXT2_ET_INVALID_ARGUMENT;
+	return pv->real->manager->set_option(pv->real, option, arg);
+}
+
+static errcode_t ouring_get_stats(io_channel channel, io_stats *stats)
+{
+	struct ouring_private *pv = channel->private_data;
+
+	if (!pv->real->manager->get_stats)
+		return EXT2_ET_INVALID_ARGUMENT;
+	return pv->real->manager->get_stats(pv->real, stats);
+}
+
+static errcode_t ouring_close(io_channel channel)
+{
+	struct ouring_private *pv = channel->private_data;
+	errcode_t err = 0;
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	if (pv->ring_up) {
+		struct io_uring_cqe *cqe;
+		int i, busy;
+
+		/* Wait out any readahead still in flight. */
+		do {
+			ouring_harvest(pv);
+			busy = 0;
+			for (i = 0; i < OURING_QD; i++)
+				if (pv->slots[i].state == OURING_INFLIGHT)
+					busy = 1;
+			if (busy && io_uring_wait_cqe(&pv->ring, &cqe))
+				break;
+		} while (busy);
+		io_uring_queue_exit(&pv->ring);
+	}
+	if (pv->fd >= 0)
+		close(pv->fd);
+	free(pv->slab);
+	if (pv->real)
+		err = io_channel_close(pv->real);
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return err;
+}
+
+static errcode_t ouring_open(const char *name, int flags, io_channel *channel)
+{
+	struct ouring_private *pv;
+	io_channel io = NULL;
+	errcode_t err;
+	int i;
+
+	err = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+	if (err)
+		return err;
+	err = ext2fs_get_memzero(sizeof(*pv), &pv);
+	if (err)
+		goto fail;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	io->manager = ouring_manager;
+	io->private_data = pv;
+	io->refcount = 1;
+	pv->fd = -1;
+	err = ext2fs_get_mem(strlen(name) + 1, &io->name);
+	if (err)
+		goto fail;
+	strcpy(io->name, name);
+
+	err = unix_io_manager->open(name, flags, &pv->real);
+	if (err)
+		goto fail;
+	io->block_size = pv->real->block_size;
+
+	/* The unix_io fd is private, so open our own for readahead. */
+	pv->fd = open(name, O_RDONLY);
+	if (pv->fd >= 0 &&
+	    posix_memalign((void **)&pv->slab, 4096,
+			   OURING_QD * (size_t)OURING_BUF_SIZE) == 0 &&
+	    io_uring_queue_init(OURING_QD, &pv->ring, 0) == 0) {
+		for (i = 0; i < OURING_QD; i++)
+			pv->slots[i].buf = pv->slab + i * OURING_BUF_SIZE;
+		pv->ring_up = 1;
+	}
+
+	*channel = io;
+	return 0;
+fail:
+	if (io && io->name)
+		ext2fs_free_mem(&io->name);
+	if (pv)
+		ext2fs_free_mem(&pv);
+	if (io)
+		ext2fs_free_mem(&io);
+	return err;
+}
+
+static struct struct_io_manager struct_ouring_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "io_uring I/O Manager",
+	.open		= ouring_open,
+	.close		= ouring_close,
+	.set_blksize	= ouring_set_blksize,
+	.read_blk	= ouring_read_blk,
+	.write_blk	= ouring_write_blk,
+	.flush		= ouring_flush,
+	.write_byte	= ouring_write_byte,
+	.set_option	= ouring_set_option,
+	.get_stats	= ouring_get_stats,
+	.read_blk64	= ouring_read_blk64,
+	.write_blk64	= ouring_write_blk64,
+};
+#endif /* HAVE_LIBURING */
+
 /* Figure out the physical offset of an inode. */
 static uint64_t inode_offset(ext2_filsys fs, ext2_ino_t ino)
 {
@@ -480,6 +811,26 @@ out:
 	return;
 }
 
+#ifdef HAVE_LIBURING
+/*
+ * Queue readahead for a child's inode table block so it's already in
+ * the pool by the time walk_fs_helper() gets around to parsing it.
+ */
+static int prefetch_dirent_helper(ext2_ino_t dir, int entry,
+				  struct ext2_dir_entry *dirent, int offset,
+				  int blocksize, char *buf, void *priv_data)
+{
+	struct e2map_t *wf = priv_data;
+	ext2_filsys fs = wf->fs;
+
+	if (!dirent->inode || dirent->inode > fs->super->s_inodes_count)
+		return 0;
+	ouring_prefetch(fs->io,
+			inode_offset(fs, dirent->inode) / fs->blocksize, 1);
+	return 0;
+}
+#endif /* HAVE_LIBURING */
+
 /* Handle a directory entry */
 static int walk_fs_helper(ext2_ino_t dir, int entry,
 			  struct ext2_dir_entry *dirent, int offset,
@@ -496,6 +847,7 @@ static int walk_fs_helper(ext2_ino_t dir, int entry,
 	time_t atime, crtime, ctime, mtime;
 	time_t *pcrtime;
 	ssize_t size;
+	int rescan;
 
 	if (!strcmp(dirent->name, ".") || !strcmp(dirent->name, ".."))
 		return 0;
@@ -550,29 +902,47 @@ static int walk_fs_helper(ext2_ino_t dir, int entry,
 		snprintf(path, PATH_MAX, "%s/%s", wf->wf_dirpath, name);
 	else
 		path[0] = 0;
-	insert_inode(&wf->base, dirent->inode, type_codes[type], path, &atime,
-		     pcrtime, &ctime, &mtime, &size);
-	if (wf->wf_db_err)
-		return DIRENT_ABORT;
-	if (dir)
+
+	/* Unchanged since the last scan?  Its rows are still good. */
+	rescan = inode_needs_rescan(&wf->base, dirent->inode, ctime);
+
+	if (rescan) {
+		insert_inode(&wf->base, dirent->inode, type_codes[type], path,
+			     &atime, pcrtime, &ctime, &mtime, &size);
+		if (wf->wf_db_err)
+			return DIRENT_ABORT;
+	}
+	if (dir && wf->dir_rescan)
 		insert_dentry(&wf->base, (signed)dir, name, dirent->inode);
 	if (wf->wf_db_err)
 		return DIRENT_ABORT;
 
-	walk_file_mappings(wf, dirent->inode, type);
-	if (wf->err || wf->wf_db_err)
-		return DIRENT_ABORT;
+	if (rescan) {
+		walk_file_mappings(wf, dirent->inode, type);
+		if (wf->err || wf->wf_db_err)
+			return DIRENT_ABORT;
+	}
 
+	/* Even an unchanged directory can hide changed descendants. */
 	if (type == EXT2_FT_DIR) {
+		int old_rescan = wf->dir_rescan;
 		errcode_t err;
 
+#ifdef HAVE_LIBURING
+		/* Get the children's inode table blocks in flight early. */
+		ext2fs_dir_iterate2(wf->fs, dirent->inode, 0, NULL,
+				    prefetch_dirent_helper, wf);
+#endif
 		old_dirpath = wf->wf_dirpath;
 		wf->wf_dirpath = path;
+		wf->dir_rescan = rescan;
 		err = ext2fs_dir_iterate2(wf->fs, dirent->inode, 0, NULL,
 					  walk_fs_helper, wf);
 		if (!wf->err)
 			wf->err = err;
 		wf->wf_dirpath = old_dirpath;
+		wf->dir_rescan = old_rescan;
+		checkpoint_db(&wf->base, -1);
 	}
 	if (wf->err || wf->wf_db_err)
 		return DIRENT_ABORT;
@@ -587,6 +957,7 @@ static void walk_fs(struct e2map_t *wf)
 	struct ext2_dir_entry dirent;
 
 	wf->wf_dirpath = "";
+	wf->dir_rescan = 1;
 
 	dirent.inode = EXT2_ROOT_INO;
 	ext2fs_set_rec_len(fs, EXT2_DIR_REC_LEN(1), &dirent);
@@ -604,6 +975,7 @@ walk_unlinked_inode_chain(struct e2map_t *wf, ext2_ino_t ino)
 	struct ext2_inode inode;
 
 	wf->wf_dirpath = "/" STR_METADATA_DIR "/" STR_UNLINKED_DIR;
+	wf->dir_rescan = 1;
 	while (ino != 0) {
 		snprintf(dirent.name, EXT2_NAME_LEN, "%u", ino);
 
@@ -638,38 +1010,57 @@ walk_unlinked_inode_chain(struct e2map_t *wf, ext2_ino_t ino)
 	INJECT_METADATA(INO_GROUPS_DIR, "/" STR_METADATA_DIR "/" STR_GROUPS_DIR, (ino), (path), (type))
 
 /* Insert extents for a file, given a bitmap */
+#define WALK_BITMAP_LEN		8192	/* bytes of bitmap per chunk */
 static void walk_bitmap(struct e2map_t *wf, int64_t ino, ext2fs_block_bitmap bm)
 {
-	blk64_t start, end, out = 0, loff = 0;
-
-	start = 0;
-	end = ext2fs_blocks_count(wf->fs->super) - 1;
-
-	wf->err = ext2fs_find_first_set_block_bitmap2(bm, start, end, &out);
-	while (wf->err == 0) {
-		start = out;
-		wf->err = ext2fs_find_first_zero_block_bitmap2(bm, start,
-							       end, &out);
-		if (wf->err == ENOENT) {
-			out = end;
-			wf->err = 0;
-		} else if (wf->err)
-			break;
-
-		insert_extent(&wf->base, ino, start * wf->fs->blocksize,
-			      NULL, (out - start) * wf->fs->blocksize,
-			      EXTENT_SHARED, extent_codes[EXT2_XT_METADATA]);
+	uint8_t buf[WALK_BITMAP_LEN];
+	blk64_t base, end, nr;
+	int64_t start = -1;
+	uint64_t bit;
+
+	base = ext2fs_get_block_bitmap_start2(bm);
+	end = ext2fs_get_block_bitmap_end2(bm);
+
+	/*
+	 * Copy the bitmap out in chunks and scan them a word at a time;
+	 * a libext2fs call per run boundary is far too slow on a big
+	 * filesystem.
+	 */
+	for (; base <= end; base += nr) {
+		nr = end - base + 1;
+		if (nr > WALK_BITMAP_LEN * 8)
+			nr = WALK_BITMAP_LEN * 8;
+		wf->err = ext2fs_get_block_bitmap_range2(bm, base, nr, buf);
+		if (wf->err)
+			return;
+
+		bit = 0;
+		while (bit < nr) {
+			if (start < 0) {
+				bit = fm_find_next_bit(buf, nr, bit);
+				if (bit == nr)
+					break;
+				start = base + bit;
+			}
+			bit = fm_find_next_zero_bit(buf, nr, bit);
+			if (bit == nr)
+				break;
 
-		if (wf->wf_db_err)
-			break;
-		start = out;
-		loff += (out - start) * wf->fs->blocksize;
-		wf->err = ext2fs_find_first_set_block_bitmap2(bm, start,
-				end, &out);
+			insert_extent(&wf->base, ino,
+				      start * wf->fs->blocksize, NULL,
+				      (base + bit - start) * wf->fs->blocksize,
+				      EXTENT_SHARED,
+				      extent_codes[EXT2_XT_METADATA]);
+			if (wf->wf_db_err)
+				return;
+			start = -1;
+		}
 	}
 
-	if (wf->err == ENOENT)
-		wf->err = 0;
+	if (start >= 0)
+		insert_extent(&wf->base, ino, start * wf->fs->blocksize, NULL,
+			      (end + 1 - start) * wf->fs->blocksize,
+			      EXTENT_SHARED, extent_codes[EXT2_XT_METADATA]);
 }
 
 /* Invent a FS tree for metadata. */
@@ -861,6 +1252,8 @@ static void walk_metadata(struct e2map_t *wf)
 		if (wf->wf_db_err)
 			goto out;
 		ino--;
+
+		checkpoint_db(&wf->base, group);
 	}
 
 	/* Unlinked inodes. */
@@ -947,27 +1340,64 @@ int main(int argc, char *argv[])
 	int db_err = 0;
 	errcode_t err = 0, err2;
 	uint64_t total_bytes;
-
-	if (argc != 3) {
-		printf("Usage: %s dbfile fsdevice\n", argv[0]);
+	int incremental = 0;
+	int resume = 0;
+	int spill = 0;
+	int optimize = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "iORS")) != -1) {
+		switch (opt) {
+		case 'i':
+			incremental = 1;
+			break;
+		case 'O':
+			optimize = 1;
+			break;
+		case 'R':
+			resume = 1;
+			break;
+		case 'S':
+			spill = 1;
+			break;
+		default:
+			printf("Usage: %s [-iORS] dbfile fsdevice\n", argv[0]);
+			return 0;
+		}
+	}
+	if (argc - optind != 2) {
+		printf("Usage: %s [-iORS] dbfile fsdevice\n", argv[0]);
 		return 0;
 	}
 
+	/* Spilled insertions never clear old rows, so full scans only. */
+	if (spill && (incremental || resume)) {
+		printf("Disabling spill files for incremental scans.\n");
+		spill = 0;
+	}
+
 	add_error_table(&et_ext2_error_table);
 
 	/* Open things */
 	memset(&wf, 0, sizeof(wf));
-	dbfile = argv[1];
-	fsdev = argv[2];
+	dbfile = argv[optind];
+	fsdev = argv[optind + 1];
 
-	db_err = truncate(dbfile, 0);
-	if (db_err && errno != ENOENT) {
-		com_err(fsdev, errno, "while truncating database.");
-		goto out;
+	if (!incremental && !resume) {
+		db_err = truncate(dbfile, 0);
+		if (db_err && errno != ENOENT) {
+			com_err(fsdev, errno, "while truncating database.");
+			goto out;
+		}
 	}
 
+#ifdef HAVE_LIBURING
+	err = ext2fs_open2(fsdev, NULL, EXT2_FLAG_64BITS | EXT2_FLAG_SKIP_MMP,
+			   0, 0, ouring_manager, &fs);
+#else
 	err = ext2fs_open2(fsdev, NULL, EXT2_FLAG_64BITS | EXT2_FLAG_SKIP_MMP,
 			   0, 0, unix_io_manager, &fs);
+#endif
 	if (err) {
 		com_err(fsdev, err, "while opening filesystem.");
 		goto out;
@@ -997,8 +1427,26 @@ int main(int argc, char *argv[])
 	wf.fs = fs;
 
 	/* Prepare and clean out database. */
-	prepare_db(&wf.base);
+	if (resume && prepare_db_resume(&wf.base)) {
+		com_err(dbfile, 0, "no checkpoint to resume; doing a full scan");
+		resume = 0;
+	}
+	if (!resume && incremental && prepare_db_incremental(&wf.base)) {
+		com_err(dbfile, 0, "no usable previous scan; doing a full scan");
+		incremental = 0;
+	}
+	if (!resume && !incremental)
+		prepare_db(&wf.base);
 	CHECK_ERROR("while preparing database");
+	/*
+	 * A checkpoint can only cover rows that made it to the database,
+	 * which in spill mode is none of them until the load phase.
+	 */
+	if (spill)
+		fm_spill_start(&wf.base, dbfile);
+	else
+		enable_checkpoints(&wf.base);
+	CHECK_ERROR("while enabling scan checkpoints");
 	wf.wf_db_err = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, &errm);
 	if (errm) {
 		com_err(dbfile, 0, "%s while starting transaction", errm);
@@ -1019,12 +1467,24 @@ int main(int argc, char *argv[])
 	/* Walk the filesystem */
 	wf.err = ext2fs_allocate_inode_bitmap(fs, "visited inodes", &wf.iseen);
 	CHECK_ERROR("while allocating scanned inode bitmap");
+	fm_writer_start(&wf.base);
+	CHECK_ERROR("while starting database writer");
+	fm_phase_start(&wf.base, "walk_fs");
 	walk_fs(&wf);
+	fm_phase_stop(&wf.base, "walk_fs");
 	CHECK_ERROR("while analyzing filesystem");
 
 	/* Walk the metadata */
+	fm_phase_start(&wf.base, "walk_metadata");
 	walk_metadata(&wf);
+	fm_phase_stop(&wf.base, "walk_metadata");
 	CHECK_ERROR("while analyzing metadata");
+	fm_writer_stop(&wf.base);
+	CHECK_ERROR("while draining database writer");
+	fm_spill_load(&wf.base);
+	CHECK_ERROR("while bulk-loading spilled records");
+	prune_db(&wf.base);
+	CHECK_ERROR("while pruning deleted inodes");
 
 	/* Generate indexes and finalize. */
 	index_db(&wf.base);
@@ -1033,6 +1493,10 @@ int main(int argc, char *argv[])
 	CHECK_ERROR("while finalizing database");
 	calc_inode_stats(&wf.base);
 	CHECK_ERROR("while calculating inode statistics");
+	if (optimize) {
+		optimize_db(&wf.base);
+		CHECK_ERROR("while optimizing database for queries");
+	}
 
 	wf.wf_db_err = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &errm);
 	if (errm) {
@@ -1050,11 +1514,9 @@ int main(int argc, char *argv[])
 	}
 	CHECK_ERROR("while starting overview cache database transaction");
 
-	/* Cache overviews. */
-	cache_overview(&wf.base, 2048);
-	CHECK_ERROR("while caching CLI overview");
+	/* Cache overviews at every zoom level. */
 	cache_overview(&wf.base, 65536);
-	CHECK_ERROR("while caching GUI overview");
+	CHECK_ERROR("while caching overviews");
 	wf.wf_db_err = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &errm);
 	if (errm) {
 		com_err(dbfile, 0, "%s while ending transaction", errm);
@@ -1069,6 +1531,7 @@ out:
 	if (wf.wf_iconv)
 		iconv_close(wf.wf_iconv);
 
+	cleanup_db(&wf.base);
 	err2 = sqlite3_close(db);
 	if (err2)
 		com_err(dbfile, 0, "%s while closing database",
@@ -73,6 +73,46 @@ static DOS_FILE *root;
 
 typedef int (*walk_file_fn)(DOS_FS *fs, DOS_FILE *file, FDSC **cp, void *private);
 
+/*
+ * Flat in-memory copy of the FAT.  read_fat() already slurps the raw
+ * table, but every next_cluster() call re-decodes a 12/16/32-bit entry
+ * through get_fat(), and following the chains of a fragmented archive
+ * volume means hundreds of millions of those dependent lookups.  Decode
+ * the whole table into next-cluster pointers once so chain walking is a
+ * single array index per hop.
+ */
+static uint32_t *flat_fat;
+static uint32_t flat_fat_entries;
+
+static void load_flat_fat(DOS_FS *fs)
+{
+	uint32_t i;
+
+	flat_fat_entries = fs->clusters + 2;
+	flat_fat = malloc((uint64_t)flat_fat_entries * sizeof(*flat_fat));
+	if (!flat_fat) {
+		flat_fat_entries = 0;
+		return;	/* fall back to next_cluster() */
+	}
+	flat_fat[0] = flat_fat[1] = -1;
+	for (i = 2; i < flat_fat_entries; i++)
+		flat_fat[i] = next_cluster(fs, i);
+}
+
+static void free_flat_fat(void)
+{
+	free(flat_fat);
+	flat_fat = NULL;
+	flat_fat_entries = 0;
+}
+
+static inline uint32_t fat_next(DOS_FS *fs, uint32_t clus)
+{
+	if (clus < flat_fat_entries)
+		return flat_fat[clus];
+	return next_cluster(fs, clus);
+}
+
 /* Walk a file's mappings for extents */
 static void walk_file_mappings(struct fatmap_t *wf, DOS_FILE *file)
 {
@@ -93,7 +133,7 @@ static void walk_file_mappings(struct fatmap_t *wf, DOS_FILE *file)
 	len = 0;
 	for (curr = FSTART(file, fs) ? FSTART(file, fs) : -1, lcurr = 0;
 	     curr != -1;
-	     curr = next_cluster(fs, curr), lcurr++) {
+	     curr = fat_next(fs, curr), lcurr++) {
 		if (len) {
 			/* Lengthen extent */
 			if (pclus + len == curr && len + 1 <= max_extent) {
@@ -157,7 +197,7 @@ static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
 			cluster_start(fs, clu_num) + (i % fs->cluster_size), cp);
 		i += sizeof(DIR_ENT);
 		if (!(i % fs->cluster_size))
-			if ((clu_num = next_cluster(fs, clu_num)) == 0 ||
+			if ((clu_num = fat_next(fs, clu_num)) == 0 ||
 			    clu_num == -1)
 				break;
 	}
@@ -458,6 +498,7 @@ int main(int argc, char *argv[])
 	fs_open((char *)fsdev, rw);
 	read_boot(fs);
 	read_fat(fs);
+	load_flat_fat(fs);
 
 	total_bytes = (uint64_t)fs->clusters * fs->cluster_size;
 	err = compdb_register("unix-excl", "comp-unix-excl",
@@ -502,11 +543,20 @@ int main(int argc, char *argv[])
 	CHECK_ERROR("while storing fs stats");
 
 	/* Walk the filesystem */
+	fm_writer_start(&wf.base);
+	CHECK_ERROR("while starting database writer");
+	fm_phase_start(&wf.base, "walk_fs");
 	walk_fs(&wf);
+	fm_phase_stop(&wf.base, "walk_fs");
 	CHECK_ERROR("while analyzing filesystem");
 
+	fm_phase_start(&wf.base, "walk_metadata");
 	walk_metadata(&wf);
+	fm_phase_stop(&wf.base, "walk_metadata");
 	CHECK_ERROR("while walking metadata");
+	fm_writer_stop(&wf.base);
+	CHECK_ERROR("while draining database writer");
+	free_flat_fat();
 
 	/* Generate indexes and finalize. */
 	index_db(&wf.base);
@@ -532,11 +582,9 @@ int main(int argc, char *argv[])
 	}
 	CHECK_ERROR("while starting overview cache database transaction");
 
-	/* Cache overviews. */
-	cache_overview(&wf.base, 2048);
-	CHECK_ERROR("while caching CLI overview");
+	/* Cache overviews at every zoom level. */
 	cache_overview(&wf.base, 65536);
-	CHECK_ERROR("while caching GUI overview");
+	CHECK_ERROR("while caching overviews");
 	wf.wf_db_err = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &errm);
 	if (errm) {
 		pdie("%s while ending transaction", errm);
@@ -549,6 +597,7 @@ out:
 	if (wf.wf_iconv)
 		iconv_close(wf.wf_iconv);
 
+	cleanup_db(&wf.base);
 	err2 = sqlite3_close(db);
 	if (err2)
 		die("%s while closing database",
@@ -8,7 +8,11 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "filemapper.h"
+#include "compdb.h"
 
 static char *opschema = "\
 PRAGMA cache_size = 4096;\
@@ -26,12 +30,16 @@ DROP VIEW IF EXISTS dentry_t;\
 DROP VIEW IF EXISTS path_extent_v;\
 DROP VIEW IF EXISTS path_inode_v;\
 DROP TABLE IF EXISTS overview_t;\
+DROP TABLE IF EXISTS overview_base_t;\
 DROP TABLE IF EXISTS dentry_t;\
 DROP TABLE IF EXISTS extent_t;\
 DROP TABLE IF EXISTS inode_t;\
-DROP TABLE IF EXISTS path_t;\
+DROP TABLE IF EXISTS pathname_t;\
+DROP TABLE IF EXISTS prefix_t;\
 DROP TABLE IF EXISTS dir_t;\
 DROP TABLE IF EXISTS fs_t;\
+DROP TABLE IF EXISTS checkpoint_t;\
+CREATE TABLE checkpoint_t(timestamp INTEGER NOT NULL, group_nr INTEGER NOT NULL);\
 CREATE TABLE fs_t(path TEXT PRIMARY KEY NOT NULL, block_size INTEGER NOT NULL, frag_size INTEGER NOT NULL, total_bytes INTEGER NOT NULL, free_bytes INTEGER NOT NULL, avail_bytes INTEGER NOT NULL, total_inodes INTEGER NOT NULL, free_inodes INTEGER NOT NULL, avail_inodes INTEGER NOT NULL, max_len INTEGER NOT NULL, timestamp INTEGER NOT NULL, finished INTEGER NOT NULL, path_separator TEXT NOT NULL, fstype TEXT);\
 CREATE TABLE inode_type_t(id INTEGER PRIMARY KEY UNIQUE, code TEXT NOT NULL);\
 INSERT INTO inode_type_t VALUES (0, 'f');\
@@ -41,7 +49,9 @@ INSERT INTO inode_type_t VALUES (3, 's');\
 INSERT INTO inode_type_t VALUES (4, 'u');\
 CREATE TABLE inode_t(ino INTEGER PRIMARY KEY UNIQUE NOT NULL, type INTEGER NOT NULL, nr_extents INTEGER, travel_score REAL, atime INTEGER, crtime INTEGER, ctime INTEGER, mtime INTEGER, size INTEGER, FOREIGN KEY(type) REFERENCES inode_type_t(id));\
 CREATE TABLE dir_t(dir_ino INTEGER NOT NULL, name TEXT NOT NULL, name_ino INTEGER NOT NULL, FOREIGN KEY(dir_ino) REFERENCES inode_t(ino), FOREIGN KEY(name_ino) REFERENCES inode_t(ino));\
-CREATE TABLE path_t(path TEXT PRIMARY KEY UNIQUE NOT NULL, ino INTEGER NOT NULL, FOREIGN KEY(ino) REFERENCES inode_t(ino));\
+CREATE TABLE prefix_t(id INTEGER PRIMARY KEY, prefix TEXT UNIQUE NOT NULL);\
+CREATE TABLE pathname_t(prefix_id INTEGER NOT NULL, name TEXT NOT NULL, ino INTEGER NOT NULL, CONSTRAINT pk_pathname PRIMARY KEY (prefix_id, name), FOREIGN KEY(prefix_id) REFERENCES prefix_t(id), FOREIGN KEY(ino) REFERENCES inode_t(ino));\
+CREATE VIEW path_t AS SELECT prefix_t.prefix || pathname_t.name AS path, pathname_t.ino AS ino FROM pathname_t, prefix_t WHERE pathname_t.prefix_id = prefix_t.id;\
 CREATE TABLE extent_type_t (id INTEGER PRIMARY KEY UNIQUE, code TEXT NOT NULL);\
 INSERT INTO extent_type_t VALUES (0, 'f');\
 INSERT INTO extent_type_t VALUES (1, 'd');\
@@ -52,23 +62,65 @@ INSERT INTO extent_type_t VALUES (5, 's');\
 INSERT INTO extent_type_t VALUES (6, 'u');\
 CREATE TABLE extent_t(ino INTEGER NOT NULL, p_off INTEGER NOT NULL, l_off INTEGER, flags INTEGER NOT NULL, length INTEGER NOT NULL, type INTEGER NOT NULL, p_end INTEGER NOT NULL, FOREIGN KEY(ino) REFERENCES inode_t(ino), FOREIGN KEY(type) REFERENCES extent_type_t(id));\
 CREATE TABLE overview_t(length INTEGER NOT NULL, cell_no INTEGER NOT NULL, files INTEGER NOT NULL, dirs INTEGER NOT NULL, mappings INTEGER NOT NULL, metadata INTEGER NOT NULL, xattrs INTEGER NOT NULL, symlinks INTEGER NOT NULL, freesp INTEGER NOT NULL, CONSTRAINT pk_overview PRIMARY KEY (length, cell_no));\
+CREATE TABLE overview_base_t(length INTEGER NOT NULL, total_bytes INTEGER NOT NULL);\
 CREATE VIEW path_extent_v AS SELECT path_t.path, extent_t.p_off, extent_t.l_off, extent_t.length, extent_t.flags, extent_t.type, extent_t.p_end, extent_t.ino FROM extent_t, path_t WHERE extent_t.ino = path_t.ino;\
 CREATE VIEW path_inode_v AS SELECT path_t.path, inode_t.ino, inode_t.type, inode_t.nr_extents, inode_t.travel_score, inode_t.atime, inode_t.crtime, inode_t.ctime, inode_t.mtime, inode_t.size FROM path_t, inode_t WHERE inode_t.ino = path_t.ino;\
 CREATE VIEW dentry_t AS SELECT dir_t.dir_ino, dir_t.name, dir_t.name_ino, inode_t.type FROM dir_t, inode_t WHERE dir_t.name_ino = inode_t.ino;";
 
-static char *dbindex = "CREATE INDEX inode_i ON inode_t(ino);\
-CREATE INDEX path_ino_i ON path_t(ino);\
-CREATE INDEX path_path_i ON path_t(path);\
-CREATE INDEX dir_ino_i ON dir_t(dir_ino);\
-CREATE INDEX dir_nino_i ON dir_t(name_ino);\
-CREATE INDEX extent_poff_i ON extent_t(p_off, p_end);\
-CREATE INDEX extent_loff_i ON extent_t(l_off, length);\
-CREATE INDEX extent_ino_i ON extent_t(ino);\
-CREATE INDEX overview_cell_i ON overview_t(length, cell_no);\
-CREATE INDEX inode_ino_i ON inode_t(ino);\
-CREATE INDEX extent_type_i ON extent_t(type);\
+/*
+ * inode_t(ino) is an INTEGER PRIMARY KEY, so indexing it again buys
+ * nothing; the old inode_i/inode_ino_i pair is gone.
+ */
+static char *dbindex = "\
+CREATE INDEX IF NOT EXISTS pathname_ino_i ON pathname_t(ino);\
+CREATE INDEX IF NOT EXISTS dir_ino_i ON dir_t(dir_ino);\
+CREATE INDEX IF NOT EXISTS dir_nino_i ON dir_t(name_ino);\
+CREATE INDEX IF NOT EXISTS extent_poff_i ON extent_t(p_off, p_end);\
+CREATE INDEX IF NOT EXISTS extent_loff_i ON extent_t(l_off, length);\
+CREATE INDEX IF NOT EXISTS extent_ino_i ON extent_t(ino);\
+CREATE INDEX IF NOT EXISTS overview_cell_i ON overview_t(length, cell_no);\
+CREATE INDEX IF NOT EXISTS extent_type_i ON extent_t(type);\
 PRAGMA foreign_key_check;";
 
+/*
+ * Read-optimized schema rebuild.  The regular schema is tuned for load
+ * speed; the GUI's hottest query shapes (extent lookups by physical
+ * range, then a join back through the path view) still have to probe
+ * the base tables for the columns the narrow indexes don't carry.  This
+ * pass re-clusters inode_t and pathname_t as WITHOUT ROWID btrees
+ * ordered by their dominant access key, rewrites extent_t in physical
+ * order, and swaps the extent indexes for covering versions that
+ * satisfy the path_extent_v/path_inode_v query shapes entirely from the
+ * index -- roughly one extra copy of extent_t in exchange for no base
+ * table hits at browse time.  Views name the tables, not the other way
+ * around, so the readers never notice the swap; legacy_alter_table
+ * keeps the renames from re-validating those views mid-rebuild, when
+ * the tables they name are legitimately missing.
+ */
+static char *optschema = "\
+PRAGMA legacy_alter_table = ON;\
+DROP INDEX IF EXISTS inode_i;\
+DROP INDEX IF EXISTS inode_ino_i;\
+CREATE TABLE inode_opt_t(ino INTEGER PRIMARY KEY NOT NULL, type INTEGER NOT NULL, nr_extents INTEGER, travel_score REAL, atime INTEGER, crtime INTEGER, ctime INTEGER, mtime INTEGER, size INTEGER, FOREIGN KEY(type) REFERENCES inode_type_t(id)) WITHOUT ROWID;\
+INSERT INTO inode_opt_t SELECT * FROM inode_t ORDER BY ino;\
+DROP TABLE inode_t;\
+ALTER TABLE inode_opt_t RENAME TO inode_t;\
+CREATE TABLE pathname_opt_t(prefix_id INTEGER NOT NULL, name TEXT NOT NULL, ino INTEGER NOT NULL, CONSTRAINT pk_pathname PRIMARY KEY (prefix_id, name), FOREIGN KEY(prefix_id) REFERENCES prefix_t(id), FOREIGN KEY(ino) REFERENCES inode_t(ino)) WITHOUT ROWID;\
+INSERT INTO pathname_opt_t SELECT * FROM pathname_t ORDER BY prefix_id, name;\
+DROP TABLE pathname_t;\
+ALTER TABLE pathname_opt_t RENAME TO pathname_t;\
+CREATE INDEX pathname_ino_i ON pathname_t(ino, prefix_id, name);\
+CREATE TABLE extent_opt_t(ino INTEGER NOT NULL, p_off INTEGER NOT NULL, l_off INTEGER, flags INTEGER NOT NULL, length INTEGER NOT NULL, type INTEGER NOT NULL, p_end INTEGER NOT NULL, FOREIGN KEY(ino) REFERENCES inode_t(ino), FOREIGN KEY(type) REFERENCES extent_type_t(id));\
+INSERT INTO extent_opt_t SELECT * FROM extent_t ORDER BY p_off, p_end;\
+DROP TABLE extent_t;\
+ALTER TABLE extent_opt_t RENAME TO extent_t;\
+CREATE INDEX extent_poff_i ON extent_t(p_off, p_end, ino, l_off, length, flags, type);\
+CREATE INDEX extent_loff_i ON extent_t(l_off, length, ino, p_off, flags, type, p_end);\
+CREATE INDEX extent_ino_i ON extent_t(ino, l_off, p_off, length, flags, type, p_end);\
+CREATE INDEX extent_type_i ON extent_t(type, ino);\
+PRAGMA legacy_alter_table = OFF;\
+ANALYZE;";
+
 static int primary_extent_type_for_inode[] = {
 	[INO_TYPE_FILE]		= EXT_TYPE_FILE,
 	[INO_TYPE_DIR]		= EXT_TYPE_DIR,
@@ -145,15 +197,246 @@ void run_batch_query(struct filemapper_t *wf, const char *sql)
 	wf->db_err = err;
 }
 
-/* Insert an inode record into the inode and path tables */
-void insert_inode(struct filemapper_t *wf, int64_t ino, int type,
-		  const char *path, time_t *atime, time_t *crtime,
-		  time_t *ctime, time_t *mtime, int64_t *size)
+/*
+ * Grab a cached insertion statement, preparing it on first use.  The hot
+ * insertion paths run millions of times per scan; reparsing the same SQL
+ * text each time costs more than the insertions themselves.
+ */
+static int prepare_cached(struct filemapper_t *wf, sqlite3_stmt **stmtp,
+			  const char *sql)
+{
+	int err;
+
+	if (*stmtp) {
+		err = sqlite3_reset(*stmtp);
+		if (err)
+			return err;
+		return sqlite3_clear_bindings(*stmtp);
+	}
+
+	return sqlite3_prepare_v2(wf->db, sql, -1, stmtp, NULL);
+}
+
+/*
+ * Scan instrumentation.  Setting FM_STATS in the environment makes the
+ * mappers collect wall-clock timings for each scan phase, row counts
+ * for the insertion entry points, and a log2 latency histogram of the
+ * hot sqlite3_step() calls; cleanup_db() dumps everything to stderr as
+ * machine-readable "fmstats:" lines.  The counters use atomic adds
+ * because the writer thread and the parallel walkers account alongside
+ * the main thread.
+ */
+#define FM_STATS_PHASE_NR	16
+#define FM_STATS_HIST_NR	28
+
+struct fm_stats {
+	/* Wall-clock nanoseconds spent in each scan phase. */
+	struct {
+		const char	*name;
+		uint64_t	start;		/* 0 when the window is shut */
+		uint64_t	nsec;
+	} phases[FM_STATS_PHASE_NR];
+	unsigned int nr_phases;
+
+	/* Rows pushed through the insertion entry points. */
+	uint64_t inode_rows;
+	uint64_t dentry_rows;
+	uint64_t extent_rows;
+
+	/* Log2 nanosecond latency histogram of insertion steps. */
+	uint64_t step_hist[FM_STATS_HIST_NR];
+};
+
+/* Current monotonic time, in nanoseconds. */
+static uint64_t fm_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Start collecting scan statistics if the user asked for them. */
+void fm_stats_start(struct filemapper_t *wf)
+{
+	if (wf->stats || !getenv("FM_STATS"))
+		return;
+	wf->stats = calloc(1, sizeof(struct fm_stats));
+}
+
+/* Open a (possibly repeated) timing window for a named scan phase. */
+void fm_phase_start(struct filemapper_t *wf, const char *name)
+{
+	struct fm_stats *s = wf->stats;
+	unsigned int i;
+
+	if (!s)
+		return;
+	for (i = 0; i < s->nr_phases; i++)
+		if (!strcmp(s->phases[i].name, name))
+			break;
+	if (i == s->nr_phases) {
+		if (s->nr_phases == FM_STATS_PHASE_NR)
+			return;
+		s->phases[i].name = name;
+		s->nr_phases++;
+	}
+	s->phases[i].start = fm_stats_now();
+}
+
+/* Shut a phase's timing window, accumulating the elapsed time. */
+void fm_phase_stop(struct filemapper_t *wf, const char *name)
+{
+	struct fm_stats *s = wf->stats;
+	unsigned int i;
+
+	if (!s)
+		return;
+	for (i = 0; i < s->nr_phases; i++) {
+		if (strcmp(s->phases[i].name, name) || !s->phases[i].start)
+			continue;
+		s->phases[i].nsec += fm_stats_now() - s->phases[i].start;
+		s->phases[i].start = 0;
+		return;
+	}
+}
+
+/* Count a row pushed through an insertion entry point. */
+static void fm_stats_count(uint64_t *ctr)
+{
+	__sync_fetch_and_add(ctr, 1);
+}
+
+/* Step a statement, billing the latency to the histogram. */
+static int fm_stats_step(struct filemapper_t *wf, sqlite3_stmt *stmt)
+{
+	uint64_t t0, nsec;
+	unsigned int bucket = 0;
+	int err;
+
+	if (!wf->stats)
+		return sqlite3_step(stmt);
+
+	t0 = fm_stats_now();
+	err = sqlite3_step(stmt);
+	nsec = fm_stats_now() - t0;
+	while (nsec > 1 && bucket < FM_STATS_HIST_NR - 1) {
+		nsec >>= 1;
+		bucket++;
+	}
+	__sync_fetch_and_add(&wf->stats->step_hist[bucket], 1);
+
+	return err;
+}
+
+/* Dump the collected statistics as machine-readable lines. */
+static void fm_stats_dump(struct filemapper_t *wf)
+{
+	struct fm_stats *s = wf->stats;
+	struct compdb_stats cs;
+	unsigned int i;
+
+	if (!s)
+		return;
+
+	for (i = 0; i < s->nr_phases; i++)
+		fprintf(stderr, "fmstats: phase.%s.nsec %"PRIu64"\n",
+			s->phases[i].name, s->phases[i].nsec);
+	fprintf(stderr, "fmstats: rows.inode %"PRIu64"\n", s->inode_rows);
+	fprintf(stderr, "fmstats: rows.dentry %"PRIu64"\n", s->dentry_rows);
+	fprintf(stderr, "fmstats: rows.extent %"PRIu64"\n", s->extent_rows);
+	for (i = 0; i < FM_STATS_HIST_NR; i++) {
+		if (!s->step_hist[i])
+			continue;
+		fprintf(stderr, "fmstats: step_hist.le_%uns %"PRIu64"\n",
+			1U << i, s->step_hist[i]);
+	}
+	compdb_get_stats(&cs);
+	fprintf(stderr, "fmstats: compdb.bytes_read %llu\n", cs.bytes_read);
+	fprintf(stderr, "fmstats: compdb.bytes_decompressed %llu\n",
+		cs.bytes_decompressed);
+
+	free(s);
+	wf->stats = NULL;
+}
+
+/*
+ * Path prefix compression.  Storing every inode's complete path as an
+ * independent string duplicates the directory prefix once per child,
+ * which on a big fileserver makes the path table the largest thing in
+ * the database.  Instead, each distinct prefix (everything through the
+ * final separator) is stored once in prefix_t and the per-inode row
+ * keeps only the id and the final component; the path_t view pastes
+ * them back together, so the readers never notice.  The mappers insert
+ * a directory's children back to back, so one cached (prefix, id) pair
+ * absorbs almost every lookup.
+ */
+static int path_prefix_id(struct filemapper_t *wf, const char *path,
+			  const char **name, int64_t *idp)
+{
+	const char *ins_sql = "INSERT OR IGNORE INTO prefix_t(prefix) VALUES(?);";
+	const char *sel_sql = "SELECT id FROM prefix_t WHERE prefix = ?;";
+	const char *sep;
+	sqlite3_stmt *stmt;
+	size_t plen;
+	char *dup;
+	int err;
+
+	sep = strrchr(path, '/');
+	*name = sep ? sep + 1 : path;	/* the prefix keeps the separator */
+	plen = *name - path;
+
+	if (wf->prefix_cache && wf->prefix_cache_len == plen &&
+	    !memcmp(wf->prefix_cache, path, plen)) {
+		*idp = wf->prefix_cache_id;
+		return 0;
+	}
+
+	err = prepare_cached(wf, &wf->prefix_ins_stmt, ins_sql);
+	if (err)
+		return err;
+	stmt = wf->prefix_ins_stmt;
+	err = sqlite3_bind_text(stmt, 1, path, plen, SQLITE_STATIC);
+	if (err)
+		return err;
+	err = sqlite3_step(stmt);
+	if (err && err != SQLITE_DONE)
+		return err;
+
+	err = prepare_cached(wf, &wf->prefix_sel_stmt, sel_sql);
+	if (err)
+		return err;
+	stmt = wf->prefix_sel_stmt;
+	err = sqlite3_bind_text(stmt, 1, path, plen, SQLITE_STATIC);
+	if (err)
+		return err;
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW)
+		return err ? err : SQLITE_CORRUPT;
+	*idp = sqlite3_column_int64(stmt, 0);
+
+	dup = realloc(wf->prefix_cache, plen + 1);
+	if (dup) {
+		memcpy(dup, path, plen);
+		dup[plen] = 0;
+		wf->prefix_cache = dup;
+		wf->prefix_cache_len = plen;
+		wf->prefix_cache_id = *idp;
+	}
+	return 0;
+}
+
+/* Step an inode record into the inode and path tables. */
+static int do_insert_inode(struct filemapper_t *wf, int64_t ino, int type,
+			   const char *path, time_t *atime, time_t *crtime,
+			   time_t *ctime, time_t *mtime, int64_t *size)
 {
 	const char *ino_sql = "INSERT OR REPLACE INTO inode_t VALUES(?, ?, NULL, NULL, ?, ?, ?, ?, ?);";
-	const char *path_sql = "INSERT INTO path_t VALUES(?, ?);";
-	sqlite3_stmt *stmt = NULL;
-	int err, err2, col = 1;
+	const char *path_sql = "INSERT OR REPLACE INTO pathname_t VALUES(?, ?, ?);";
+	const char *name;
+	int64_t prefix_id;
+	sqlite3_stmt *stmt;
+	int err, col = 1;
 
 #ifdef PROGRESS_REPORT
 	{static int i = 0;
@@ -167,9 +450,10 @@ void insert_inode(struct filemapper_t *wf, int64_t ino, int type,
 #endif
 
 	/* Update the inode table */
-	err = sqlite3_prepare_v2(wf->db, ino_sql, -1, &stmt, NULL);
+	err = prepare_cached(wf, &wf->ino_stmt, ino_sql);
 	if (err)
 		goto out;
+	stmt = wf->ino_stmt;
 	err = sqlite3_bind_int64(stmt, col++, ino);
 	if (err)
 		goto out;
@@ -206,51 +490,52 @@ void insert_inode(struct filemapper_t *wf, int64_t ino, int type,
 		err = sqlite3_bind_null(stmt, col++);
 	if (err)
 		goto out;
-	err = sqlite3_step(stmt);
+	err = fm_stats_step(wf, stmt);
 	if (err && err != SQLITE_DONE)
 		goto out;
-	err = sqlite3_finalize(stmt);
-	if (err)
-		goto out;
-	stmt = NULL;
 
 	/* Update the path table */
+	err = path_prefix_id(wf, path, &name, &prefix_id);
+	if (err)
+		goto out;
 	col = 1;
-	err = sqlite3_prepare_v2(wf->db, path_sql, -1, &stmt, NULL);
+	err = prepare_cached(wf, &wf->path_stmt, path_sql);
+	if (err)
+		goto out;
+	stmt = wf->path_stmt;
+	err = sqlite3_bind_int64(stmt, col++, prefix_id);
 	if (err)
 		goto out;
-	err = sqlite3_bind_text(stmt, col++, path, -1, SQLITE_STATIC);
+	err = sqlite3_bind_text(stmt, col++, name, -1, SQLITE_STATIC);
 	if (err)
 		goto out;
 	err = sqlite3_bind_int64(stmt, col++, ino);
 	if (err)
 		goto out;
-	err = sqlite3_step(stmt);
+	err = fm_stats_step(wf, stmt);
 	if (err && err != SQLITE_DONE)
 		goto out;
 	err = 0;
 out:
-	err2 = sqlite3_finalize(stmt);
-	if (!err && err2)
-		err = err2;
-	wf->db_err = err;
+	return err;
 }
 
-/* Insert a directory entry into the database. */
-void insert_dentry(struct filemapper_t *wf, int64_t dir_ino,
-		   const char *name, int64_t ino)
+/* Step a directory entry into the dentry table. */
+static int do_insert_dentry(struct filemapper_t *wf, int64_t dir_ino,
+			    const char *name, int64_t ino)
 {
 	const char *dentry_sql = "INSERT INTO dir_t VALUES(?, ?, ?);";
-	sqlite3_stmt *stmt = NULL;
-	int err, err2, col = 1;
+	sqlite3_stmt *stmt;
+	int err, col = 1;
 
 	dbg_printf("%s: dir=%"PRId64" name=%s ino=%"PRId64"\n", __func__,
 		   dir_ino, name, ino);
 
 	/* Update the dentry table */
-	err = sqlite3_prepare_v2(wf->db, dentry_sql, -1, &stmt, NULL);
+	err = prepare_cached(wf, &wf->dentry_stmt, dentry_sql);
 	if (err)
 		goto out;
+	stmt = wf->dentry_stmt;
 	err = sqlite3_bind_int64(stmt, col++, dir_ino);
 	if (err)
 		goto out;
@@ -260,143 +545,178 @@ void insert_dentry(struct filemapper_t *wf, int64_t dir_ino,
 	err = sqlite3_bind_int64(stmt, col++, ino);
 	if (err)
 		goto out;
-	err = sqlite3_step(stmt);
+	err = fm_stats_step(wf, stmt);
 	if (err && err != SQLITE_DONE)
 		goto out;
 	err = 0;
 out:
-	err2 = sqlite3_finalize(stmt);
-	if (!err && err2)
-		err = err2;
-	wf->db_err = err;
+	return err;
 }
 
-/* Insert an extent into the database. */
-void insert_extent(struct filemapper_t *wf, int64_t ino, uint64_t physical,
-		   uint64_t *logical, uint64_t length, int flags, int type)
-{
-	const char *extent_sql = "INSERT INTO extent_t VALUES(?, ?, ?, ?, ?, ?, ?);";
-	sqlite3_stmt *stmt = NULL;
-	int err, err2, col = 1;
+/*
+ * Incremental rescan support.  When the caller keeps the previous scan's
+ * database, we load every inode's ctime into an in-core signature map
+ * before the walk begins (the writer thread owns the database while the
+ * walk runs, so the walk must not query it).  The mappers then ask
+ * inode_needs_rescan() per inode: a stored ctime that matches the disk
+ * and predates the previous scan's timestamp means nothing about the
+ * inode changed, so its rows are still good and the whole mapping walk
+ * can be skipped.  Everything else is re-inserted; the first insertion
+ * of a previously-known inode deletes its stale rows, and prune_db()
+ * sweeps out inodes that disappeared entirely.
+ */
+#define SIG_PRESENT	(1 << 0)	/* slot is occupied */
+#define SIG_HASCTIME	(1 << 1)	/* old db recorded a ctime */
+#define SIG_SETTLED	(1 << 2)	/* validated or cleared this scan */
+#define SIG_KEPT	(1 << 3)	/* unchanged; old rows still live */
 
-	dbg_printf("%s: ino=%"PRId64" phys=%"PRIu64" logical=%"PRIu64" len=%"PRIu64" flags=0x%x type=%d\n", __func__,
-		   ino, physical, logical ? *logical : 0, length, flags, type);
+struct fm_inosig {
+	int64_t			ino;
+	int64_t			ctime;
+	uint8_t			flags;
+};
 
-	/* Update the dentry table */
-	err = sqlite3_prepare_v2(wf->db, extent_sql, -1, &stmt, NULL);
-	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, ino);
-	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, physical);
-	if (err)
-		goto out;
-	if (logical) {
-		err = sqlite3_bind_int64(stmt, col++, *logical);
-		if (err)
-			goto out;
-	} else {
-		err = sqlite3_bind_null(stmt, col++);
-		if (err)
-			goto out;
+struct fm_rescan {
+	/* Mappers with parallel walks hit the map from several threads. */
+	pthread_mutex_t		lock;
+	struct fm_inosig	*slots;
+	uint64_t		nr;
+	uint64_t		cap;	/* always a power of two */
+	int64_t			last_scan;
+
+	/* Cached stale row removal statements. */
+	sqlite3_stmt		*clear_ext_stmt;
+	sqlite3_stmt		*clear_path_stmt;
+	sqlite3_stmt		*clear_dir_stmt;
+};
+
+static struct fm_inosig *rescan_slot(struct fm_rescan *r, int64_t ino)
+{
+	uint64_t slot;
+
+	slot = ((uint64_t)ino * 0x9E3779B97F4A7C15ULL) & (r->cap - 1);
+	while (r->slots[slot].flags & SIG_PRESENT) {
+		if (r->slots[slot].ino == ino)
+			break;
+		slot = (slot + 1) & (r->cap - 1);
 	}
-	err = sqlite3_bind_int(stmt, col++, flags);
-	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, length);
-	if (err)
-		goto out;
-	err = sqlite3_bind_int(stmt, col++, type);
-	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, physical + length - 1);
-	if (err)
-		goto out;
-	err = sqlite3_step(stmt);
-	if (err && err != SQLITE_DONE)
-		goto out;
-	err = 0;
-out:
-	err2 = sqlite3_finalize(stmt);
-	if (!err && err2)
-		err = err2;
-	wf->db_err = err;
+	return &r->slots[slot];
 }
 
-void inject_metadata(struct filemapper_t *wf, int64_t parent_ino,
-		     const char *path, int64_t ino, const char *name,
-		     int type)
+/* Record an inode signature, growing the map as needed. */
+static int rescan_store(struct fm_rescan *r, int64_t ino, int64_t ctime,
+			int flags)
 {
-	char __path[PATH_MAX + 1];
+	struct fm_inosig *nslots, *e;
+	uint64_t ncap, i;
 
-	snprintf(__path, PATH_MAX, "%s/%s", path, name);
-	wf->dirpath = path;
-	insert_inode(wf, ino, type, __path, NULL, NULL, NULL, NULL, NULL);
-	if (wf->db_err)
-		return;
-	insert_dentry(wf, parent_ino, name, ino);
-	if (wf->db_err)
-		return;
+	/* Keep the load factor under 3/4. */
+	if (r->nr + (r->nr / 2) >= r->cap) {
+		ncap = r->cap * 2;
+		nslots = calloc(ncap, sizeof(struct fm_inosig));
+		if (!nslots)
+			return ENOMEM;
+		for (i = 0; i < r->cap; i++) {
+			struct fm_rescan big = {.slots = nslots, .cap = ncap};
+
+			if (!(r->slots[i].flags & SIG_PRESENT))
+				continue;
+			*rescan_slot(&big, r->slots[i].ino) = r->slots[i];
+		}
+		free(r->slots);
+		r->slots = nslots;
+		r->cap = ncap;
+	}
+
+	e = rescan_slot(r, ino);
+	e->ino = ino;
+	e->ctime = ctime;
+	e->flags = SIG_PRESENT | flags;
+	r->nr++;
+	return 0;
 }
 
-/* Store fs statistics in the database */
-void collect_fs_stats(struct filemapper_t *wf, char *fs_name,
-		      uint32_t blocksize, uint32_t fragsize,
-		      uint64_t total_bytes, uint64_t free_bytes,
-		      uint64_t total_inodes, uint64_t free_inodes,
-		      unsigned int max_name_len, const char *fstype)
+/* Delete an inode's old extents, paths, and directory entries. */
+static int do_clear_inode(struct filemapper_t *wf, int64_t ino)
 {
-	const char *sql = "INSERT INTO fs_t VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 0, ?, ?);";
-	char p[PATH_MAX + 1];
+	struct fm_rescan *r = wf->rescan;
+	const char *ext_sql = "DELETE FROM extent_t WHERE ino = ?;";
+	const char *path_sql = "DELETE FROM pathname_t WHERE ino = ?;";
+	const char *dir_sql = "DELETE FROM dir_t WHERE dir_ino = ?;";
 	sqlite3_stmt *stmt;
-	time_t t;
-	int err, err2, col = 1;
+	int err;
 
-	err = sqlite3_prepare_v2(wf->db, sql, -1, &stmt, NULL);
-	if (err)
-		goto out;
-	err = icvt(wf, fs_name, strlen(fs_name), p, PATH_MAX);
-	if (err)
-		goto out;
-	err = sqlite3_bind_text(stmt, col++, p, -1, SQLITE_STATIC);
-	if (err)
-		goto out;
-	err = sqlite3_bind_int(stmt, col++, blocksize);
-	if (err)
-		goto out;
-	err = sqlite3_bind_int(stmt, col++, fragsize);
-	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, total_bytes);
+	dbg_printf("%s: ino=%"PRId64"\n", __func__, ino);
+
+	err = prepare_cached(wf, &r->clear_ext_stmt, ext_sql);
 	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, free_bytes);
+		return err;
+	stmt = r->clear_ext_stmt;
+	err = sqlite3_bind_int64(stmt, 1, ino);
 	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, free_bytes);
+		return err;
+	err = sqlite3_step(stmt);
+	if (err && err != SQLITE_DONE)
+		return err;
+
+	err = prepare_cached(wf, &r->clear_path_stmt, path_sql);
 	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, total_inodes);
+		return err;
+	stmt = r->clear_path_stmt;
+	err = sqlite3_bind_int64(stmt, 1, ino);
 	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, free_inodes);
+		return err;
+	err = sqlite3_step(stmt);
+	if (err && err != SQLITE_DONE)
+		return err;
+
+	err = prepare_cached(wf, &r->clear_dir_stmt, dir_sql);
 	if (err)
-		goto out;
-	err = sqlite3_bind_int64(stmt, col++, free_inodes);
+		return err;
+	stmt = r->clear_dir_stmt;
+	err = sqlite3_bind_int64(stmt, 1, ino);
 	if (err)
-		goto out;
-	err = sqlite3_bind_int(stmt, col++, max_name_len);
+		return err;
+	err = sqlite3_step(stmt);
+	if (err && err != SQLITE_DONE)
+		return err;
+	return 0;
+}
+
+/*
+ * Periodic checkpointing.  A scan normally runs as one giant transaction,
+ * so a crash nine hours in throws away nine hours of work.  When
+ * checkpoints are enabled, the engine commits the transaction every so
+ * often and records a progress cursor in checkpoint_t; a later run can
+ * treat the committed rows like a previous scan's rows and skip the
+ * inodes that are already persisted.
+ */
+#define FM_CKPT_INTERVAL	60	/* seconds between commits */
+
+/* Commit everything inserted so far and remember how far we got. */
+static int do_checkpoint(struct filemapper_t *wf, int64_t group_nr)
+{
+	const char *ins_sql = "INSERT INTO checkpoint_t VALUES(?, ?);";
+	sqlite3_stmt *stmt = NULL;
+	int err, err2;
+
+	dbg_printf("%s: group_nr=%"PRId64"\n", __func__, group_nr);
+
+	flush_extents(wf);
+	if (wf->db_err)
+		return wf->db_err;
+
+	err = sqlite3_exec(wf->db, "DELETE FROM checkpoint_t;", NULL, NULL,
+			   NULL);
 	if (err)
-		goto out;
-	t = time(NULL);
-	err = sqlite3_bind_int64(stmt, col++, t);
+		return err;
+	err = sqlite3_prepare_v2(wf->db, ins_sql, -1, &stmt, NULL);
 	if (err)
-		goto out;
-	err = sqlite3_bind_text(stmt, col++, "/", -1, SQLITE_STATIC);
+		return err;
+	err = sqlite3_bind_int64(stmt, 1, time(NULL));
 	if (err)
 		goto out;
-	err = sqlite3_bind_text(stmt, col++, fstype, -1, SQLITE_STATIC);
+	err = sqlite3_bind_int64(stmt, 2, group_nr);
 	if (err)
 		goto out;
 	err = sqlite3_step(stmt);
@@ -407,18 +727,1530 @@ out:
 	err2 = sqlite3_finalize(stmt);
 	if (!err && err2)
 		err = err2;
-	wf->db_err = err;
+	if (err)
+		return err;
+	return sqlite3_exec(wf->db, "END TRANSACTION; BEGIN TRANSACTION;",
+			    NULL, NULL, NULL);
 }
 
-/* Mark the database as complete. */
-void finalize_fs_stats(struct filemapper_t *wf, char *fs_name)
-{
-	const char *sql = "UPDATE fs_t SET finished = 1 WHERE path = ?;";
-	char p[PATH_MAX + 1];
+/*
+ * Extent insertion batching.  One sqlite3_step() per extent is the dominant
+ * cost of a big scan, so insert_extent() only records the row in an in-core
+ * array; the rows are pushed into extent_t a few thousand at a time.
+ */
+#define EXTENT_BATCH_NR		4096
+struct extent_rec {
+	int64_t ino;
+	uint64_t physical;
+	uint64_t logical;
+	uint64_t length;
+	int has_logical;
+	int flags;
+	int type;
+};
+struct extent_batch {
+	unsigned int used;
+	struct extent_rec recs[EXTENT_BATCH_NR];
+};
+
+/*
+ * Streaming inode statistics.  The mappers deliver each inode's mappings
+ * as one logically ordered run, so nr_extents and the travel score can be
+ * accumulated while the rows go by and written out when the inode
+ * changes.  That leaves calc_inode_stats() to sort out only the inodes
+ * this path couldn't finish -- the synthetic metadata files, whose
+ * extents arrive in several passes, and any run that showed up out of
+ * order -- instead of the entire extent table.
+ */
+struct istat_acc {
+	int enabled;
+	int has_ino;
+	int broken;		/* disordered run; leave to calc_inode_stats */
+	int64_t ino;
+	int64_t extents;
+	int64_t p_dist;
+	int64_t l_dist;
+	int64_t last_poff;
+	int64_t last_loff;
+	sqlite3_stmt *upd_stmt;
+};
+
+/* Write out the statistics accumulated for the current inode. */
+static int istat_flush(struct filemapper_t *wf)
+{
+	const char *upd_sql = "UPDATE inode_t SET nr_extents = ?, travel_score = ? WHERE ino = ? AND nr_extents IS NULL;";
+	struct istat_acc *is = wf->istats;
+	sqlite3_stmt *stmt;
+	int err;
+
+	if (!is || !is->has_ino)
+		return 0;
+	is->has_ino = 0;
+	if (is->broken)
+		return 0;
+
+	err = prepare_cached(wf, &is->upd_stmt, upd_sql);
+	if (err)
+		return err;
+	stmt = is->upd_stmt;
+	err = sqlite3_bind_int64(stmt, 1, is->extents);
+	if (err)
+		return err;
+	err = sqlite3_bind_double(stmt, 2, (double)is->p_dist / is->l_dist);
+	if (err)
+		return err;
+	err = sqlite3_bind_int64(stmt, 3, is->ino);
+	if (err)
+		return err;
+	err = sqlite3_step(stmt);
+	if (err && err != SQLITE_DONE)
+		return err;
+	return 0;
+}
+
+/* Fold one extent row into the streaming inode statistics. */
+static int istat_account(struct filemapper_t *wf, struct extent_rec *rec)
+{
+	struct istat_acc *is = wf->istats;
+	int err;
+
+	if (!is) {
+		is = calloc(1, sizeof(*is));
+		if (!is)
+			return SQLITE_NOMEM;
+		is->enabled = 1;
+		wf->istats = is;
+	}
+	if (!is->enabled || !rec->has_logical)
+		return 0;
+
+	/*
+	 * Only extents of the inode's primary type count towards the
+	 * score.  The mappers use one extent type per inode type, so
+	 * filtering on the extent type alone matches the join in
+	 * calc_inode_stats(); the synthetic metadata files (negative
+	 * inode numbers) collect extents across several phases and are
+	 * left for it to finish.
+	 */
+	switch (rec->type) {
+	case EXT_TYPE_FILE:
+	case EXT_TYPE_DIR:
+	case EXT_TYPE_METADATA:
+	case EXT_TYPE_SYMLINK:
+	case EXT_TYPE_FREESP:
+		break;
+	default:
+		return 0;
+	}
+	if (rec->ino < 0)
+		return 0;
+
+	if (is->has_ino && rec->ino != is->ino) {
+		err = istat_flush(wf);
+		if (err)
+			return err;
+	}
+	if (!is->has_ino) {
+		is->has_ino = 1;
+		is->broken = 0;
+		is->ino = rec->ino;
+		is->extents = 0;
+		is->p_dist = is->l_dist = 0;
+		is->last_poff = is->last_loff = 0;
+	}
+	if (is->broken)
+		return 0;
+	if (is->extents && (int64_t)rec->logical <= is->last_loff) {
+		is->broken = 1;
+		return 0;
+	}
+
+	if (is->extents) {
+		is->p_dist += llabs((int64_t)rec->physical - is->last_poff);
+		is->l_dist += rec->logical - is->last_loff;
+	}
+	is->extents++;
+	is->p_dist += rec->length;
+	is->l_dist += rec->length;
+	is->last_poff = rec->physical + rec->length - 1;
+	is->last_loff = rec->logical + rec->length - 1;
+	return 0;
+}
+
+/* Insert one batched extent row. */
+static int insert_extent_rec(struct filemapper_t *wf, struct extent_rec *rec)
+{
+	const char *extent_sql = "INSERT INTO extent_t VALUES(?, ?, ?, ?, ?, ?, ?);";
+	sqlite3_stmt *stmt;
+	int err, col = 1;
+
+	err = prepare_cached(wf, &wf->extent_stmt, extent_sql);
+	if (err)
+		return err;
+	stmt = wf->extent_stmt;
+	err = sqlite3_bind_int64(stmt, col++, rec->ino);
+	if (err)
+		return err;
+	err = sqlite3_bind_int64(stmt, col++, rec->physical);
+	if (err)
+		return err;
+	if (rec->has_logical)
+		err = sqlite3_bind_int64(stmt, col++, rec->logical);
+	else
+		err = sqlite3_bind_null(stmt, col++);
+	if (err)
+		return err;
+	err = sqlite3_bind_int(stmt, col++, rec->flags);
+	if (err)
+		return err;
+	err = sqlite3_bind_int64(stmt, col++, rec->length);
+	if (err)
+		return err;
+	err = sqlite3_bind_int(stmt, col++, rec->type);
+	if (err)
+		return err;
+	err = sqlite3_bind_int64(stmt, col++, rec->physical + rec->length - 1);
+	if (err)
+		return err;
+	err = fm_stats_step(wf, stmt);
+	if (err && err != SQLITE_DONE)
+		return err;
+	return istat_account(wf, rec);
+}
+
+/* Push all batched extents into the database. */
+void flush_extents(struct filemapper_t *wf)
+{
+	struct extent_batch *batch = wf->ext_batch;
+	int own_txn;
+	unsigned int i;
+	int err = 0;
+
+	if (!batch || !batch->used)
+		return;
+
+	/*
+	 * The mappers normally run the whole scan inside one big
+	 * transaction; only open our own if nobody else did.
+	 */
+	own_txn = sqlite3_get_autocommit(wf->db);
+	if (own_txn) {
+		err = sqlite3_exec(wf->db, "BEGIN TRANSACTION", NULL, NULL,
+				   NULL);
+		if (err)
+			goto out;
+	}
+
+	for (i = 0; i < batch->used; i++) {
+		err = insert_extent_rec(wf, &batch->recs[i]);
+		if (err)
+			break;
+	}
+	batch->used = 0;
+
+	if (own_txn) {
+		int err2 = sqlite3_exec(wf->db, "END TRANSACTION", NULL, NULL,
+					NULL);
+		if (!err && err2)
+			err = err2;
+	}
+
+out:
+	if (err)
+		wf->db_err = err;
+}
+
+/*
+ * Database writer thread.  The mappers are fully serial: they alternate
+ * between filesystem metadata I/O and synchronous SQLite insertion, so
+ * the disk sits idle while SQLite runs and the CPU sits idle during
+ * seeks.  When a writer thread is active, the insertion entry points
+ * only copy the record into a bounded ring buffer; the writer thread
+ * drains the ring into the database, overlapping the two.  Only the
+ * writer thread touches the database while it runs, so the mappers must
+ * stop it (fm_writer_stop) before reading anything back.
+ */
+#define FM_WRITER_RING_NR	16384
+
+enum fm_rec_type {
+	FM_REC_INODE,
+	FM_REC_DENTRY,
+	FM_REC_EXTENT,
+	FM_REC_CLEAR,
+	FM_REC_CKPT,
+};
+
+/* Optional inode fields actually supplied in a queued record. */
+#define FM_INO_ATIME		(1 << 0)
+#define FM_INO_CRTIME		(1 << 1)
+#define FM_INO_CTIME		(1 << 2)
+#define FM_INO_MTIME		(1 << 3)
+#define FM_INO_SIZE		(1 << 4)
+
+/*
+ * Most dentry names and paths fit this; anything longer falls back to
+ * strdup().  Inline strings spare the hot insertion path a malloc and
+ * a free per row.
+ */
+#define FM_REC_INLINE	104
+
+struct fm_rec {
+	enum fm_rec_type rtype;
+	char ibuf[FM_REC_INLINE];
+	union {
+		struct {
+			int64_t ino;
+			int type;
+			char *path;
+			time_t atime;
+			time_t crtime;
+			time_t ctime;
+			time_t mtime;
+			int64_t size;
+			int present;
+		} ino;
+		struct {
+			int64_t dir_ino;
+			char *name;
+			int64_t ino;
+		} dentry;
+		struct extent_rec ext;
+		struct {
+			int64_t ino;
+		} clear;
+		struct {
+			int64_t group_nr;
+		} ckpt;
+	};
+};
+
+struct fm_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t can_produce;
+	pthread_cond_t can_consume;
+	struct fm_rec *ring;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int used;
+	int stop;
+	int err;
+	struct filemapper_t *wf;
+};
+
+/* Release the string copies hanging off a queued record. */
+static void fm_rec_free(struct fm_rec *rec)
+{
+	switch (rec->rtype) {
+	case FM_REC_INODE:
+		if (rec->ino.path != rec->ibuf)
+			free(rec->ino.path);
+		break;
+	case FM_REC_DENTRY:
+		if (rec->dentry.name != rec->ibuf)
+			free(rec->dentry.name);
+		break;
+	case FM_REC_EXTENT:
+	case FM_REC_CLEAR:
+	case FM_REC_CKPT:
+		break;
+	}
+}
+
+/* Stash a string in a record, inline when it fits. */
+static char *fm_rec_strput(struct fm_rec *rec, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (len < FM_REC_INLINE) {
+		memcpy(rec->ibuf, str, len + 1);
+		return rec->ibuf;
+	}
+	return strdup(str);
+}
+
+/* Copy a record, keeping inline string pointers aimed at the copy. */
+static void fm_rec_copy(struct fm_rec *dst, const struct fm_rec *src)
+{
+	*dst = *src;
+	if (src->rtype == FM_REC_INODE && src->ino.path == src->ibuf)
+		dst->ino.path = dst->ibuf;
+	else if (src->rtype == FM_REC_DENTRY &&
+		 src->dentry.name == src->ibuf)
+		dst->dentry.name = dst->ibuf;
+}
+
+/* Insert one queued record into the database. */
+static int fm_writer_apply(struct filemapper_t *wf, struct fm_rec *rec)
+{
+	switch (rec->rtype) {
+	case FM_REC_INODE:
+		return do_insert_inode(wf, rec->ino.ino, rec->ino.type,
+				rec->ino.path,
+				rec->ino.present & FM_INO_ATIME ? &rec->ino.atime : NULL,
+				rec->ino.present & FM_INO_CRTIME ? &rec->ino.crtime : NULL,
+				rec->ino.present & FM_INO_CTIME ? &rec->ino.ctime : NULL,
+				rec->ino.present & FM_INO_MTIME ? &rec->ino.mtime : NULL,
+				rec->ino.present & FM_INO_SIZE ? &rec->ino.size : NULL);
+	case FM_REC_DENTRY:
+		return do_insert_dentry(wf, rec->dentry.dir_ino,
+				rec->dentry.name, rec->dentry.ino);
+	case FM_REC_EXTENT:
+		return insert_extent_rec(wf, &rec->ext);
+	case FM_REC_CLEAR:
+		return do_clear_inode(wf, rec->clear.ino);
+	case FM_REC_CKPT:
+		return do_checkpoint(wf, rec->ckpt.group_nr);
+	}
+	return 0;
+}
+
+/* Drain records out of the ring until told to stop. */
+static void *fm_writer_run(void *arg)
+{
+	struct fm_writer *w = arg;
+	struct fm_rec rec;
+	int err;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (!w->used && !w->stop)
+			pthread_cond_wait(&w->can_consume, &w->lock);
+		if (!w->used && w->stop) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		fm_rec_copy(&rec, &w->ring[w->tail]);
+		w->tail = (w->tail + 1) % FM_WRITER_RING_NR;
+		w->used--;
+		err = w->err;
+		pthread_cond_signal(&w->can_produce);
+		pthread_mutex_unlock(&w->lock);
+
+		/* Once a write fails, just drain and discard. */
+		if (!err)
+			err = fm_writer_apply(w->wf, &rec);
+		fm_rec_free(&rec);
+		if (err) {
+			pthread_mutex_lock(&w->lock);
+			if (!w->err)
+				w->err = err;
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* Hand a record to the writer thread, blocking if the ring is full. */
+static void fm_writer_enqueue(struct filemapper_t *wf, struct fm_rec *rec)
+{
+	struct fm_writer *w = wf->writer;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->err) {
+		pthread_mutex_unlock(&w->lock);
+		fm_rec_free(rec);
+		return;
+	}
+	while (w->used == FM_WRITER_RING_NR)
+		pthread_cond_wait(&w->can_produce, &w->lock);
+	fm_rec_copy(&w->ring[w->head], rec);
+	w->head = (w->head + 1) % FM_WRITER_RING_NR;
+	w->used++;
+	pthread_cond_signal(&w->can_consume);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Start pipelining insertions through a writer thread.  If we can't get
+ * the thread, carry on serially; this is only an optimization.
+ */
+void fm_writer_start(struct filemapper_t *wf)
+{
+	struct fm_writer *w;
+
+	/* Spilled insertions never reach the database; nothing to overlap. */
+	if (wf->writer || wf->spill)
+		return;
+
+	flush_extents(wf);
+	if (wf->db_err)
+		return;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return;
+	w->ring = calloc(FM_WRITER_RING_NR, sizeof(*w->ring));
+	if (!w->ring) {
+		free(w);
+		return;
+	}
+	w->wf = wf;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->can_produce, NULL);
+	pthread_cond_init(&w->can_consume, NULL);
+	if (pthread_create(&w->thread, NULL, fm_writer_run, w)) {
+		pthread_cond_destroy(&w->can_consume);
+		pthread_cond_destroy(&w->can_produce);
+		pthread_mutex_destroy(&w->lock);
+		free(w->ring);
+		free(w);
+		return;
+	}
+	wf->writer = w;
+}
+
+/* Wait for all queued records to land, then tear down the writer. */
+void fm_writer_stop(struct filemapper_t *wf)
+{
+	struct fm_writer *w = wf->writer;
+
+	if (!w)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->can_consume);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	if (w->err && !wf->db_err)
+		wf->db_err = w->err;
+
+	pthread_cond_destroy(&w->can_consume);
+	pthread_cond_destroy(&w->can_produce);
+	pthread_mutex_destroy(&w->lock);
+	free(w->ring);
+	free(w);
+	wf->writer = NULL;
+}
+
+/*
+ * Flat-file spill backend.  Even with the writer thread, the biggest
+ * scans spend most of their wall time inside SQLite, interleaved with
+ * the walk.  In spill mode the insertion entry points only append
+ * fixed-width records to flat files next to the database -- pure
+ * sequential writes, no SQL at all -- so the walk runs at device
+ * bandwidth.  Afterwards, fm_spill_load() maps the spill files, sorts
+ * the records into primary key order, and bulk-loads them through the
+ * regular insertion statements, committing every so many rows so the
+ * load transactions stay a reasonable size.  Variable-length strings
+ * live in their own spill; records carry the string's offset, and the
+ * NUL terminator is spilled too so the mapped file can be used as-is.
+ */
+#define FM_SPILL_TXN_NR		(1ULL << 20)	/* rows per load commit */
+
+enum fm_spill_file {
+	FM_SPILL_INODES = 0,
+	FM_SPILL_DENTRIES,
+	FM_SPILL_EXTENTS,
+	FM_SPILL_STRINGS,
+	FM_SPILL_MAX,
+};
+
+static const char *fm_spill_suffix[FM_SPILL_MAX] = {
+	[FM_SPILL_INODES]	= "inodes",
+	[FM_SPILL_DENTRIES]	= "dentries",
+	[FM_SPILL_EXTENTS]	= "extents",
+	[FM_SPILL_STRINGS]	= "strings",
+};
+
+struct fm_spill_inode {
+	int64_t ino;
+	int64_t size;
+	int64_t atime;
+	int64_t crtime;
+	int64_t ctime;
+	int64_t mtime;
+	int64_t path_off;
+	int32_t type;
+	int32_t present;	/* FM_INO_* fields actually supplied */
+};
+
+struct fm_spill_dentry {
+	int64_t dir_ino;
+	int64_t ino;
+	int64_t name_off;
+};
+
+struct fm_spill_extent {
+	int64_t ino;
+	uint64_t physical;
+	uint64_t logical;
+	uint64_t length;
+	int32_t has_logical;
+	int32_t flags;
+	int32_t type;
+	int32_t pad;
+};
+
+struct fm_spill {
+	FILE *files[FM_SPILL_MAX];
+	char *names[FM_SPILL_MAX];
+	/*
+	 * Mappers with parallel walks spill from several threads.  stdio
+	 * already serializes each record append; the lock keeps the string
+	 * offset accounting atomic with the string's append.
+	 */
+	pthread_mutex_t str_lock;
+	int64_t str_off;	/* bytes written to the string spill */
+	int err;
+};
+
+/* Tear down the spill files, leaving nothing behind on disk. */
+static void fm_spill_free(struct filemapper_t *wf)
+{
+	struct fm_spill *sp = wf->spill;
+	int i;
+
+	if (!sp)
+		return;
+	for (i = 0; i < FM_SPILL_MAX; i++) {
+		if (sp->files[i])
+			fclose(sp->files[i]);
+		if (sp->names[i]) {
+			unlink(sp->names[i]);
+			free(sp->names[i]);
+		}
+	}
+	pthread_mutex_destroy(&sp->str_lock);
+	free(sp);
+	wf->spill = NULL;
+}
+
+/* Append one fixed-width record to a spill file. */
+static void fm_spill_put(struct filemapper_t *wf, enum fm_spill_file which,
+			 const void *rec, size_t size)
+{
+	struct fm_spill *sp = wf->spill;
+
+	if (sp->err)
+		return;
+	if (fwrite(rec, size, 1, sp->files[which]) != 1) {
+		sp->err = 1;
+		wf->db_err = SQLITE_IOERR;
+	}
+}
+
+/* Append a string (and its NUL) to the string spill; returns its offset. */
+static int64_t fm_spill_put_str(struct filemapper_t *wf, const char *str)
+{
+	struct fm_spill *sp = wf->spill;
+	size_t len = strlen(str) + 1;
+	int64_t off;
+
+	pthread_mutex_lock(&sp->str_lock);
+	off = sp->str_off;
+	fm_spill_put(wf, FM_SPILL_STRINGS, str, len);
+	if (!sp->err)
+		sp->str_off = off + len;
+	pthread_mutex_unlock(&sp->str_lock);
+	return sp->err ? -1 : off;
+}
+
+/*
+ * Divert the insertion entry points into flat spill files.  Call this
+ * for full scans only -- the spill path never touches the database, so
+ * the clear-before-reinsert dance of an incremental rescan can't work.
+ * If the files can't be created, carry on through the normal SQL path;
+ * this is only an optimization.
+ */
+void fm_spill_start(struct filemapper_t *wf, const char *dbfile)
+{
+	struct fm_spill *sp;
+	char *name;
+	int i;
+
+	if (wf->spill || wf->db_err)
+		return;
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp)
+		return;
+	pthread_mutex_init(&sp->str_lock, NULL);
+	wf->spill = sp;
+	for (i = 0; i < FM_SPILL_MAX; i++) {
+		name = malloc(strlen(dbfile) + strlen(fm_spill_suffix[i]) + 8);
+		if (!name)
+			goto fail;
+		sprintf(name, "%s.%s.spill", dbfile, fm_spill_suffix[i]);
+		sp->names[i] = name;
+		sp->files[i] = fopen(name, "w+b");
+		if (!sp->files[i])
+			goto fail;
+	}
+	return;
+fail:
+	fm_spill_free(wf);
+}
+
+/* Map one spill file for the load phase. */
+static void *fm_spill_map(struct fm_spill *sp, enum fm_spill_file which,
+			  size_t *len)
+{
+	struct stat sb;
+	void *p;
+
+	*len = 0;
+	if (fflush(sp->files[which]) ||
+	    fstat(fileno(sp->files[which]), &sb)) {
+		sp->err = 1;
+		return NULL;
+	}
+	if (!sb.st_size)
+		return NULL;
+	p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		 fileno(sp->files[which]), 0);
+	if (p == MAP_FAILED) {
+		sp->err = 1;
+		return NULL;
+	}
+	*len = sb.st_size;
+	return p;
+}
+
+static int fm_spill_cmp_inode(const void *a, const void *b)
+{
+	const struct fm_spill_inode *x = a, *y = b;
+
+	return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+static int fm_spill_cmp_dentry(const void *a, const void *b)
+{
+	const struct fm_spill_dentry *x = a, *y = b;
+
+	if (x->dir_ino != y->dir_ino)
+		return (x->dir_ino > y->dir_ino) - (x->dir_ino < y->dir_ino);
+	return (x->name_off > y->name_off) - (x->name_off < y->name_off);
+}
+
+static int fm_spill_cmp_extent(const void *a, const void *b)
+{
+	const struct fm_spill_extent *x = a, *y = b;
+
+	if (x->ino != y->ino)
+		return (x->ino > y->ino) - (x->ino < y->ino);
+	if (x->logical != y->logical)
+		return (x->logical > y->logical) - (x->logical < y->logical);
+	return (x->physical > y->physical) - (x->physical < y->physical);
+}
+
+/* Commit a finished chunk of the bulk load. */
+static int fm_spill_commit(struct filemapper_t *wf, uint64_t *rows)
+{
+	if (++(*rows) % FM_SPILL_TXN_NR)
+		return 0;
+	if (sqlite3_get_autocommit(wf->db))
+		return 0;
+	return sqlite3_exec(wf->db, "END TRANSACTION; BEGIN TRANSACTION;",
+			    NULL, NULL, NULL);
+}
+
+/*
+ * Sort the spilled records and bulk-load them into the database.  Call
+ * this after the walk (and after fm_writer_stop) and before index_db();
+ * loading in primary key order builds the table btrees append-only, and
+ * feeding the sorted extents through the batched insert path lets the
+ * streaming statistics finish every inode in one pass.
+ */
+void fm_spill_load(struct filemapper_t *wf)
+{
+	struct fm_spill *sp = wf->spill;
+	struct fm_spill_inode *inos = NULL;
+	struct fm_spill_dentry *dents = NULL;
+	struct fm_spill_extent *exts = NULL;
+	char *strs = NULL;
+	size_t ino_len, dent_len, ext_len, str_len;
+	uint64_t i, nr, rows = 0;
+	int err = 0;
+
+	if (!sp)
+		return;
+	fm_phase_start(wf, "spill_load");
+	if (sp->err || wf->db_err)
+		goto out;
+
+	strs = fm_spill_map(sp, FM_SPILL_STRINGS, &str_len);
+	inos = fm_spill_map(sp, FM_SPILL_INODES, &ino_len);
+	dents = fm_spill_map(sp, FM_SPILL_DENTRIES, &dent_len);
+	exts = fm_spill_map(sp, FM_SPILL_EXTENTS, &ext_len);
+	if (sp->err) {
+		wf->db_err = SQLITE_IOERR;
+		goto out;
+	}
+
+	nr = ino_len / sizeof(*inos);
+	qsort(inos, nr, sizeof(*inos), fm_spill_cmp_inode);
+	for (i = 0; !err && i < nr; i++) {
+		struct fm_spill_inode *r = &inos[i];
+		time_t atime = r->atime;
+		time_t crtime = r->crtime;
+		time_t ctime = r->ctime;
+		time_t mtime = r->mtime;
+		int64_t size = r->size;
+
+		err = do_insert_inode(wf, r->ino, r->type, strs + r->path_off,
+				r->present & FM_INO_ATIME ? &atime : NULL,
+				r->present & FM_INO_CRTIME ? &crtime : NULL,
+				r->present & FM_INO_CTIME ? &ctime : NULL,
+				r->present & FM_INO_MTIME ? &mtime : NULL,
+				r->present & FM_INO_SIZE ? &size : NULL);
+		if (!err)
+			err = fm_spill_commit(wf, &rows);
+	}
+
+	nr = dent_len / sizeof(*dents);
+	qsort(dents, nr, sizeof(*dents), fm_spill_cmp_dentry);
+	for (i = 0; !err && i < nr; i++) {
+		struct fm_spill_dentry *r = &dents[i];
+
+		err = do_insert_dentry(wf, r->dir_ino, strs + r->name_off,
+				       r->ino);
+		if (!err)
+			err = fm_spill_commit(wf, &rows);
+	}
+
+	nr = ext_len / sizeof(*exts);
+	qsort(exts, nr, sizeof(*exts), fm_spill_cmp_extent);
+	for (i = 0; !err && i < nr; i++) {
+		struct fm_spill_extent *r = &exts[i];
+		struct extent_rec rec = {
+			.ino = r->ino,
+			.physical = r->physical,
+			.logical = r->logical,
+			.length = r->length,
+			.has_logical = r->has_logical,
+			.flags = r->flags,
+			.type = r->type,
+		};
+
+		err = insert_extent_rec(wf, &rec);
+		if (!err)
+			err = fm_spill_commit(wf, &rows);
+	}
+
+	if (err && !wf->db_err)
+		wf->db_err = err;
+out:
+	if (inos)
+		munmap(inos, ino_len);
+	if (dents)
+		munmap(dents, dent_len);
+	if (exts)
+		munmap(exts, ext_len);
+	if (strs)
+		munmap(strs, str_len);
+	fm_spill_free(wf);
+	fm_phase_stop(wf, "spill_load");
+}
+
+/*
+ * Arena for per-directory scratch memory.  Scan callbacks need the same
+ * short-lived buffers for every directory they map -- dirent blocks,
+ * ioctl arguments, assembled child paths -- and calling malloc for each
+ * one dominates the CPU profile once the actual reads overlap.  The
+ * arena bump-allocates out of a list of big chunks and is rewound
+ * between directories without freeing anything, so after the first few
+ * directories the steady-state walk makes no malloc calls at all.
+ */
+#define FM_ARENA_CHUNK		(256U << 10)
+
+struct fm_arena_chunk {
+	struct fm_arena_chunk *next;
+	size_t size;
+	size_t used;
+	/* chunk memory follows */
+};
+
+struct fm_arena {
+	struct fm_arena_chunk *chunks;
+};
+
+/* Carve a piece out of the arena.  Freed only by resetting the arena. */
+void *fm_arena_alloc(struct fm_arena *arena, size_t len)
+{
+	struct fm_arena_chunk *c;
+	size_t size;
+	void *p;
+
+	len = (len + 15) & ~(size_t)15;
+	for (c = arena->chunks; c != NULL; c = c->next) {
+		if (c->size - c->used >= len)
+			break;
+	}
+	if (!c) {
+		size = len > FM_ARENA_CHUNK ? len : FM_ARENA_CHUNK;
+		c = malloc(sizeof(*c) + size);
+		if (!c)
+			return NULL;
+		c->size = size;
+		c->used = 0;
+		c->next = arena->chunks;
+		arena->chunks = c;
+	}
+	p = (char *)(c + 1) + c->used;
+	c->used += len;
+	return p;
+}
+
+/* Rewind the arena, keeping the chunks for the next directory. */
+static void fm_arena_reset(struct fm_arena *arena)
+{
+	struct fm_arena_chunk *c;
+
+	for (c = arena->chunks; c != NULL; c = c->next)
+		c->used = 0;
+}
+
+static void fm_arena_destroy(struct fm_arena *arena)
+{
+	struct fm_arena_chunk *c;
+
+	while (arena->chunks) {
+		c = arena->chunks;
+		arena->chunks = c->next;
+		free(c);
+	}
+}
+
+/*
+ * Parallel directory traversal.  Tree walks are latency-bound -- each
+ * directory read waits out a full storage round trip -- so a pool of
+ * walkers keeps several reads in flight.  Pending directories sit in a
+ * shared stack; idle walkers pop the most recently pushed entry (depth
+ * first, for dcache locality) and push whatever subdirectories they
+ * find, so a thread that lands on a bushy subtree feeds the threads
+ * that ran dry.  Every walker works on its own copy of the mapper
+ * state and the database records funnel through the writer ring or the
+ * spill files, both of which take concurrent producers; with neither
+ * active there is nobody to serialize database access, so the walk
+ * falls back to a single thread.
+ */
+struct fm_walk {
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	struct fm_walk_item *items;
+	unsigned int nr;
+	unsigned int cap;
+	unsigned int active;	/* walkers currently inside the callback */
+	int serial;		/* single walker, working on wf itself */
+	int err;
+	int db_err;
+	fm_walk_fn fn;
+	void *arg;
+	struct filemapper_t *wf;
+};
+
+/* Queue a directory for some walker to process.  Copies the path. */
+void fm_walk_push(struct filemapper_t *wf, int64_t ino, const char *path)
+{
+	struct fm_walk *w = wf->walk;
+	struct fm_walk_item *item;
+	char *dup;
+
+	dup = strdup(path);
+	if (!dup) {
+		wf->db_err = SQLITE_NOMEM;
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	if (w->nr == w->cap) {
+		unsigned int cap = w->cap ? w->cap * 2 : 64;
+
+		item = realloc(w->items, cap * sizeof(*item));
+		if (!item) {
+			pthread_mutex_unlock(&w->lock);
+			free(dup);
+			wf->db_err = SQLITE_NOMEM;
+			return;
+		}
+		w->items = item;
+		w->cap = cap;
+	}
+	item = &w->items[w->nr++];
+	item->ino = ino;
+	item->path = dup;
+	pthread_cond_signal(&w->more);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Pop directories and process them until the whole tree has been walked. */
+static void *fm_walk_thread(void *arg)
+{
+	struct fm_walk *w = arg;
+	struct filemapper_t twf;
+	struct filemapper_t *wf;
+	struct fm_walk_item item;
+	struct fm_arena arena = { NULL };
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		if (w->err || w->db_err || (w->serial && w->wf->db_err)) {
+			pthread_cond_broadcast(&w->more);
+			break;
+		}
+		if (w->nr == 0) {
+			if (w->active == 0) {
+				/* Nobody left to push more work. */
+				pthread_cond_broadcast(&w->more);
+				break;
+			}
+			pthread_cond_wait(&w->more, &w->lock);
+			continue;
+		}
+		item = w->items[--w->nr];
+		item.arena = &arena;
+		w->active++;
+		pthread_mutex_unlock(&w->lock);
+
+		if (w->serial) {
+			/*
+			 * A single walker works on the real mapper state;
+			 * anything the inserts cache in it (statement
+			 * handles, the extent batch) has to survive the
+			 * walk.
+			 */
+			wf = w->wf;
+		} else {
+			twf = *w->wf;
+			twf.db_err = 0;
+			/*
+			 * A checkpoint commit assumes everything enqueued
+			 * before it describes whole inodes, which isn't
+			 * true with several walkers enqueueing
+			 * concurrently.
+			 */
+			twf.ckpt_enabled = 0;
+			wf = &twf;
+		}
+		w->fn(wf, &item, w->arg);
+		free(item.path);
+		fm_arena_reset(&arena);
+
+		pthread_mutex_lock(&w->lock);
+		w->active--;
+		if (!w->serial && twf.db_err && !w->db_err)
+			w->db_err = twf.db_err;
+	}
+	pthread_mutex_unlock(&w->lock);
+	fm_arena_destroy(&arena);
+	return NULL;
+}
+
+/* Record a non-database error and wake everybody up to quit. */
+void fm_walk_fail(struct filemapper_t *wf, int err)
+{
+	struct fm_walk *w = wf->walk;
+
+	pthread_mutex_lock(&w->lock);
+	if (!w->err)
+		w->err = err;
+	pthread_cond_broadcast(&w->more);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Walk a directory tree with a pool of threads, starting from the root
+ * item.  fn is handed one queued directory at a time along with a
+ * per-thread copy of *wf -- or *wf itself when the walk runs single
+ * threaded, so that state the inserts cache in it isn't lost.  Items
+ * carry only a path -- the callback opens whatever it needs when it
+ * picks one up, so a deep queue never pins open file descriptors.  It
+ * pushes any subdirectories it finds with fm_walk_push().  Returns the
+ * first non-database error; database errors latch into wf->db_err as
+ * usual.
+ */
+int fm_walk_run(struct filemapper_t *wf, int nr_threads, fm_walk_fn fn,
+		void *arg, int64_t ino, const char *path)
+{
+	struct fm_walk w;
+	pthread_t *threads;
+	int t, started;
+
+	if (nr_threads < 1)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	/* Without the writer thread, nobody serializes database access. */
+	if (!wf->writer && !wf->spill)
+		nr_threads = 1;
+
+	/*
+	 * Several walkers interleave each inode's extents, so the
+	 * streaming statistics would latch a partial first run for every
+	 * inode; let calc_inode_stats() compute them afterwards.
+	 */
+	if (nr_threads > 1)
+		disable_streaming_stats(wf);
+
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.more, NULL);
+	w.fn = fn;
+	w.arg = arg;
+	w.wf = wf;
+	wf->walk = &w;
+
+	fm_walk_push(wf, ino, path);
+	if (wf->db_err)
+		goto out;
+
+	if (nr_threads > 1) {
+		threads = calloc(nr_threads, sizeof(*threads));
+		if (!threads) {
+			w.err = ENOMEM;
+			goto out;
+		}
+		started = 0;
+		for (t = 0; t < nr_threads; t++) {
+			if (pthread_create(&threads[t], NULL, fm_walk_thread,
+					   &w))
+				break;
+			started++;
+		}
+		if (!started) {
+			w.serial = 1;
+			fm_walk_thread(&w);
+		}
+		for (t = 0; t < started; t++)
+			pthread_join(threads[t], NULL);
+		free(threads);
+	} else {
+		w.serial = 1;
+		fm_walk_thread(&w);
+	}
+
+	if (w.db_err && !wf->db_err)
+		wf->db_err = w.db_err;
+out:
+	/* An aborted walk leaves unprocessed directories behind. */
+	while (w.nr > 0)
+		free(w.items[--w.nr].path);
+	free(w.items);
+	pthread_cond_destroy(&w.more);
+	pthread_mutex_destroy(&w.lock);
+	wf->walk = NULL;
+	return w.err;
+}
+
+/*
+ * Remove an inode's stale rows before its first re-insertion of this
+ * scan.  The delete rides the writer ring like any other record so that
+ * it lands ahead of the new rows.
+ */
+static void rescan_clear_inode(struct filemapper_t *wf, int64_t ino)
+{
+	struct fm_rescan *r = wf->rescan;
+	struct fm_inosig *e;
+	int settled;
+
+	if (!r)
+		return;
+	pthread_mutex_lock(&r->lock);
+	e = rescan_slot(r, ino);
+	settled = !(e->flags & SIG_PRESENT) || (e->flags & SIG_SETTLED);
+	if (!settled)
+		e->flags |= SIG_SETTLED;
+	pthread_mutex_unlock(&r->lock);
+	if (settled)
+		return;
+
+	if (wf->writer) {
+		struct fm_rec rec = {
+			.rtype = FM_REC_CLEAR,
+		};
+
+		rec.clear.ino = ino;
+		fm_writer_enqueue(wf, &rec);
+		return;
+	}
+
+	wf->db_err = do_clear_inode(wf, ino);
+}
+
+/*
+ * Decide whether an inode must be re-walked.  Anything without a clean
+ * signature from the previous scan (or running in full-scan mode) needs
+ * the walk; a validated inode keeps all of its old rows.
+ */
+int inode_needs_rescan(struct filemapper_t *wf, int64_t ino, time_t ctime)
+{
+	struct fm_rescan *r = wf->rescan;
+	struct fm_inosig *e;
+	int rescan = 1;
+
+	if (!r)
+		return 1;
+	pthread_mutex_lock(&r->lock);
+	e = rescan_slot(r, ino);
+	if ((e->flags & SIG_PRESENT) && (e->flags & SIG_HASCTIME) &&
+	    e->ctime == ctime && ctime < r->last_scan) {
+		e->flags |= SIG_SETTLED | SIG_KEPT;
+		rescan = 0;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return rescan;
+}
+
+/*
+ * Start committing the scan periodically so that it can be resumed.
+ * Checkpoints are only worth anything if an interrupted transaction can
+ * be rolled back, so trade the in-memory journal for a real one; the
+ * journal bypasses the compression VFS, which only touches the main
+ * database file.  Call this before opening the scan transaction.
+ */
+void enable_checkpoints(struct filemapper_t *wf)
+{
+	run_batch_query(wf, "PRAGMA journal_mode = TRUNCATE;\
+PRAGMA synchronous = NORMAL;\
+CREATE TABLE IF NOT EXISTS checkpoint_t(timestamp INTEGER NOT NULL, group_nr INTEGER NOT NULL);");
+	if (wf->db_err)
+		return;
+	wf->ckpt_enabled = 1;
+	wf->last_ckpt = time(NULL);
+}
+
+/*
+ * Note that everything up to a natural boundary (a finished directory,
+ * block group, or AG) has been inserted.  The mappers call this often;
+ * the actual commit is rate-limited here, and rides the writer ring so
+ * that it lands after the records it covers.
+ */
+void checkpoint_db(struct filemapper_t *wf, int64_t group_nr)
+{
+	time_t now;
+
+	if (!wf->ckpt_enabled || wf->db_err)
+		return;
+	now = time(NULL);
+	if (now - wf->last_ckpt < FM_CKPT_INTERVAL)
+		return;
+	wf->last_ckpt = now;
+
+	if (wf->writer) {
+		struct fm_rec rec = {
+			.rtype = FM_REC_CKPT,
+		};
+
+		rec.ckpt.group_nr = group_nr;
+		fm_writer_enqueue(wf, &rec);
+		return;
+	}
+
+	wf->db_err = do_checkpoint(wf, group_nr);
+}
+
+/* Insert an inode record into the inode and path tables */
+void insert_inode(struct filemapper_t *wf, int64_t ino, int type,
+		  const char *path, time_t *atime, time_t *crtime,
+		  time_t *ctime, time_t *mtime, int64_t *size)
+{
+	rescan_clear_inode(wf, ino);
+	if (wf->db_err)
+		return;
+
+	if (wf->stats)
+		fm_stats_count(&wf->stats->inode_rows);
+
+	if (wf->spill) {
+		struct fm_spill_inode rec = {
+			.ino = ino,
+			.type = type,
+		};
+
+		rec.path_off = fm_spill_put_str(wf, path);
+		if (atime) {
+			rec.atime = *atime;
+			rec.present |= FM_INO_ATIME;
+		}
+		if (crtime) {
+			rec.crtime = *crtime;
+			rec.present |= FM_INO_CRTIME;
+		}
+		if (ctime) {
+			rec.ctime = *ctime;
+			rec.present |= FM_INO_CTIME;
+		}
+		if (mtime) {
+			rec.mtime = *mtime;
+			rec.present |= FM_INO_MTIME;
+		}
+		if (size) {
+			rec.size = *size;
+			rec.present |= FM_INO_SIZE;
+		}
+		fm_spill_put(wf, FM_SPILL_INODES, &rec, sizeof(rec));
+		return;
+	}
+
+	if (wf->writer) {
+		struct fm_rec rec = {
+			.rtype = FM_REC_INODE,
+		};
+
+		rec.ino.ino = ino;
+		rec.ino.type = type;
+		rec.ino.path = fm_rec_strput(&rec, path);
+		if (!rec.ino.path) {
+			wf->db_err = SQLITE_NOMEM;
+			return;
+		}
+		if (atime) {
+			rec.ino.atime = *atime;
+			rec.ino.present |= FM_INO_ATIME;
+		}
+		if (crtime) {
+			rec.ino.crtime = *crtime;
+			rec.ino.present |= FM_INO_CRTIME;
+		}
+		if (ctime) {
+			rec.ino.ctime = *ctime;
+			rec.ino.present |= FM_INO_CTIME;
+		}
+		if (mtime) {
+			rec.ino.mtime = *mtime;
+			rec.ino.present |= FM_INO_MTIME;
+		}
+		if (size) {
+			rec.ino.size = *size;
+			rec.ino.present |= FM_INO_SIZE;
+		}
+		fm_writer_enqueue(wf, &rec);
+		return;
+	}
+
+	wf->db_err = do_insert_inode(wf, ino, type, path, atime, crtime,
+				     ctime, mtime, size);
+}
+
+/* Insert a directory entry into the database. */
+void insert_dentry(struct filemapper_t *wf, int64_t dir_ino,
+		   const char *name, int64_t ino)
+{
+	if (wf->stats)
+		fm_stats_count(&wf->stats->dentry_rows);
+
+	if (wf->spill) {
+		struct fm_spill_dentry rec = {
+			.dir_ino = dir_ino,
+			.ino = ino,
+		};
+
+		rec.name_off = fm_spill_put_str(wf, name);
+		fm_spill_put(wf, FM_SPILL_DENTRIES, &rec, sizeof(rec));
+		return;
+	}
+
+	if (wf->writer) {
+		struct fm_rec rec = {
+			.rtype = FM_REC_DENTRY,
+		};
+
+		rec.dentry.dir_ino = dir_ino;
+		rec.dentry.name = fm_rec_strput(&rec, name);
+		if (!rec.dentry.name) {
+			wf->db_err = SQLITE_NOMEM;
+			return;
+		}
+		rec.dentry.ino = ino;
+		fm_writer_enqueue(wf, &rec);
+		return;
+	}
+
+	wf->db_err = do_insert_dentry(wf, dir_ino, name, ino);
+}
+
+/* Insert an extent into the database. */
+void insert_extent(struct filemapper_t *wf, int64_t ino, uint64_t physical,
+		   uint64_t *logical, uint64_t length, int flags, int type)
+{
+	struct extent_batch *batch = wf->ext_batch;
+	struct extent_rec *rec;
+
+	dbg_printf("%s: ino=%"PRId64" phys=%"PRIu64" logical=%"PRIu64" len=%"PRIu64" flags=0x%x type=%d\n", __func__,
+		   ino, physical, logical ? *logical : 0, length, flags, type);
+
+	if (wf->stats)
+		fm_stats_count(&wf->stats->extent_rows);
+
+	if (wf->spill) {
+		struct fm_spill_extent rec = {
+			.ino = ino,
+			.physical = physical,
+			.logical = logical ? *logical : 0,
+			.length = length,
+			.has_logical = (logical != NULL),
+			.flags = flags,
+			.type = type,
+		};
+
+		fm_spill_put(wf, FM_SPILL_EXTENTS, &rec, sizeof(rec));
+		return;
+	}
+
+	if (wf->writer) {
+		struct fm_rec wrec = {
+			.rtype = FM_REC_EXTENT,
+		};
+
+		wrec.ext.ino = ino;
+		wrec.ext.physical = physical;
+		wrec.ext.has_logical = (logical != NULL);
+		wrec.ext.logical = logical ? *logical : 0;
+		wrec.ext.length = length;
+		wrec.ext.flags = flags;
+		wrec.ext.type = type;
+		fm_writer_enqueue(wf, &wrec);
+		return;
+	}
+
+	if (!batch) {
+		batch = calloc(1, sizeof(*batch));
+		if (!batch) {
+			wf->db_err = SQLITE_NOMEM;
+			return;
+		}
+		wf->ext_batch = batch;
+	}
+
+	rec = &batch->recs[batch->used++];
+	rec->ino = ino;
+	rec->physical = physical;
+	rec->has_logical = (logical != NULL);
+	rec->logical = logical ? *logical : 0;
+	rec->length = length;
+	rec->flags = flags;
+	rec->type = type;
+
+	if (batch->used == EXTENT_BATCH_NR)
+		flush_extents(wf);
+}
+
+void inject_metadata(struct filemapper_t *wf, int64_t parent_ino,
+		     const char *path, int64_t ino, const char *name,
+		     int type)
+{
+	char __path[PATH_MAX + 1];
+
+	snprintf(__path, PATH_MAX, "%s/%s", path, name);
+	wf->dirpath = path;
+	insert_inode(wf, ino, type, __path, NULL, NULL, NULL, NULL, NULL);
+	if (wf->db_err)
+		return;
+
+	/*
+	 * On a rescan, a parent that validated as unchanged kept all of
+	 * its old dentries, including the one pointing at us.
+	 */
+	if (wf->rescan) {
+		struct fm_inosig *e;
+		int kept;
+
+		pthread_mutex_lock(&wf->rescan->lock);
+		e = rescan_slot(wf->rescan, parent_ino);
+		kept = (e->flags & SIG_PRESENT) && (e->flags & SIG_KEPT);
+		pthread_mutex_unlock(&wf->rescan->lock);
+		if (kept)
+			return;
+	}
+
+	insert_dentry(wf, parent_ino, name, ino);
+	if (wf->db_err)
+		return;
+}
+
+/* Store fs statistics in the database */
+void collect_fs_stats(struct filemapper_t *wf, char *fs_name,
+		      uint32_t blocksize, uint32_t fragsize,
+		      uint64_t total_bytes, uint64_t free_bytes,
+		      uint64_t total_inodes, uint64_t free_inodes,
+		      unsigned int max_name_len, const char *fstype)
+{
+	const char *sql = "INSERT INTO fs_t VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 0, ?, ?);";
+	char p[PATH_MAX + 1];
 	sqlite3_stmt *stmt;
+	time_t t;
+	int err, err2, col = 1;
+
+	err = sqlite3_prepare_v2(wf->db, sql, -1, &stmt, NULL);
+	if (err)
+		goto out;
+	err = icvt(wf, fs_name, strlen(fs_name), p, PATH_MAX);
+	if (err)
+		goto out;
+	err = sqlite3_bind_text(stmt, col++, p, -1, SQLITE_STATIC);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int(stmt, col++, blocksize);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int(stmt, col++, fragsize);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int64(stmt, col++, total_bytes);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int64(stmt, col++, free_bytes);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int64(stmt, col++, free_bytes);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int64(stmt, col++, total_inodes);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int64(stmt, col++, free_inodes);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int64(stmt, col++, free_inodes);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int(stmt, col++, max_name_len);
+	if (err)
+		goto out;
+	t = time(NULL);
+	err = sqlite3_bind_int64(stmt, col++, t);
+	if (err)
+		goto out;
+	err = sqlite3_bind_text(stmt, col++, "/", -1, SQLITE_STATIC);
+	if (err)
+		goto out;
+	err = sqlite3_bind_text(stmt, col++, fstype, -1, SQLITE_STATIC);
+	if (err)
+		goto out;
+	err = sqlite3_step(stmt);
+	if (err && err != SQLITE_DONE)
+		goto out;
+	err = 0;
+out:
+	err2 = sqlite3_finalize(stmt);
+	if (!err && err2)
+		err = err2;
+	wf->db_err = err;
+}
+
+/* Mark the database as complete. */
+void finalize_fs_stats(struct filemapper_t *wf, char *fs_name)
+{
+	const char *sql = "UPDATE fs_t SET finished = 1 WHERE path = ?;";
+	char p[PATH_MAX + 1];
+	sqlite3_stmt *stmt = NULL;
 	int64_t total_bytes, max_pend;
 	int err, err2, col = 1;
 
+	flush_extents(wf);
+	if (wf->db_err)
+		return;
+
+	/* The scan is complete; the resume cursor is now meaningless. */
+	if (wf->ckpt_enabled) {
+		err = sqlite3_exec(wf->db, "DELETE FROM checkpoint_t;",
+				   NULL, NULL, NULL);
+		if (err)
+			goto out;
+	}
+
 	err = sqlite3_prepare_v2(wf->db, sql, -1, &stmt, NULL);
 	if (err)
 		goto out;
@@ -495,19 +2327,41 @@ out:
 	wf->db_err = err;
 }
 
-/* Generate an overview cache. */
+/*
+ * Generate overview caches for every power-of-two zoom level up to
+ * length.  Rather than rescanning extent_t per level and bumping one
+ * cell at a time (a freespace extent spanning half the disk touches
+ * half the cells), read the extents once, record each one as a +1/-1
+ * pair in a difference array per level, and recover the actual counts
+ * with a prefix sum before writing all the levels out.
+ *
+ * overview_base_t records which level is the finest and the fs size it
+ * was computed against; readers wanting any other length (or finding
+ * that total_bytes has since been rewritten) re-bin that level in
+ * memory instead of rescanning the extents.
+ */
 void cache_overview(struct filemapper_t *wf, uint64_t length)
 {
 	sqlite3 *db = wf->db;
 	uint64_t start_cell, end_cell, i;
 	uint64_t e_p_off, e_p_end;
+	uint64_t len;
 	double bytes_per_cell;
-	int e_type;
+	int e_type, field;
+	unsigned int nr_levels, lvl;
 	sqlite3_stmt *stmt = NULL;
-	struct overview_t *overview = NULL;
+	struct overview_t **diffs = NULL;
+	struct overview_t sum;
+	uint64_t *counter, *delta;
 	int err, err2;
 	uint64_t total_bytes;
 	char *sql;
+	unsigned int f;
+
+	flush_extents(wf);
+	if (wf->db_err)
+		return;
+	fm_phase_start(wf, "cache_overview");
 
 	/* How many bytes do we know about? */
 	sql = "SELECT total_bytes FROM fs_t";
@@ -526,14 +2380,22 @@ void cache_overview(struct filemapper_t *wf, uint64_t length)
 	if (err)
 		goto out;
 
-	/* Allocate memory */
-	overview = calloc(length, sizeof(*overview));
-	if (overview == NULL) {
+	/* One difference array per zoom level, plus a slot past the end. */
+	nr_levels = 0;
+	for (len = length; len; len >>= 1)
+		nr_levels++;
+	diffs = calloc(nr_levels, sizeof(*diffs));
+	if (diffs == NULL) {
 		err = SQLITE_NOMEM;
 		goto out;
 	}
-
-	bytes_per_cell = (double)total_bytes / length;
+	for (lvl = 0, len = length; lvl < nr_levels; lvl++, len >>= 1) {
+		diffs[lvl] = calloc(len + 1, sizeof(*diffs[lvl]));
+		if (diffs[lvl] == NULL) {
+			err = SQLITE_NOMEM;
+			goto out;
+		}
+	}
 
 	/* Aggregate the extents */
 	sql = "SELECT p_off, p_end, type FROM extent_t;";
@@ -545,40 +2407,49 @@ void cache_overview(struct filemapper_t *wf, uint64_t length)
 		e_p_off = sqlite3_column_int64(stmt, 0);
 		e_p_end = sqlite3_column_int64(stmt, 1);
 		e_type = sqlite3_column_int(stmt, 2);
-		start_cell = e_p_off / bytes_per_cell;
-		end_cell = e_p_end / bytes_per_cell;
-		assert(start_cell < length && end_cell < length);
 
 		switch (e_type) {
 		case EXT_TYPE_FILE:
-			for (i = start_cell; i <= end_cell; i++)
-				overview[i].files++;
+			field = 0;
 			break;
 		case EXT_TYPE_DIR:
-			for (i = start_cell; i <= end_cell; i++)
-				overview[i].dirs++;
+			field = 1;
 			break;
 		case EXT_TYPE_EXTENT:
-			for (i = start_cell; i <= end_cell; i++)
-				overview[i].mappings++;
+			field = 2;
 			break;
 		case EXT_TYPE_METADATA:
-			for (i = start_cell; i <= end_cell; i++)
-				overview[i].metadata++;
+			field = 3;
 			break;
 		case EXT_TYPE_XATTR:
-			for (i = start_cell; i <= end_cell; i++)
-				overview[i].xattrs++;
+			field = 4;
 			break;
 		case EXT_TYPE_SYMLINK:
-			for (i = start_cell; i <= end_cell; i++)
-				overview[i].symlinks++;
+			field = 5;
 			break;
 		case EXT_TYPE_FREESP:
-			for (i = start_cell; i <= end_cell; i++)
-				overview[i].freesp++;
+			field = 6;
 			break;
+		default:
+			field = -1;
+			break;
+		}
+		if (field < 0)
+			goto next;
+
+		for (lvl = 0, len = length; lvl < nr_levels; lvl++, len >>= 1) {
+			bytes_per_cell = (double)total_bytes / len;
+			start_cell = e_p_off / bytes_per_cell;
+			end_cell = e_p_end / bytes_per_cell;
+			assert(start_cell < len && end_cell < len);
+
+			/* overview_t is seven adjacent counters. */
+			delta = &diffs[lvl][start_cell].files;
+			delta[field]++;
+			delta = &diffs[lvl][end_cell + 1].files;
+			delta[field]--;
 		}
+next:
 		err = sqlite3_step(stmt);
 	}
 	if (err && err != SQLITE_DONE)
@@ -588,58 +2459,132 @@ void cache_overview(struct filemapper_t *wf, uint64_t length)
 		goto out;
 	stmt = NULL;
 
-	/* Now spit it back to the database */
+	/* Now spit it all back to the database */
 	err = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO overview_t VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);",
 				 -1, &stmt, NULL);
 	if (err)
 		goto out;
-	for (i = 0; i < length; i++) {
-		err = sqlite3_bind_int64(stmt, 1, length);
-		if (err)
-			goto out;
-		err = sqlite3_bind_int64(stmt, 2, i);
-		if (err)
-			goto out;
-		err = sqlite3_bind_int64(stmt, 3, overview[i].files);
-		if (err)
-			goto out;
-		err = sqlite3_bind_int64(stmt, 4, overview[i].dirs);
-		if (err)
-			goto out;
-		err = sqlite3_bind_int64(stmt, 5, overview[i].mappings);
-		if (err)
-			goto out;
-		err = sqlite3_bind_int64(stmt, 6, overview[i].metadata);
-		if (err)
-			goto out;
-		err = sqlite3_bind_int64(stmt, 7, overview[i].xattrs);
-		if (err)
-			goto out;
-		err = sqlite3_bind_int64(stmt, 8, overview[i].symlinks);
-		if (err)
-			goto out;
-		err = sqlite3_bind_int64(stmt, 9, overview[i].freesp);
-		if (err)
-			goto out;
-		err = sqlite3_step(stmt);
-		if (err && err != SQLITE_DONE)
-			goto out;
-		err = sqlite3_reset(stmt);
-		if (err)
-			goto out;
+	for (lvl = 0, len = length; lvl < nr_levels; lvl++, len >>= 1) {
+		memset(&sum, 0, sizeof(sum));
+		counter = &sum.files;
+		for (i = 0; i < len; i++) {
+			delta = &diffs[lvl][i].files;
+			for (f = 0; f < 7; f++)
+				counter[f] += delta[f];
+
+			err = sqlite3_bind_int64(stmt, 1, len);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmt, 2, i);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmt, 3, sum.files);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmt, 4, sum.dirs);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmt, 5, sum.mappings);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmt, 6, sum.metadata);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmt, 7, sum.xattrs);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmt, 8, sum.symlinks);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmt, 9, sum.freesp);
+			if (err)
+				goto out;
+			err = sqlite3_step(stmt);
+			if (err && err != SQLITE_DONE)
+				goto out;
+			err = sqlite3_reset(stmt);
+			if (err)
+				goto out;
+		}
 	}
+	err = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (err)
+		goto out;
+
+	/* Remember the finest level and the fs size it spans. */
+	err = sqlite3_exec(db, "DELETE FROM overview_base_t;", NULL, NULL,
+			   NULL);
+	if (err)
+		goto out;
+	err = sqlite3_prepare_v2(db, "INSERT INTO overview_base_t VALUES (?, ?);",
+				 -1, &stmt, NULL);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int64(stmt, 1, length);
+	if (err)
+		goto out;
+	err = sqlite3_bind_int64(stmt, 2, total_bytes);
+	if (err)
+		goto out;
+	err = sqlite3_step(stmt);
+	if (err && err != SQLITE_DONE)
+		goto out;
+	err = 0;
 out:
 	err2 = sqlite3_finalize(stmt);
 	if (!err)
 		err = err2;
-	free(overview);
+	if (diffs)
+		for (lvl = 0; lvl < nr_levels; lvl++)
+			free(diffs[lvl]);
+	free(diffs);
+	wf->db_err = err;
+	fm_phase_stop(wf, "cache_overview");
+}
+
+/*
+ * Drop a leftover path_t.  It was a real table before the paths grew
+ * prefix compression, and a typed DROP of the wrong kind is an error,
+ * so ask sqlite_master which kind this database has.
+ */
+static void drop_old_path_t(struct filemapper_t *wf)
+{
+	sqlite3_stmt *stmt = NULL;
+	int err, err2, is_table = 0, found = 0;
+
+	err = sqlite3_prepare_v2(wf->db,
+			"SELECT type FROM sqlite_master WHERE name = 'path_t';",
+			-1, &stmt, NULL);
+	if (err)
+		goto out;
+	err = sqlite3_step(stmt);
+	if (err == SQLITE_ROW) {
+		found = 1;
+		is_table = !strcmp((const char *)sqlite3_column_text(stmt, 0),
+				   "table");
+	} else if (err != SQLITE_DONE) {
+		goto out;
+	}
+	err = 0;
+out:
+	err2 = sqlite3_finalize(stmt);
+	if (!err && err2)
+		err = err2;
+	if (!err && found)
+		err = sqlite3_exec(wf->db, is_table ? "DROP TABLE path_t;" :
+				   "DROP VIEW path_t;", NULL, NULL, NULL);
 	wf->db_err = err;
 }
 
 /* Prepare database to receive new data */
 void prepare_db(struct filemapper_t *wf)
 {
+	fm_stats_start(wf);
 	run_batch_query(wf, opschema);
+	if (wf->db_err)
+		return;
+	drop_old_path_t(wf);
 	if (wf->db_err)
 		return;
 	run_batch_query(wf, dbschema);
@@ -647,10 +2592,366 @@ void prepare_db(struct filemapper_t *wf)
 		return;
 }
 
+/*
+ * Load an existing database's inode signatures into the in-core rescan
+ * map, treating rows older than last_scan as candidates for keeping.
+ */
+static int rescan_load(struct filemapper_t *wf, int64_t last_scan)
+{
+	struct fm_rescan *r = NULL;
+	sqlite3_stmt *stmt = NULL;
+	int err;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -1;
+	pthread_mutex_init(&r->lock, NULL);
+	r->last_scan = last_scan;
+	r->cap = 1ULL << 16;
+	r->slots = calloc(r->cap, sizeof(struct fm_inosig));
+	if (!r->slots)
+		goto fail;
+
+	/* Databases from before prefix compression need a full rescan. */
+	err = sqlite3_prepare_v2(wf->db,
+			"SELECT name FROM sqlite_master WHERE name = 'pathname_t' AND type = 'table';",
+			-1, &stmt, NULL);
+	if (err)
+		goto fail;
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW)
+		goto fail;
+	err = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (err)
+		goto fail;
+
+	/* Load the previous scan's inode signatures. */
+	err = sqlite3_prepare_v2(wf->db, "SELECT ino, ctime FROM inode_t;",
+				 -1, &stmt, NULL);
+	if (err)
+		goto fail;
+	while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		int hasctime = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+
+		err = rescan_store(r, sqlite3_column_int64(stmt, 0),
+				   sqlite3_column_int64(stmt, 1),
+				   hasctime ? SIG_HASCTIME : 0);
+		if (err)
+			goto fail;
+	}
+	if (err != SQLITE_DONE)
+		goto fail;
+	err = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (err)
+		goto fail;
+
+	/*
+	 * The fs stats and overviews are regenerated from scratch every
+	 * scan; clear them out so the usual insertion paths work.
+	 */
+	err = sqlite3_exec(wf->db, "DELETE FROM fs_t; DELETE FROM overview_t;"
+			   "CREATE TABLE IF NOT EXISTS overview_base_t(length INTEGER NOT NULL, total_bytes INTEGER NOT NULL);"
+			   "DELETE FROM overview_base_t;",
+			   NULL, NULL, NULL);
+	if (err)
+		goto fail;
+
+	wf->rescan = r;
+	return 0;
+fail:
+	sqlite3_finalize(stmt);
+	free(r->slots);
+	free(r);
+	return -1;
+}
+
+/*
+ * Prepare an existing database for an incremental rescan.  Returns
+ * nonzero if the database isn't a finished scan we can update in place;
+ * the caller should fall back to prepare_db() and a full walk.
+ */
+int prepare_db_incremental(struct filemapper_t *wf)
+{
+	sqlite3_stmt *stmt = NULL;
+	int64_t last_scan;
+	int err;
+
+	fm_stats_start(wf);
+	run_batch_query(wf, opschema);
+	if (wf->db_err)
+		return -1;
+
+	/* A usable previous scan has a single finished fs_t row. */
+	err = sqlite3_prepare_v2(wf->db,
+			"SELECT timestamp, finished FROM fs_t;", -1,
+			&stmt, NULL);
+	if (err)
+		return -1;
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW || !sqlite3_column_int(stmt, 1)) {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+	last_scan = sqlite3_column_int64(stmt, 0);
+	err = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (err)
+		return -1;
+
+	return rescan_load(wf, last_scan);
+}
+
+/*
+ * Prepare a checkpointed but unfinished database so that a scan that
+ * died can pick up where the last commit left off.  Rows committed by
+ * the final checkpoint are treated exactly like a previous scan's rows:
+ * unchanged inodes keep them, everything else is re-walked.  Returns
+ * nonzero if there's no checkpoint to resume from; the caller should
+ * fall back to a fresh scan.
+ */
+int prepare_db_resume(struct filemapper_t *wf)
+{
+	sqlite3_stmt *stmt = NULL;
+	int64_t last_ckpt;
+	int err;
+
+	fm_stats_start(wf);
+	run_batch_query(wf, opschema);
+	if (wf->db_err)
+		return -1;
+
+	/* Only an unfinished scan is worth resuming. */
+	err = sqlite3_prepare_v2(wf->db, "SELECT finished FROM fs_t;", -1,
+				 &stmt, NULL);
+	if (err)
+		return -1;
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW || sqlite3_column_int(stmt, 0)) {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+	err = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (err)
+		return -1;
+
+	err = sqlite3_prepare_v2(wf->db,
+			"SELECT timestamp FROM checkpoint_t;", -1,
+			&stmt, NULL);
+	if (err)
+		return -1;
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW) {
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+	last_ckpt = sqlite3_column_int64(stmt, 0);
+	err = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (err)
+		return -1;
+
+	return rescan_load(wf, last_ckpt);
+}
+
+/* Remove every trace of the inodes that went away since the last scan. */
+void prune_db(struct filemapper_t *wf)
+{
+	struct fm_rescan *r = wf->rescan;
+	sqlite3_stmt *ext_stmt = NULL, *path_stmt = NULL;
+	sqlite3_stmt *dir_stmt = NULL, *ino_stmt = NULL;
+	uint64_t i;
+	int err, err2;
+
+	if (!r)
+		return;
+
+	flush_extents(wf);
+	if (wf->db_err)
+		return;
+	fm_phase_start(wf, "prune_db");
+
+	err = sqlite3_prepare_v2(wf->db,
+			"DELETE FROM extent_t WHERE ino = ?;", -1,
+			&ext_stmt, NULL);
+	if (err)
+		goto out;
+	err = sqlite3_prepare_v2(wf->db,
+			"DELETE FROM pathname_t WHERE ino = ?;", -1,
+			&path_stmt, NULL);
+	if (err)
+		goto out;
+	err = sqlite3_prepare_v2(wf->db,
+			"DELETE FROM dir_t WHERE dir_ino = ?1 OR name_ino = ?1;",
+			-1, &dir_stmt, NULL);
+	if (err)
+		goto out;
+	err = sqlite3_prepare_v2(wf->db,
+			"DELETE FROM inode_t WHERE ino = ?;", -1,
+			&ino_stmt, NULL);
+	if (err)
+		goto out;
+
+	for (i = 0; i < r->cap; i++) {
+		struct fm_inosig *e = &r->slots[i];
+		sqlite3_stmt *stmts[] = {ext_stmt, path_stmt, dir_stmt,
+					 ino_stmt};
+		unsigned int s;
+
+		if (!(e->flags & SIG_PRESENT) || (e->flags & SIG_SETTLED))
+			continue;
+		dbg_printf("%s: ino=%"PRId64"\n", __func__, e->ino);
+		for (s = 0; s < sizeof(stmts) / sizeof(stmts[0]); s++) {
+			err = sqlite3_reset(stmts[s]);
+			if (err)
+				goto out;
+			err = sqlite3_bind_int64(stmts[s], 1, e->ino);
+			if (err)
+				goto out;
+			err = sqlite3_step(stmts[s]);
+			if (err && err != SQLITE_DONE)
+				goto out;
+		}
+		err = 0;
+	}
+out:
+	err2 = sqlite3_finalize(ext_stmt);
+	if (!err && err2)
+		err = err2;
+	err2 = sqlite3_finalize(path_stmt);
+	if (!err && err2)
+		err = err2;
+	err2 = sqlite3_finalize(dir_stmt);
+	if (!err && err2)
+		err = err2;
+	err2 = sqlite3_finalize(ino_stmt);
+	if (!err && err2)
+		err = err2;
+	if (!wf->db_err && err)
+		wf->db_err = err;
+	fm_phase_stop(wf, "prune_db");
+}
+
+/* Tear down cached database state prior to closing the database */
+void cleanup_db(struct filemapper_t *wf)
+{
+	sqlite3_stmt **stmts[] = {
+		&wf->ino_stmt,
+		&wf->path_stmt,
+		&wf->dentry_stmt,
+		&wf->extent_stmt,
+		&wf->prefix_ins_stmt,
+		&wf->prefix_sel_stmt,
+	};
+	int err = 0, err2;
+	unsigned int i;
+
+	fm_writer_stop(wf);
+	fm_spill_free(wf);
+	flush_extents(wf);
+
+	for (i = 0; i < sizeof(stmts) / sizeof(stmts[0]); i++) {
+		err2 = sqlite3_finalize(*stmts[i]);
+		*stmts[i] = NULL;
+		if (!err && err2)
+			err = err2;
+	}
+
+	free(wf->ext_batch);
+	wf->ext_batch = NULL;
+
+	free(wf->prefix_cache);
+	wf->prefix_cache = NULL;
+	wf->prefix_cache_len = 0;
+
+	if (wf->istats) {
+		err2 = sqlite3_finalize(wf->istats->upd_stmt);
+		if (!err && err2)
+			err = err2;
+		free(wf->istats);
+		wf->istats = NULL;
+	}
+
+	if (wf->rescan) {
+		err2 = sqlite3_finalize(wf->rescan->clear_ext_stmt);
+		if (!err && err2)
+			err = err2;
+		err2 = sqlite3_finalize(wf->rescan->clear_path_stmt);
+		if (!err && err2)
+			err = err2;
+		err2 = sqlite3_finalize(wf->rescan->clear_dir_stmt);
+		if (!err && err2)
+			err = err2;
+		pthread_mutex_destroy(&wf->rescan->lock);
+		free(wf->rescan->slots);
+		free(wf->rescan);
+		wf->rescan = NULL;
+	}
+
+	if (!wf->db_err && err)
+		wf->db_err = err;
+
+	fm_stats_dump(wf);
+}
+
 /* Index database data */
 void index_db(struct filemapper_t *wf)
 {
+	flush_extents(wf);
+	if (wf->db_err)
+		return;
+	fm_phase_start(wf, "index_db");
 	run_batch_query(wf, dbindex);
+	fm_phase_stop(wf, "index_db");
+}
+
+/*
+ * Rebuild the tables and indexes for interactive query latency.  Call
+ * this after everything else has been computed -- the rebuild copies
+ * whatever is in the tables at that point.
+ */
+void optimize_db(struct filemapper_t *wf)
+{
+	sqlite3_stmt **stmts[] = {
+		&wf->ino_stmt,
+		&wf->path_stmt,
+		&wf->dentry_stmt,
+		&wf->extent_stmt,
+		&wf->prefix_ins_stmt,
+		&wf->prefix_sel_stmt,
+	};
+	unsigned int i;
+
+	flush_extents(wf);
+	if (wf->db_err)
+		return;
+
+	/*
+	 * The rebuild can't drop tables that the cached scan statements
+	 * still reference; the scan is over, so let them all go.
+	 */
+	for (i = 0; i < sizeof(stmts) / sizeof(stmts[0]); i++) {
+		sqlite3_finalize(*stmts[i]);
+		*stmts[i] = NULL;
+	}
+	if (wf->istats) {
+		sqlite3_finalize(wf->istats->upd_stmt);
+		wf->istats->upd_stmt = NULL;
+	}
+	if (wf->rescan) {
+		sqlite3_finalize(wf->rescan->clear_ext_stmt);
+		sqlite3_finalize(wf->rescan->clear_path_stmt);
+		sqlite3_finalize(wf->rescan->clear_dir_stmt);
+		wf->rescan->clear_ext_stmt = NULL;
+		wf->rescan->clear_path_stmt = NULL;
+		wf->rescan->clear_dir_stmt = NULL;
+	}
+
+	fm_phase_start(wf, "optimize_db");
+	run_batch_query(wf, optschema);
+	fm_phase_stop(wf, "optimize_db");
 }
 
 /* Calculate the number of extents and travel score data */
@@ -664,6 +2965,17 @@ void calc_inode_stats(struct filemapper_t *wf)
 	int etype, itype, has_ino;
 	int err, err2;
 
+	flush_extents(wf);
+	if (wf->db_err)
+		return;
+
+	fm_phase_start(wf, "calc_inode_stats");
+
+	/* Write out whatever the streaming accumulator still holds. */
+	err = istat_flush(wf);
+	if (err)
+		goto out;
+
 	/* For each inode... */
 	err = sqlite3_prepare_v2(db, "SELECT extent_t.ino, inode_t.type AS itype, extent_t.type AS etype, p_off, l_off, length FROM extent_t INNER JOIN inode_t WHERE extent_t.l_off IS NOT NULL AND extent_t.ino = inode_t.ino AND inode_t.ino IN (SELECT ino FROM inode_t WHERE travel_score IS NULL OR nr_extents IS NULL) ORDER BY extent_t.ino, l_off;",
 				 -1, &ino_stmt, NULL);
@@ -761,6 +3073,26 @@ out:
 	if (err2 && !err)
 		err = err2;
 	wf->db_err = err;
+	fm_phase_stop(wf, "calc_inode_stats");
+}
+
+/*
+ * Stop accumulating inode statistics at insert time.  Mappers that can't
+ * deliver each inode's extents as one contiguous run (parallel scans, the
+ * rmapbt scan) call this before inserting anything; calc_inode_stats()
+ * then computes the statistics for every inode, as it always has.
+ */
+void disable_streaming_stats(struct filemapper_t *wf)
+{
+	if (!wf->istats) {
+		wf->istats = calloc(1, sizeof(*wf->istats));
+		if (!wf->istats) {
+			wf->db_err = SQLITE_NOMEM;
+			return;
+		}
+	}
+	wf->istats->enabled = 0;
+	wf->istats->has_ino = 0;
 }
 
 /* Simple bitmap functions */
@@ -776,3 +3108,93 @@ void fm_set_bit(uint8_t *bmap, const uint64_t bit, const int new_value)
 	else
 		bmap[bit >> 3] &= ~(1 << (bit & 7));
 }
+
+/*
+ * Find the next set bit at or after @bit in a bitmap @size bits long,
+ * or @size if there isn't one.  Long runs are skipped a word at a time;
+ * only the word containing the boundary gets examined bit by bit, so
+ * walking a bitmap costs one comparison per 64 bits instead of one per
+ * bit.
+ */
+uint64_t fm_find_next_bit(const uint8_t *bmap, const uint64_t size,
+			  uint64_t bit)
+{
+	uint64_t word;
+
+	while (bit < size && (bit & 7)) {
+		if (fm_test_bit(bmap, bit))
+			return bit;
+		bit++;
+	}
+
+	/* Whole bytes until we're word aligned. */
+	while (bit + 8 <= size && ((bit >> 3) & 7)) {
+		if (bmap[bit >> 3])
+			return bit + __builtin_ctz(bmap[bit >> 3]);
+		bit += 8;
+	}
+
+	/* Whole words. */
+	while (bit + 64 <= size) {
+		memcpy(&word, bmap + (bit >> 3), sizeof(word));
+		if (word)
+			break;
+		bit += 64;
+	}
+
+	while (bit + 8 <= size) {
+		if (bmap[bit >> 3])
+			return bit + __builtin_ctz(bmap[bit >> 3]);
+		bit += 8;
+	}
+
+	while (bit < size) {
+		if (fm_test_bit(bmap, bit))
+			return bit;
+		bit++;
+	}
+
+	return size;
+}
+
+/* Find the next clear bit at or after @bit, or @size if there isn't one. */
+uint64_t fm_find_next_zero_bit(const uint8_t *bmap, const uint64_t size,
+			       uint64_t bit)
+{
+	uint64_t word;
+
+	while (bit < size && (bit & 7)) {
+		if (!fm_test_bit(bmap, bit))
+			return bit;
+		bit++;
+	}
+
+	/* Whole bytes until we're word aligned. */
+	while (bit + 8 <= size && ((bit >> 3) & 7)) {
+		if (bmap[bit >> 3] != 0xFF)
+			return bit + __builtin_ctz(~bmap[bit >> 3] & 0xFF);
+		bit += 8;
+	}
+
+	/* Whole words. */
+	while (bit + 64 <= size) {
+		memcpy(&word, bmap + (bit >> 3), sizeof(word));
+		if (word != ~0ULL)
+			break;
+		bit += 64;
+	}
+
+	while (bit + 8 <= size) {
+		if (bmap[bit >> 3] != 0xFF)
+			return bit + __builtin_ctz(~bmap[bit >> 3] & 0xFF);
+		bit += 8;
+	}
+
+	while (bit < size) {
+		if (!fm_test_bit(bmap, bit))
+			return bit;
+		bit++;
+	}
+
+	return size;
+}
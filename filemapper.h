@@ -27,6 +27,44 @@ struct filemapper_t {
 	int db_err;
 	const char *dirpath;
 	iconv_t iconv;
+
+	/* Cached insertion statements for the scan hot path. */
+	sqlite3_stmt *ino_stmt;
+	sqlite3_stmt *path_stmt;
+	sqlite3_stmt *dentry_stmt;
+	sqlite3_stmt *extent_stmt;
+
+	/* Path prefix compression state. */
+	sqlite3_stmt *prefix_ins_stmt;
+	sqlite3_stmt *prefix_sel_stmt;
+	char *prefix_cache;
+	size_t prefix_cache_len;
+	int64_t prefix_cache_id;
+
+	/* Accumulated extent rows awaiting insertion. */
+	struct extent_batch *ext_batch;
+
+	/* Writer thread state, when insertion is pipelined. */
+	struct fm_writer *writer;
+
+	/* Flat-file spill state, when insertion is deferred entirely. */
+	struct fm_spill *spill;
+
+	/* Streaming per-inode statistics, accumulated at insert time. */
+	struct istat_acc *istats;
+
+	/* Parallel directory traversal state, while a walk runs. */
+	struct fm_walk *walk;
+
+	/* Previous scan's inode signatures, for incremental rescans. */
+	struct fm_rescan *rescan;
+
+	/* Scan instrumentation, enabled via FM_STATS in the environment. */
+	struct fm_stats *stats;
+
+	/* Periodic commit state, when the scan is resumable. */
+	int ckpt_enabled;
+	time_t last_ckpt;
 };
 
 struct overview_t {
@@ -102,6 +140,37 @@ void insert_dentry(struct filemapper_t *wf, int64_t dir_ino,
 void insert_extent(struct filemapper_t *wf, int64_t ino, uint64_t physical,
 		   uint64_t *logical, uint64_t length, int flags, int type);
 
+/* Push all batched extents into the database. */
+void flush_extents(struct filemapper_t *wf);
+
+/* Pipeline database insertions through a dedicated writer thread. */
+void fm_writer_start(struct filemapper_t *wf);
+void fm_writer_stop(struct filemapper_t *wf);
+
+/* Spill insertions to flat files during the walk; bulk-load afterwards. */
+void fm_spill_start(struct filemapper_t *wf, const char *dbfile);
+void fm_spill_load(struct filemapper_t *wf);
+
+/*
+ * Walk a directory tree with a pool of threads.  Each queued item names
+ * one directory by path -- pending work holds no open handles -- and
+ * the callback maps it with a per-thread copy of the mapper state and
+ * pushes the subdirectories it finds.
+ */
+struct fm_walk_item {
+	int64_t ino;
+	char *path;		/* owned by the engine */
+	struct fm_arena *arena;	/* scratch memory, reset after each item */
+};
+typedef void (*fm_walk_fn)(struct filemapper_t *wf,
+			   struct fm_walk_item *item, void *arg);
+/* Scratch memory good until the walk engine finishes this item. */
+void *fm_arena_alloc(struct fm_arena *arena, size_t len);
+int fm_walk_run(struct filemapper_t *wf, int nr_threads, fm_walk_fn fn,
+		void *arg, int64_t ino, const char *path);
+void fm_walk_push(struct filemapper_t *wf, int64_t ino, const char *path);
+void fm_walk_fail(struct filemapper_t *wf, int err);
+
 void inject_metadata(struct filemapper_t *wf, int64_t parent_ino,
 		     const char *path, int64_t ino, const char *name,
 		     int type);
@@ -122,14 +191,52 @@ void cache_overview(struct filemapper_t *wf, uint64_t length);
 /* Prepare database to receive new data. */
 void prepare_db(struct filemapper_t *wf);
 
+/* Prepare an existing database for an incremental rescan. */
+int prepare_db_incremental(struct filemapper_t *wf);
+
+/* Prepare a checkpointed database to resume an interrupted scan. */
+int prepare_db_resume(struct filemapper_t *wf);
+
+/* Commit periodically so an interrupted scan can be resumed. */
+void enable_checkpoints(struct filemapper_t *wf);
+void checkpoint_db(struct filemapper_t *wf, int64_t group_nr);
+
+/* Does this inode need to be re-walked on an incremental rescan? */
+int inode_needs_rescan(struct filemapper_t *wf, int64_t ino, time_t ctime);
+
+/* Remove rows for inodes that vanished since the previous scan. */
+void prune_db(struct filemapper_t *wf);
+
+/* Tear down cached database state prior to closing the database. */
+void cleanup_db(struct filemapper_t *wf);
+
 /* Index database. */
 void index_db(struct filemapper_t *wf);
 
+/* Rebuild the schema for query latency at the cost of space. */
+void optimize_db(struct filemapper_t *wf);
+
 /* Calculate inode statistics */
 void calc_inode_stats(struct filemapper_t *wf);
 
+/* Don't accumulate inode statistics at insert time. */
+void disable_streaming_stats(struct filemapper_t *wf);
+
+/*
+ * Scan instrumentation.  fm_stats_start() enables collection when
+ * FM_STATS is set in the environment; the phase timers bracket the big
+ * scan phases and the report is dumped by cleanup_db().
+ */
+void fm_stats_start(struct filemapper_t *wf);
+void fm_phase_start(struct filemapper_t *wf, const char *name);
+void fm_phase_stop(struct filemapper_t *wf, const char *name);
+
 /* Simple bitmap functions */
 int fm_test_bit(const uint8_t *bmap, const uint64_t bit);
 void fm_set_bit(uint8_t *bmap, const uint64_t bit, const int new_value);
+uint64_t fm_find_next_bit(const uint8_t *bmap, const uint64_t size,
+			  uint64_t bit);
+uint64_t fm_find_next_zero_bit(const uint8_t *bmap, const uint64_t size,
+			       uint64_t bit);
 
 #endif /* ifdef FM_H_ */
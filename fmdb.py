@@ -10,6 +10,7 @@ import stat
 import array
 import fiemap
 import math
+import struct
 import compdb
 import vfs
 from collections import namedtuple
@@ -229,6 +230,7 @@ DROP VIEW IF EXISTS dentry_t;
 DROP VIEW IF EXISTS path_extent_v;
 DROP VIEW IF EXISTS path_inode_v;
 DROP TABLE IF EXISTS overview_t;
+DROP TABLE IF EXISTS overview_base_t;
 DROP TABLE IF EXISTS dentry_t;
 DROP TABLE IF EXISTS extent_t;
 DROP TABLE IF EXISTS extent_type_t;
@@ -245,6 +247,7 @@ CREATE TABLE path_t(path TEXT PRIMARY KEY UNIQUE NOT NULL, ino INTEGER NOT NULL,
 CREATE TABLE extent_type_t (id INTEGER PRIMARY KEY UNIQUE, code TEXT NOT NULL);
 CREATE TABLE extent_t(ino INTEGER NOT NULL, p_off INTEGER NOT NULL, l_off INTEGER, flags INTEGER NOT NULL, length INTEGER NOT NULL, type INTEGER NOT NULL, p_end INTEGER NOT NULL, FOREIGN KEY(ino) REFERENCES inode_t(ino), FOREIGN KEY(type) REFERENCES extent_type_t(id));
 CREATE TABLE overview_t(length INTEGER NOT NULL, cell_no INTEGER NOT NULL, files INTEGER NOT NULL, dirs INTEGER NOT NULL, mappings INTEGER NOT NULL, metadata INTEGER NOT NULL, xattrs INTEGER NOT NULL, symlinks INTEGER NOT NULL, freesp INTEGER NOT NULL, CONSTRAINT pk_overview PRIMARY KEY (length, cell_no));
+CREATE TABLE overview_base_t(length INTEGER NOT NULL, total_bytes INTEGER NOT NULL);
 CREATE VIEW path_extent_v AS SELECT path_t.path, extent_t.p_off, extent_t.l_off, extent_t.length, extent_t.flags, extent_t.type, extent_t.p_end, extent_t.ino FROM extent_t, path_t WHERE extent_t.ino = path_t.ino;
 CREATE VIEW path_inode_v AS SELECT path_t.path, inode_t.ino, inode_t.type, inode_t.nr_extents, inode_t.travel_score, inode_t.atime, inode_t.crtime, inode_t.ctime, inode_t.mtime, inode_t.size FROM path_t, inode_t WHERE inode_t.ino = path_t.ino;
 CREATE VIEW dentry_t AS SELECT dir_t.dir_ino, dir_t.name, dir_t.name_ino, inode_t.type FROM dir_t, inode_t WHERE dir_t.name_ino = inode_t.ino;''' % (PAGE_SIZE, APP_ID)]
@@ -334,6 +337,10 @@ def scale_colors(colors):
 		pct += p
 	return ret.sqrt().clamp()
 
+# Counters per cell in a packed overview buffer; must match the field
+# order of struct overview_t in filemapper.h.
+OVERVIEW_FIELDS = 7
+
 class overview_block(object):
 	def __init__(self, extents_to_show, files = 0, dirs = 0, mappings = 0, \
 		     metadata = 0, xattrs = 0, symlinks = 0, freesp = 0):
@@ -346,6 +353,20 @@ class overview_block(object):
 		self.symlinks = symlinks
 		self.freesp = freesp
 
+	@classmethod
+	def from_buffer(cls, extents_to_show, buf, start, end):
+		'''Aggregate a run of cells from a packed overview buffer.'''
+		s = start * OVERVIEW_FIELDS
+		e = end * OVERVIEW_FIELDS
+		return cls(extents_to_show, \
+			   sum(buf[s    : e : OVERVIEW_FIELDS]), \
+			   sum(buf[s + 1 : e : OVERVIEW_FIELDS]), \
+			   sum(buf[s + 2 : e : OVERVIEW_FIELDS]), \
+			   sum(buf[s + 3 : e : OVERVIEW_FIELDS]), \
+			   sum(buf[s + 4 : e : OVERVIEW_FIELDS]), \
+			   sum(buf[s + 5 : e : OVERVIEW_FIELDS]), \
+			   sum(buf[s + 6 : e : OVERVIEW_FIELDS]))
+
 	def add(self, value):
 		'''Add another overview block to this one.'''
 		self.files += value.files
@@ -476,6 +497,15 @@ class fmdb(object):
 		if self.conn is None:
 			raise RuntimeError('Could not connect to database.')
 		self.conn.isolation_level = None
+		# Read-only sessions also get a native query connection so
+		# that the hot queries run in C, without the per-row Python
+		# overhead of the sqlite3 module.
+		self.nquery = None
+		if not self.writable and dbpath != ':memory:':
+			try:
+				self.nquery = compdb.query_open(db)
+			except Exception:
+				self.nquery = None
 		self.fs = None
 		self.overview_len = None
 		self.result_batch_size = 512
@@ -505,6 +535,9 @@ class fmdb(object):
 
 	def __del__(self):
 		'''Destroy database object.'''
+		if getattr(self, 'nquery', None) is not None:
+			compdb.query_close(self.nquery)
+			self.nquery = None
 		if self.conn is not None:
 			self.conn.close()
 
@@ -704,6 +737,19 @@ class fmdb(object):
 				 for i in range(0, length)]
 			print_sql(qstr, [])
 			cur.executemany(qstr, qarg)
+
+			# Point overview_base_t at this level if it's now
+			# the finest one cached.
+			try:
+				cur.execute('SELECT length FROM overview_base_t')
+				rows = cur.fetchall()
+				if len(rows) == 0 or rows[0][0] <= length:
+					cur.execute('DELETE FROM overview_base_t')
+					cur.execute('INSERT INTO overview_base_t VALUES (?, ?)', \
+						(length, self.fs.total_bytes))
+			except sqlite3.OperationalError:
+				# Database predates overview_base_t.
+				pass
 			self.finish_update()
 
 			t1 = datetime.datetime.today()
@@ -713,8 +759,93 @@ class fmdb(object):
 			pass
 		return overview
 
+	def query_overview_base(self):
+		'''Find the finest fully-cached overview level and the fs
+		   size it was computed against, or None if there is nothing
+		   usable to re-bin (including databases from before
+		   overview_base_t existed).'''
+		try:
+			cur = self.conn.execute('SELECT length, total_bytes FROM overview_base_t')
+			rows = cur.fetchall()
+		except sqlite3.OperationalError:
+			return None
+		if len(rows) != 1:
+			return None
+		(length, total_bytes) = rows[0]
+		if length < 1 or total_bytes < 1:
+			return None
+		cur = self.conn.execute('SELECT COUNT(cell_no) FROM overview_t WHERE length = ?', \
+				(length,))
+		if cur.fetchall()[0][0] != length:
+			return None
+		return (length, total_bytes)
+
+	def rebin_overview(self, base_len, base_total):
+		'''Derive the current overview length by re-binning the
+		   finest cached level -- the same aggregation that
+		   overview_block.from_buffer applies to runs of cells, so
+		   an extent spanning several base cells counts once per
+		   cell it touched.  If total_bytes grew after the level
+		   was cached, the cells past the old end stay empty.'''
+		t0 = datetime.datetime.today()
+		qstr = 'SELECT cell_no, files, dirs, mappings, metadata, xattrs, symlinks, freesp FROM overview_t WHERE length = ? ORDER BY cell_no'
+		qarg = [base_len]
+		print_sql(qstr, qarg)
+		cur = self.conn.cursor()
+		cur.execute(qstr, qarg)
+		cells = cur.fetchall()
+		total = self.fs.total_bytes
+		ets = self.extent_types_to_show
+		for j in range(0, self.overview_len):
+			lo = j * total // self.overview_len
+			hi = (j + 1) * total // self.overview_len
+			if hi > lo:
+				hi -= 1
+			block = overview_block(ets)
+			if lo >= base_total:
+				yield block
+				continue
+			hi = min(hi, base_total - 1)
+			i0 = lo * base_len // base_total
+			i1 = min(hi * base_len // base_total, base_len - 1)
+			for i in range(i0, i1 + 1):
+				r = cells[i]
+				block.files += r[1]
+				block.dirs += r[2]
+				block.mappings += r[3]
+				block.metadata += r[4]
+				block.xattrs += r[5]
+				block.symlinks += r[6]
+				block.freesp += r[7]
+			yield block
+		t1 = datetime.datetime.today()
+		print_times('rebin_overview', [t0, t1])
+
+	def query_overview_buffer(self):
+		'''Fetch an overview level as a flat buffer of cell
+		   counters, OVERVIEW_FIELDS per cell, re-binned natively
+		   from the finest cached level if need be, or None if
+		   nothing is cached at all.'''
+		if self.nquery is None:
+			return None
+		buf = compdb.query_overview(self.nquery, self.overview_len)
+		if buf is None:
+			return None
+		return memoryview(buf).cast('Q')
+
 	def query_overview(self):
 		'''Generate an overview report.'''
+		buf = self.query_overview_buffer()
+		if buf is not None:
+			t0 = datetime.datetime.today()
+			ets = self.extent_types_to_show
+			for i in range(0, self.overview_len):
+				yield overview_block.from_buffer(ets, buf, \
+						i, i + 1)
+			t1 = datetime.datetime.today()
+			print_times('native_overview', [t0, t1])
+			return
+
 		cur = self.conn.cursor()
 		cur.arraysize = self.result_batch_size
 
@@ -740,6 +871,13 @@ class fmdb(object):
 			print_times('cached_overview', [t0, t1])
 			return
 
+		# Re-bin the finest cached level rather than rescan extent_t.
+		base = self.query_overview_base()
+		if base is not None and base[0] != self.overview_len:
+			for row in self.rebin_overview(base[0], base[1]):
+				yield row
+			return
+
 		# Generate and cache it, then.
 		for row in self.cache_overview(self.overview_len):
 			yield row
@@ -765,6 +903,12 @@ class fmdb(object):
 		sbc = self.bytes_per_cell
 		self.query_summary()
 
+		if self.nquery is not None:
+			for x in compdb.pick_bytes(ranges, \
+					self.fs.total_bytes, sbc):
+				yield x
+			return
+
 		for i in ranges:
 			if type(i) == int:
 				if i > self.fs.total_bytes:
@@ -792,10 +936,32 @@ class fmdb(object):
 
 	## FS Summary
 
+	def __query_summary_native(self):
+		'''Fetch the filesystem summary through the native module.'''
+		(extents, extent_bytes, inodes, path, block_size, frag_size, \
+		 total_bytes, free_bytes, avail_bytes, total_inodes, \
+		 free_inodes, avail_inodes, pathsep, timestamp, \
+		 fstype) = compdb.query_summary(self.nquery)
+
+		# In the old days, the date was a string instead of Epoch seconds
+		if type(timestamp) == str:
+			d = datetime.datetime.strptime(timestamp, '%Y-%m-%d %H:%M:%S').replace(tzinfo = tz_gmt)
+		else:
+			d = utctimestamp_to_datetime(timestamp)
+		self.fs = fs_summary(path, int(block_size), int(frag_size), \
+				 int(total_bytes), int(free_bytes), \
+				 int(avail_bytes), int(total_inodes), \
+				 int(free_inodes), int(avail_inodes), \
+				 int(extents), pathsep, int(inodes), d, \
+				 fstype, int(extent_bytes))
+		return self.fs
+
 	def query_summary(self):
 		'''Fetch the filesystem summary.'''
 		if self.fs is not None:
 			return self.fs
+		if self.nquery is not None:
+			return self.__query_summary_native()
 
 		cur = self.conn.cursor()
 		etypes = ', '.join(map(str, [EXT_TYPE_FILE, EXT_TYPE_DIR, EXT_TYPE_XATTR, EXT_TYPE_SYMLINK, EXT_TYPE_FREESP]))
@@ -865,8 +1031,32 @@ class fmdb(object):
 			qstr = 'ino IN (SELECT DISTINCT ino FROM extent_t WHERE %s)' % qstr
 		return (qstr, qarg)
 
+	def __query_extent_ranges_native(self, ranges, mode):
+		'''Run an extent range query in C and unpack the results.'''
+		if len(ranges) == 0:
+			return
+		ets = self.extent_types_to_show
+		if ets is not None and len(ets) == 0:
+			return
+		t0 = datetime.datetime.now()
+		(paths, recs) = compdb.query_extents(self.nquery, mode, \
+				ranges, None if ets is None else list(ets))
+		t1 = datetime.datetime.now()
+		for (p, ino, p_off, l_off, length, flags, etype) in \
+		    struct.iter_unpack('=7q', recs):
+			yield extent(paths[p:paths.index(b'\0', p)].decode('utf-8'), \
+					ino, p_off, \
+					None if l_off == -1 else l_off, \
+					length, flags, etype)
+		t2 = datetime.datetime.now()
+		print_times('query_extents_native', [t0, t1, t2])
+
 	def query_poff_range(self, ranges, **kwargs):
 		'''Query extents covering ranges of physical bytes.'''
+		if self.nquery is not None and not kwargs:
+			for x in self.__query_extent_ranges_native(ranges, 0):
+				yield x
+			return
 		qstr, qarg = self. __query_extent_ranges_sql(ranges, FMDB_EXTENT_SQL, 'p_off', 'p_end')
 		for x in self.query_extents(qstr, qarg, **kwargs):
 			yield x
@@ -879,6 +1069,10 @@ class fmdb(object):
 
 	def query_loff_range(self, ranges, **kwargs):
 		'''Query extents covering ranges of logical bytes.'''
+		if self.nquery is not None and not kwargs:
+			for x in self.__query_extent_ranges_native(ranges, 1):
+				yield x
+			return
 		qstr, qarg = self. __query_extent_ranges_sql(ranges, FMDB_EXTENT_SQL, 'l_off', 'l_off + length - 1')
 		for x in self.query_extents(qstr, qarg, **kwargs):
 			yield x
@@ -543,6 +543,8 @@ class OverviewModel(QtCore.QObject):
 		self.zoom = 1.0
 		self.precision = precision
 		self.overview_big = None
+		self.overview_buf = None
+		self.overview_cells = 0
 		self.rst = QtCore.QTimer()
 		self.rst.timeout.connect(self.delayed_resize)
 		self.range_highlight = None
@@ -557,7 +559,16 @@ class OverviewModel(QtCore.QObject):
 		'''Query the DB for the high-res overview data.'''
 		olen = min(self.precision, self.fs.total_bytes // self.fs.block_size)
 		self.fmdb.set_overview_length(olen)
-		self.overview_big = [ov for ov in self.fmdb.query_overview()]
+		# Grab the whole level as one packed buffer if we can; the
+		# render loop then aggregates cells without creating a
+		# Python object apiece.
+		self.overview_buf = self.fmdb.query_overview_buffer()
+		if self.overview_buf is not None:
+			self.overview_big = None
+			self.overview_cells = len(self.overview_buf) // fmdb.OVERVIEW_FIELDS
+		else:
+			self.overview_big = [ov for ov in self.fmdb.query_overview()]
+			self.overview_cells = len(self.overview_big)
 		self.has_rendered = False
 
 	def set_zoom(self, zoom):
@@ -599,7 +610,7 @@ class OverviewModel(QtCore.QObject):
 			return False
 
 		t0 = datetime.datetime.today()
-		if self.overview_big is None:
+		if self.overview_big is None and self.overview_buf is None:
 			return None
 		bgcolor = fmdb.color(255, 255, 255)
 		userdatacolor = fmdb.color(255,  99,  71)
@@ -607,18 +618,23 @@ class OverviewModel(QtCore.QObject):
 		fsmetacolor = fmdb.color(136, 206, 255)
 		freespcolor = fmdb.color(238, 245, 255)
 		olen = int(length)
-		o2s = float(len(self.overview_big)) / olen
+		o2s = float(self.overview_cells) / olen
 		ov_str = []
 		t1 = datetime.datetime.today()
 		old_style_str = None
 		for i in range(0, olen):
 			x = int(round(i * o2s))
 			y = int(round((i + 1) * o2s))
-			ss = self.overview_big[x:y]
 			rh = self.range_highlight[x:y] if self.range_highlight is not None else [0]
-			ovs = fmdb.overview_block(self.fmdb.get_extent_types_to_show())
-			for s in ss:
-				ovs.add(s)
+			if self.overview_buf is not None:
+				ovs = fmdb.overview_block.from_buffer( \
+					self.fmdb.get_extent_types_to_show(), \
+					self.overview_buf, x, y)
+			else:
+				ss = self.overview_big[x:y]
+				ovs = fmdb.overview_block(self.fmdb.get_extent_types_to_show())
+				for s in ss:
+					ovs.add(s)
 			if sum(rh) > 0:
 				style_str = 'background: #e0e0e0; font-weight: bold;'
 			else:
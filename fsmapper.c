@@ -0,0 +1,840 @@
+/*
+ * Generate filemapper databases from mounted filesystems.
+ * Copyright 2026 Darrick J. Wong.
+ * Licensed under the GPLv2.
+ */
+#define _FILE_OFFSET_BITS	64
+#define _LARGEFILE64_SOURCE	1
+#define _GNU_SOURCE		1
+
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <iconv.h>
+#include <sqlite3.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/fsmap.h>
+#undef DEBUG
+#include "filemapper.h"
+#include "compdb.h"
+
+struct fsmap_t {
+	struct filemapper_t base;
+
+	int err;
+	int rootfd;
+	int nr_threads;
+	dev_t fsdev;
+	uint64_t total_bytes;
+	struct ino_set *ino_seen;
+	struct ino_set *fake_seen;
+	struct fsmap_head *fsmap_buf;
+};
+#define wf_db		base.db
+#define wf_db_err	base.db_err
+#define wf_dirpath	base.dirpath
+#define wf_iconv	base.iconv
+
+#define FIEMAP_BATCH	2048
+#define FSMAP_BATCH	2048
+
+/* Fake inodes for metadata, matching the Python vfs.py scanner. */
+#define INO_METADATA_DIR	(-1)
+#define STR_METADATA_DIR	METADATA_DIR
+#define INO_FREESP_FILE		(-2)
+#define STR_FREESP_FILE		FREESP_FILE
+#define INO_METADATA_FILE	(-3)
+#define STR_METADATA_FILE	METADATA_FILE
+#define INO_UNLINKED_DIR	(-4)
+#define STR_UNLINKED_DIR	UNLINKED_DIR
+
+/* Inodes we've seen, so hardlinks are only mapped once. */
+
+static pthread_mutex_t ino_seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct ino_set {
+	uint64_t *slots;	/* ino + 1; 0 means empty */
+	uint64_t nr;
+	uint64_t cap;		/* always a power of two */
+	int err;
+};
+
+static int ino_set_init(struct ino_set **set)
+{
+	struct ino_set *u;
+
+	u = calloc(1, sizeof(struct ino_set));
+	if (!u)
+		return ENOMEM;
+
+	u->cap = 1ULL << 16;
+	u->slots = calloc(u->cap, sizeof(uint64_t));
+	if (!u->slots) {
+		free(u);
+		return ENOMEM;
+	}
+
+	*set = u;
+	return 0;
+}
+
+static void ino_set_destroy(struct ino_set *set)
+{
+	if (!set)
+		return;
+	free(set->slots);
+	free(set);
+}
+
+static uint64_t ino_set_hash(struct ino_set *set, uint64_t key)
+{
+	return (key * 0x9E3779B97F4A7C15ULL) & (set->cap - 1);
+}
+
+/* Double the table and rehash everything into it. */
+static void ino_set_grow(struct ino_set *set)
+{
+	struct ino_set big;
+	uint64_t slot;
+	uint64_t i;
+
+	big.nr = set->nr;
+	big.cap = set->cap * 2;
+	big.err = 0;
+	big.slots = calloc(big.cap, sizeof(uint64_t));
+	if (!big.slots) {
+		set->err = ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < set->cap; i++) {
+		if (!set->slots[i])
+			continue;
+		slot = ino_set_hash(&big, set->slots[i] - 1);
+		while (big.slots[slot])
+			slot = (slot + 1) & (big.cap - 1);
+		big.slots[slot] = set->slots[i];
+	}
+
+	free(set->slots);
+	set->slots = big.slots;
+	set->cap = big.cap;
+}
+
+/* Is this inode already in the set? */
+static int ino_set_test(struct ino_set *set, uint64_t ino)
+{
+	uint64_t key = ino + 1;
+	uint64_t slot = ino_set_hash(set, ino);
+
+	while (set->slots[slot]) {
+		if (set->slots[slot] == key)
+			return 1;
+		slot = (slot + 1) & (set->cap - 1);
+	}
+	return 0;
+}
+
+/*
+ * Record an inode in the set.  Returns nonzero if it was already there
+ * (or if we've run out of memory, in which case set->err is latched).
+ */
+static int ino_set_add(struct ino_set *set, uint64_t ino)
+{
+	uint64_t key = ino + 1;
+	uint64_t slot;
+
+	if (set->err)
+		return 1;
+	if (set->nr * 4 >= set->cap * 3) {
+		ino_set_grow(set);
+		if (set->err)
+			return 1;
+	}
+
+	slot = ino_set_hash(set, ino);
+	while (set->slots[slot]) {
+		if (set->slots[slot] == key)
+			return 1;
+		slot = (slot + 1) & (set->cap - 1);
+	}
+	set->slots[slot] = key;
+	set->nr++;
+	return 0;
+}
+
+/* Encode a stat dev_t the way the kernel writes fmr_device. */
+static uint32_t encode_dev(dev_t dev)
+{
+	unsigned int maj = major(dev);
+	unsigned int min = minor(dev);
+
+	return (min & 0xff) | (maj << 8) | ((min & ~0xffU) << 12);
+}
+
+/*
+ * Pull a file's mappings out with batched FIEMAP calls.  The FIEMAP
+ * extent flags are the extent_t flags, so they pass straight through;
+ * extents whose location the fs won't commit to are skipped, like the
+ * Python scanner does.
+ */
+static void walk_fd_mappings(struct fsmap_t *wf, struct fiemap *fm, int fd,
+			     int64_t ino, int ext_type, int xattr)
+{
+	struct fiemap_extent *fe;
+	uint64_t loff;
+	unsigned int i;
+	int last = 0;
+
+	fm->fm_start = 0;
+	while (!last) {
+		fm->fm_length = FIEMAP_MAX_OFFSET - fm->fm_start;
+		fm->fm_flags = FIEMAP_FLAG_SYNC;
+		if (xattr)
+			fm->fm_flags |= FIEMAP_FLAG_XATTR;
+		fm->fm_extent_count = FIEMAP_BATCH;
+		fm->fm_mapped_extents = 0;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm)) {
+			/* Not all filesystems map all forks; not fatal. */
+			return;
+		}
+		if (fm->fm_mapped_extents == 0)
+			return;
+
+		for (i = 0; i < fm->fm_mapped_extents; i++) {
+			fe = &fm->fm_extents[i];
+			if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+				last = 1;
+			if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN |
+					    FIEMAP_EXTENT_DELALLOC))
+				continue;
+			dbg_printf("ino=%"PRId64" poff=%llu loff=%llu "
+				   "len=%llu flags=0x%x\n", ino,
+				   fe->fe_physical, fe->fe_logical,
+				   fe->fe_length, fe->fe_flags);
+			loff = fe->fe_logical;
+			insert_extent(&wf->base, ino, fe->fe_physical, &loff,
+				      fe->fe_length, fe->fe_flags,
+				      xattr ? EXT_TYPE_XATTR : ext_type);
+			if (wf->wf_db_err)
+				return;
+		}
+		fe = &fm->fm_extents[fm->fm_mapped_extents - 1];
+		fm->fm_start = fe->fe_logical + fe->fe_length;
+	}
+}
+
+/* Map both the data and the xattr fork of an open file. */
+static void walk_file_mappings(struct fsmap_t *wf, struct fiemap *fm, int fd,
+			       int64_t ino, int ext_type)
+{
+	walk_fd_mappings(wf, fm, fd, ino, ext_type, 0);
+	if (wf->wf_db_err)
+		return;
+	walk_fd_mappings(wf, fm, fd, ino, ext_type, 1);
+}
+
+/*
+ * Process one queued directory: insert its children, map their data,
+ * and queue any subdirectories for the walker pool.  Runs on a walker
+ * thread with a per-thread copy of the mapper state; only the seen-
+ * inode set is shared and it takes the lock.
+ */
+static void walk_dir_item(struct filemapper_t *base,
+			  struct fm_walk_item *item, void *arg)
+{
+	struct fsmap_t twf;
+	struct fsmap_t *wf;
+	char path[PATH_MAX + 1];
+	char dents[65536];
+	struct fiemap *fm;
+	struct dirent64 *de;
+	struct stat sb;
+	time_t atime, ctime, mtime;
+	int64_t size;
+	ssize_t nread;
+	size_t off;
+	int dirfd;
+	int type, fd, seen;
+
+	if (base == &((struct fsmap_t *)arg)->base) {
+		/*
+		 * Single-threaded walk: the engine handed us the real
+		 * mapper state, so work on it directly.  Copying it out
+		 * at the end would clobber the statement handles that
+		 * the writer thread caches in it while we run.
+		 */
+		wf = arg;
+	} else {
+		twf = *(struct fsmap_t *)arg;
+		twf.base = *base;
+		wf = &twf;
+	}
+	wf->err = 0;
+	wf->wf_dirpath = item->path;
+
+	fm = fm_arena_alloc(item->arena, sizeof(struct fiemap) +
+			    FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if (!fm) {
+		fm_walk_fail(&wf->base, ENOMEM);
+		return;
+	}
+	memset(fm, 0, sizeof(struct fiemap));
+
+	/*
+	 * Directories queue by path and are only opened here, when a
+	 * walker picks them up; holding a descriptor for every pending
+	 * directory would run a bushy tree into RLIMIT_NOFILE.
+	 */
+	dirfd = openat(wf->rootfd, item->path[0] ? item->path + 1 : ".",
+		       O_RDONLY | O_NOFOLLOW | O_DIRECTORY | O_NOATIME);
+	if (dirfd < 0)
+		dirfd = openat(wf->rootfd,
+			       item->path[0] ? item->path + 1 : ".",
+			       O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
+	if (dirfd < 0) {
+		/*
+		 * The directory existed when we queued it.  If the live
+		 * tree changed under us there is nothing left to map,
+		 * but any other failure would silently drop a whole
+		 * subtree from the database, so abort the walk.
+		 */
+		if (errno == ENOENT || errno == ENOTDIR)
+			perror(item->path);
+		else
+			fm_walk_fail(&wf->base, errno);
+		return;
+	}
+
+	while ((nread = getdents64(dirfd, dents, sizeof(dents))) > 0) {
+		for (off = 0; off < (size_t)nread; off += de->d_reclen) {
+			de = (struct dirent64 *)(dents + off);
+			if (!strcmp(de->d_name, ".") ||
+			    !strcmp(de->d_name, ".."))
+				continue;
+
+			if (fstatat(dirfd, de->d_name, &sb,
+				    AT_SYMLINK_NOFOLLOW)) {
+				perror(de->d_name);
+				continue;
+			}
+			/* Don't cross mountpoints. */
+			if (sb.st_dev != wf->fsdev)
+				continue;
+
+			switch (sb.st_mode & S_IFMT) {
+			case S_IFREG:
+				type = INO_TYPE_FILE;
+				break;
+			case S_IFDIR:
+				type = INO_TYPE_DIR;
+				break;
+			case S_IFLNK:
+				type = INO_TYPE_SYMLINK;
+				break;
+			default:
+				continue;
+			}
+
+			snprintf(path, PATH_MAX, "%s/%s", item->path,
+				 de->d_name);
+			dbg_printf("dir=%"PRId64" name=%s ino=%llu type=%d\n",
+				   item->ino, path, sb.st_ino, type);
+
+			atime = sb.st_atime;
+			ctime = sb.st_ctime;
+			mtime = sb.st_mtime;
+			size = sb.st_size;
+			insert_inode(&wf->base, sb.st_ino, type, path,
+				     &atime, NULL, &ctime, &mtime, &size);
+			if (wf->wf_db_err)
+				goto out;
+			insert_dentry(&wf->base, item->ino, de->d_name,
+				      sb.st_ino);
+			if (wf->wf_db_err)
+				goto out;
+
+			/* Each hardlinked inode is only mapped once. */
+			pthread_mutex_lock(&ino_seen_lock);
+			seen = ino_set_add(wf->ino_seen, sb.st_ino);
+			pthread_mutex_unlock(&ino_seen_lock);
+			if (wf->ino_seen->err) {
+				fm_walk_fail(&wf->base, wf->ino_seen->err);
+				goto out;
+			}
+			if (seen || type == INO_TYPE_SYMLINK)
+				continue;
+
+			fd = openat(dirfd, de->d_name,
+				    O_RDONLY | O_NOFOLLOW | O_NOATIME);
+			if (fd < 0)
+				fd = openat(dirfd, de->d_name,
+					    O_RDONLY | O_NOFOLLOW);
+			if (fd < 0) {
+				perror(de->d_name);
+				continue;
+			}
+			walk_file_mappings(wf, fm, fd, sb.st_ino,
+					   type == INO_TYPE_DIR ?
+					   EXT_TYPE_DIR : EXT_TYPE_FILE);
+			close(fd);
+			if (type == INO_TYPE_DIR && !wf->wf_db_err)
+				fm_walk_push(&wf->base, sb.st_ino, path);
+			if (wf->wf_db_err)
+				goto out;
+		}
+	}
+	if (nread < 0)
+		fm_walk_fail(&wf->base, errno);
+out:
+	close(dirfd);
+	/*
+	 * Hand the whole mapper state back to the walker's copy, not
+	 * just db_err: the inserts may have cached statement handles or
+	 * batched extents in our working copy.
+	 */
+	if (wf != (struct fsmap_t *)arg)
+		*base = wf->base;
+}
+
+/* Walk the mounted tree for inodes, dentries, and data mappings. */
+static void walk_fs(struct fsmap_t *wf, const char *fspath)
+{
+	struct fiemap *fm;
+	struct stat sb;
+	time_t atime, ctime, mtime;
+	int64_t size;
+
+	if (fstat(wf->rootfd, &sb)) {
+		wf->err = errno;
+		return;
+	}
+
+	atime = sb.st_atime;
+	ctime = sb.st_ctime;
+	mtime = sb.st_mtime;
+	size = sb.st_size;
+	insert_inode(&wf->base, sb.st_ino, INO_TYPE_DIR, "", &atime, NULL,
+		     &ctime, &mtime, &size);
+	if (wf->wf_db_err)
+		return;
+	ino_set_add(wf->ino_seen, sb.st_ino);
+	if (wf->ino_seen->err) {
+		wf->err = wf->ino_seen->err;
+		return;
+	}
+
+	fm = calloc(1, sizeof(struct fiemap) +
+		    FIEMAP_BATCH * sizeof(struct fiemap_extent));
+	if (!fm) {
+		wf->err = ENOMEM;
+		return;
+	}
+	walk_file_mappings(wf, fm, wf->rootfd, sb.st_ino, EXT_TYPE_DIR);
+	free(fm);
+	if (wf->wf_db_err)
+		return;
+
+	wf->err = fm_walk_run(&wf->base, wf->nr_threads, walk_dir_item, wf,
+			      sb.st_ino, "");
+}
+
+/* Names for the filesystem-specific special owners, from getfsmap.py. */
+static const struct special_owner {
+	uint64_t owner;
+	const char *name;
+} special_owners[] = {
+	{FMR_OWNER('X', 1),	"xfs:fsdata"},
+	{FMR_OWNER('X', 2),	"xfs:log"},
+	{FMR_OWNER('X', 3),	"xfs:bnobt-cntbt-rmapbt"},
+	{FMR_OWNER('X', 4),	"xfs:inobt"},
+	{FMR_OWNER('X', 5),	"xfs:inodes"},
+	{FMR_OWNER('X', 6),	"xfs:refcountbt"},
+	{FMR_OWNER('X', 7),	"xfs:cow"},
+	{FMR_OWNER('X', 8),	"xfs:defective"},
+	{FMR_OWNER('f', 1),	"ext4:group_descriptors"},
+	{FMR_OWNER('f', 2),	"ext4:reserved_gdt_blocks"},
+	{FMR_OWNER('f', 3),	"ext4:block_bitmap"},
+	{FMR_OWNER('f', 4),	"ext4:inode_bitmap"},
+	{0,			NULL},
+};
+
+static const char *special_owner_name(uint64_t owner, char *buf, size_t len)
+{
+	const struct special_owner *so;
+
+	for (so = special_owners; so->name; so++)
+		if (so->owner == owner)
+			return so->name;
+	snprintf(buf, len, "%u:%u", FMR_OWNER_TYPE(owner),
+		 FMR_OWNER_CODE(owner));
+	return buf;
+}
+
+/* Inject a fake metadata inode the first time an owner shows up. */
+static int ensure_metadir(struct fsmap_t *wf)
+{
+	struct stat sb;
+
+	if (ino_set_add(wf->fake_seen, (uint64_t)INO_METADATA_DIR))
+		return wf->fake_seen->err;
+	inject_metadata(&wf->base, fstat(wf->rootfd, &sb) ? 0 : sb.st_ino,
+			"", INO_METADATA_DIR, STR_METADATA_DIR, INO_TYPE_DIR);
+	return 0;
+}
+
+static int ensure_metadir_file(struct fsmap_t *wf, int64_t ino,
+			       const char *name, int type)
+{
+	int err;
+
+	if (ino_set_add(wf->fake_seen, (uint64_t)ino))
+		return wf->fake_seen->err;
+	err = ensure_metadir(wf);
+	if (err || wf->wf_db_err)
+		return err;
+	inject_metadata(&wf->base, INO_METADATA_DIR, "/" STR_METADATA_DIR,
+			ino, name, type);
+	return 0;
+}
+
+static int ensure_unlinked_file(struct fsmap_t *wf, int64_t ino)
+{
+	char name[32];
+	int err;
+
+	if (ino_set_add(wf->fake_seen, (uint64_t)ino))
+		return wf->fake_seen->err;
+	err = ensure_metadir_file(wf, INO_UNLINKED_DIR, STR_UNLINKED_DIR,
+				  INO_TYPE_DIR);
+	if (err || wf->wf_db_err)
+		return err;
+	snprintf(name, sizeof(name), "%"PRId64, ino);
+	inject_metadata(&wf->base, INO_UNLINKED_DIR,
+			"/" STR_METADATA_DIR "/" STR_UNLINKED_DIR,
+			ino, name, INO_TYPE_FILE);
+	return 0;
+}
+
+/*
+ * Walk the space map for free space, fs metadata, and unlinked inodes.
+ * Not every filesystem implements GETFSMAP; lacking it just means the
+ * map shows files only, exactly like the Python scanner.
+ */
+static void walk_metadata(struct fsmap_t *wf)
+{
+	struct fsmap_head *head = wf->fsmap_buf;
+	struct fsmap *rec, *last_rec = NULL;
+	uint32_t fsdev = encode_dev(wf->fsdev);
+	char namebuf[48];
+	uint64_t loff;
+	unsigned int i;
+	int64_t ino;
+	int ext_type, flags;
+
+	memset(head, 0, sizeof(*head));
+	head->fmh_keys[1].fmr_device = UINT32_MAX;
+	head->fmh_keys[1].fmr_flags = UINT32_MAX;
+	head->fmh_keys[1].fmr_physical = UINT64_MAX;
+	head->fmh_keys[1].fmr_owner = UINT64_MAX;
+	head->fmh_keys[1].fmr_offset = UINT64_MAX;
+
+	for (;;) {
+		head->fmh_count = FSMAP_BATCH;
+		head->fmh_entries = 0;
+		if (ioctl(wf->rootfd, FS_IOC_GETFSMAP, head))
+			return;
+		if (head->fmh_entries == 0)
+			return;
+
+		for (i = 0; i < head->fmh_entries; i++) {
+			rec = &head->fmh_recs[i];
+			last_rec = rec;
+			if ((head->fmh_oflags & FMH_OF_DEV_T) &&
+			    rec->fmr_device != fsdev)
+				continue;
+
+			ext_type = EXT_TYPE_METADATA;
+			flags = 0;
+			if (rec->fmr_flags & FMR_OF_PREALLOC)
+				flags |= EXTENT_UNWRITTEN;
+			if (rec->fmr_flags & FMR_OF_SHARED)
+				flags |= EXTENT_SHARED;
+
+			if (!(rec->fmr_flags & FMR_OF_SPECIAL_OWNER)) {
+				/* Unlinked (or virtual-fs) inode extents. */
+				if (ino_set_test(wf->ino_seen,
+						 rec->fmr_owner))
+					continue;
+				ino = rec->fmr_owner;
+				if (ensure_unlinked_file(wf, ino)) {
+					wf->err = wf->fake_seen->err;
+					return;
+				}
+				if (rec->fmr_flags & FMR_OF_ATTR_FORK)
+					ext_type = EXT_TYPE_XATTR;
+				else
+					ext_type = EXT_TYPE_FILE;
+				loff = rec->fmr_offset;
+				insert_extent(&wf->base, ino,
+					      rec->fmr_physical, &loff,
+					      rec->fmr_length, flags,
+					      ext_type);
+			} else if (rec->fmr_owner == FMR_OWN_FREE) {
+				if (ensure_metadir_file(wf, INO_FREESP_FILE,
+						STR_FREESP_FILE,
+						INO_TYPE_FREESP)) {
+					wf->err = wf->fake_seen->err;
+					return;
+				}
+				insert_extent(&wf->base, INO_FREESP_FILE,
+					      rec->fmr_physical, NULL,
+					      rec->fmr_length, flags,
+					      EXT_TYPE_FREESP);
+			} else if (rec->fmr_owner == FMR_OWN_METADATA) {
+				if (ensure_metadir_file(wf,
+						INO_METADATA_FILE,
+						STR_METADATA_FILE,
+						INO_TYPE_METADATA)) {
+					wf->err = wf->fake_seen->err;
+					return;
+				}
+				insert_extent(&wf->base, INO_METADATA_FILE,
+					      rec->fmr_physical, NULL,
+					      rec->fmr_length, flags,
+					      EXT_TYPE_METADATA);
+			} else if (rec->fmr_owner >> 32) {
+				/* Filesystem-specific metadata. */
+				ino = rec->fmr_owner;
+				if (ensure_metadir_file(wf, ino,
+						special_owner_name(
+							rec->fmr_owner,
+							namebuf,
+							sizeof(namebuf)),
+						INO_TYPE_METADATA)) {
+					wf->err = wf->fake_seen->err;
+					return;
+				}
+				insert_extent(&wf->base, ino,
+					      rec->fmr_physical, NULL,
+					      rec->fmr_length, flags,
+					      EXT_TYPE_METADATA);
+			} else {
+				/* Unknown generic special owner. */
+				continue;
+			}
+			if (wf->wf_db_err)
+				return;
+		}
+
+		if (last_rec->fmr_flags & FMR_OF_LAST)
+			return;
+		head->fmh_keys[0] = *last_rec;
+	}
+}
+
+#define CHECK_ERROR(msg) \
+do { \
+	if (wf.err) { \
+		fprintf(stderr, "%s %s\n", strerror(wf.err), (msg)); \
+		goto out; \
+	} \
+	if (wf.wf_db_err) { \
+		fprintf(stderr, "%s %s\n", sqlite3_errstr(wf.wf_db_err), \
+			(msg)); \
+		goto out; \
+	} \
+} while (0);
+
+int main(int argc, char *argv[])
+{
+	const char *dbfile;
+	const char *fspath;
+	char *errm;
+	struct fsmap_t wf;
+	struct statvfs sv;
+	struct stat sb;
+	sqlite3 *db = NULL;
+	int db_err = 0;
+	int nr_threads = 0;
+	int err = 0, err2, opt;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			printf("Usage: %s [-t nr_threads] dbfile fspath\n",
+			       argv[0]);
+			return 0;
+		}
+	}
+	if (argc - optind != 2) {
+		printf("Usage: %s [-t nr_threads] dbfile fspath\n", argv[0]);
+		return 0;
+	}
+
+	/* Open things */
+	memset(&wf, 0, sizeof(wf));
+	wf.rootfd = -1;
+	wf.nr_threads = nr_threads;
+	dbfile = argv[optind];
+	fspath = argv[optind + 1];
+
+	db_err = truncate(dbfile, 0);
+	if (db_err && errno != ENOENT) {
+		perror(dbfile);
+		goto out;
+	}
+
+	wf.rootfd = open(fspath, O_RDONLY | O_DIRECTORY);
+	if (wf.rootfd < 0) {
+		perror(fspath);
+		goto out;
+	}
+	if (fstat(wf.rootfd, &sb)) {
+		perror(fspath);
+		goto out;
+	}
+	wf.fsdev = sb.st_dev;
+	if (fstatvfs(wf.rootfd, &sv)) {
+		perror(fspath);
+		goto out;
+	}
+	wf.total_bytes = (uint64_t)sv.f_blocks * sv.f_bsize;
+
+	err = ino_set_init(&wf.ino_seen);
+	if (!err)
+		err = ino_set_init(&wf.fake_seen);
+	if (err) {
+		fprintf(stderr, "%s while allocating inode sets\n",
+			strerror(err));
+		goto out;
+	}
+	wf.fsmap_buf = calloc(1, sizeof(struct fsmap_head) +
+			FSMAP_BATCH * sizeof(struct fsmap));
+	if (!wf.fsmap_buf) {
+		fprintf(stderr, "%s while allocating ioctl buffers\n",
+			strerror(ENOMEM));
+		goto out;
+	}
+
+	err = compdb_register("unix-excl", "comp-unix-excl",
+			wf.total_bytes > 100000000000ULL ? "LZMA" : "GZIP");
+	if (err) {
+		fprintf(stderr, "%s while setting up compressed db\n",
+			sqlite3_errstr(err));
+		goto out;
+	}
+
+	err = sqlite3_open_v2(dbfile, &db,
+			      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+			      "comp-unix-excl");
+	if (err) {
+		fprintf(stderr, "%s while opening database\n",
+			sqlite3_errstr(err));
+		goto out;
+	}
+
+	wf.wf_iconv = iconv_open("UTF-8", "UTF-8");
+	wf.wf_db = db;
+
+	/* Prepare and clean out database. */
+	prepare_db(&wf.base);
+	CHECK_ERROR("while preparing database");
+	wf.wf_db_err = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, &errm);
+	if (errm) {
+		fprintf(stderr, "%s while starting transaction\n", errm);
+		free(errm);
+		goto out;
+	}
+	CHECK_ERROR("while starting fs analysis database transaction");
+
+	collect_fs_stats(&wf.base, (char *)fspath, sv.f_bsize, sv.f_frsize,
+			wf.total_bytes, (uint64_t)sv.f_bfree * sv.f_bsize,
+			sv.f_files, sv.f_ffree, sv.f_namemax, "fiemap");
+	CHECK_ERROR("while storing fs stats");
+
+	/* Walk the filesystem */
+	fm_writer_start(&wf.base);
+	CHECK_ERROR("while starting database writer");
+	fm_phase_start(&wf.base, "walk_fs");
+	walk_fs(&wf, fspath);
+	fm_phase_stop(&wf.base, "walk_fs");
+	CHECK_ERROR("while analyzing filesystem");
+
+	/* Walk the space map for metadata */
+	fm_phase_start(&wf.base, "walk_metadata");
+	walk_metadata(&wf);
+	fm_phase_stop(&wf.base, "walk_metadata");
+	CHECK_ERROR("while analyzing metadata");
+	fm_writer_stop(&wf.base);
+	CHECK_ERROR("while draining database writer");
+
+	/* Generate indexes and finalize. */
+	index_db(&wf.base);
+	CHECK_ERROR("while indexing database");
+	finalize_fs_stats(&wf.base, (char *)fspath);
+	CHECK_ERROR("while finalizing database");
+	calc_inode_stats(&wf.base);
+	CHECK_ERROR("while calculating inode statistics");
+
+	wf.wf_db_err = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &errm);
+	if (errm) {
+		fprintf(stderr, "%s while ending transaction\n", errm);
+		free(errm);
+		goto out;
+	}
+	CHECK_ERROR("while flushing fs analysis database transaction");
+
+	wf.wf_db_err = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, &errm);
+	if (errm) {
+		fprintf(stderr, "%s while starting transaction\n", errm);
+		free(errm);
+		goto out;
+	}
+	CHECK_ERROR("while starting overview cache database transaction");
+
+	/* Cache overviews at every zoom level. */
+	cache_overview(&wf.base, 65536);
+	CHECK_ERROR("while caching overviews");
+	wf.wf_db_err = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &errm);
+	if (errm) {
+		fprintf(stderr, "%s while ending transaction\n", errm);
+		free(errm);
+		goto out;
+	}
+	CHECK_ERROR("while flushing overview cache database transaction");
+
+out:
+	if (wf.wf_iconv)
+		iconv_close(wf.wf_iconv);
+
+	cleanup_db(&wf.base);
+	err2 = sqlite3_close(db);
+	if (err2)
+		fprintf(stderr, "%s while closing database\n",
+			sqlite3_errstr(err2));
+	if (!err && err2)
+		err = err2;
+
+	free(wf.fsmap_buf);
+	ino_set_destroy(wf.fake_seen);
+	ino_set_destroy(wf.ino_seen);
+	if (wf.rootfd >= 0)
+		close(wf.rootfd);
+
+	return err;
+}
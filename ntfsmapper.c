@@ -336,60 +336,18 @@ static void walk_fs(struct ntfsmap_t *wf)
 	wf->ino_bmap = NULL;
 }
 
-/* Walk a byte in the bitmap... */
-#define CL(c)		((c) * wf->fs->cluster_size)
-static inline void walk_block_bitmap_byte(struct ntfsmap_t *wf,
-					  unsigned char b, long long blknow,
-					  long long *freestart)
-{
-	int j;
-
-	switch (b) {
-	case 0:
-		if (*freestart < 0)
-			*freestart = blknow;
-		break;
-	case 255:
-		if (*freestart >= 0) {
-			insert_extent(&wf->base, INO_FREESP_FILE,
-			      CL(*freestart), NULL,
-			      CL(blknow - *freestart), 0,
-			      EXT_TYPE_FREESP);
-			dbg_printf("freestart %llu blknow %llu\n",
-				   *freestart, blknow);
-			*freestart = -1;
-		}
-		break;
-	default:
-		for (j = 0; j < 8; j++, blknow++) {
-			if ( (b & (1 << j)) && *freestart >= 0) {
-				insert_extent(&wf->base, INO_FREESP_FILE,
-					      CL(*freestart), NULL,
-					      CL(blknow - *freestart),
-					      0, EXT_TYPE_FREESP);
-				dbg_printf("freestart %llu blknow %llu\n",
-					   *freestart, blknow);
-				*freestart = -1;
-			} else if ( !(b & (1 << j)) && *freestart < 0) {
-				*freestart = blknow;
-			}
-		}
-		break;
-	}
-}
-
 /* Read bitmap? */
+#define CL(c)		((c) * wf->fs->cluster_size)
 #define BITMAP_LEN	65536
 static void walk_block_bitmap(struct ntfsmap_t *wf)
 {
 	ntfs_attr *bmp_na = wf->fs->lcnbmp_na;
 	unsigned char buf[BITMAP_LEN];
-	unsigned char *b;
 	long long bmp_offset = 0;
 	long long br;
 	long long freestart;
-	long long blk;
-	long long blknow;
+	uint64_t nr_bits;
+	uint64_t bit;
 
 	inject_metadata(&wf->base, INO_METADATA_DIR, "/" STR_METADATA_DIR,
 			INO_FREESP_FILE, STR_FREESP_FILE, INO_TYPE_FREESP);
@@ -402,10 +360,27 @@ static void walk_block_bitmap(struct ntfsmap_t *wf)
 		if (br <= 0)
 			break;
 
-		/* Look for zero bits == free clusters. */
-		for (b = buf, blk = 0; b < buf + br; b++, blk += 8) {
-			blknow = (bmp_offset << 3) + blk;
-			walk_block_bitmap_byte(wf, *b, blknow, &freestart);
+		/* Look for runs of zero bits == free clusters. */
+		nr_bits = br << 3;
+		bit = 0;
+		while (bit < nr_bits) {
+			if (freestart < 0) {
+				bit = fm_find_next_zero_bit(buf, nr_bits, bit);
+				if (bit == nr_bits)
+					break;
+				freestart = (bmp_offset << 3) + bit;
+			}
+			bit = fm_find_next_bit(buf, nr_bits, bit);
+			if (bit == nr_bits)
+				break;
+
+			insert_extent(&wf->base, INO_FREESP_FILE,
+				      CL(freestart), NULL,
+				      CL((bmp_offset << 3) + bit - freestart),
+				      0, EXT_TYPE_FREESP);
+			dbg_printf("freestart %llu blknow %llu\n",
+				   freestart, (bmp_offset << 3) + bit);
+			freestart = -1;
 		}
 
 		bmp_offset += br;
@@ -413,7 +388,7 @@ static void walk_block_bitmap(struct ntfsmap_t *wf)
 	if (freestart >= 0) {
 		insert_extent(&wf->base, INO_FREESP_FILE,
 			      CL(freestart), NULL,
-			      CL(blknow - freestart),
+			      CL((bmp_offset << 3) - freestart),
 			      0, EXT_TYPE_FREESP);
 		dbg_printf("freestart %llu eofs %llu\n", freestart,
 			   wf->fs->nr_clusters);
@@ -541,10 +516,18 @@ int main(int argc, char *argv[])
 	CHECK_ERROR("while storing fs stats");
 
 	/* Walk the filesystem */
+	fm_writer_start(&wf.base);
+	CHECK_ERROR("while starting database writer");
+	fm_phase_start(&wf.base, "walk_fs");
 	walk_fs(&wf);
+	fm_phase_stop(&wf.base, "walk_fs");
 	CHECK_ERROR("while analyzing filesystem");
+	fm_phase_start(&wf.base, "walk_metadata");
 	walk_block_bitmap(&wf);
+	fm_phase_stop(&wf.base, "walk_metadata");
 	CHECK_ERROR("while analyzing free space");
+	fm_writer_stop(&wf.base);
+	CHECK_ERROR("while draining database writer");
 
 	/* Generate indexes and finalize. */
 	index_db(&wf.base);
@@ -570,11 +553,9 @@ int main(int argc, char *argv[])
 	}
 	CHECK_ERROR("while starting overview cache database transaction");
 
-	/* Cache overviews. */
-	cache_overview(&wf.base, 2048);
-	CHECK_ERROR("while caching CLI overview");
+	/* Cache overviews at every zoom level. */
 	cache_overview(&wf.base, 65536);
-	CHECK_ERROR("while caching GUI overview");
+	CHECK_ERROR("while caching overviews");
 	wf.wf_db_err = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &errm);
 	if (errm) {
 		ntfs_log_error("%s while ending transaction", errm);
@@ -587,6 +568,7 @@ out:
 	if (wf.wf_iconv)
 		iconv_close(wf.wf_iconv);
 
+	cleanup_db(&wf.base);
 	err2 = sqlite3_close(db);
 	if (err2)
 		ntfs_log_error("%s while closing database",
@@ -9,6 +9,12 @@
 #include "compress.h"
 
 #define MOD_NAME		"compdb"
+#define QUERY_CAPSULE		MOD_NAME ".query"
+
+/* Extent types that count towards the filesystem summary. */
+#define SUMMARY_ETYPE_FMT	"%d, %d, %d, %d, %d"
+#define SUMMARY_ETYPE_ARGS	EXT_TYPE_FILE, EXT_TYPE_DIR, EXT_TYPE_XATTR, \
+				EXT_TYPE_SYMLINK, EXT_TYPE_FREESP
 
 /* Get a list of supported compression algorithms. */
 static PyObject *
@@ -41,8 +47,10 @@ compdb_register_py(
 		return NULL;
 
 	err = compdb_register(under, name, compr);
-        if (err)
+        if (err) {
 		PyErr_SetString(PyExc_RuntimeError, strerror(err));
+		return NULL;
+	}
 
 	return Py_BuildValue("i", err);
 }
@@ -62,25 +70,782 @@ compdb_unregister_py(
 
 	vfs = sqlite3_vfs_find(name);
 	if (!vfs) {
-		err = ENOENT;
-		PyErr_SetString(PyExc_RuntimeError, strerror(err));
-		goto out;
+		PyErr_SetString(PyExc_RuntimeError, strerror(ENOENT));
+		return NULL;
 	}
 
 	err = sqlite3_vfs_unregister(vfs);
 	if (err != SQLITE_OK) {
-		err = EIO;
-		PyErr_SetString(PyExc_RuntimeError, strerror(err));
+		PyErr_SetString(PyExc_RuntimeError, strerror(EIO));
+		return NULL;
 	}
 
-out:
 	return Py_BuildValue("i", err);
 }
 
+/*
+ * Native query engine.
+ *
+ * fmdb.py runs its queries through Python's sqlite3 module, which creates
+ * Python objects for every row it touches.  On a map with millions of
+ * extents that per-row overhead dominates the interactive query latency,
+ * so the hot read-only operations are also implemented here: they open
+ * their own connection, run the SQL in C, and hand the whole result set
+ * back to Python in a single call as packed buffers.
+ */
+
+/* Sentinel pointer marking an explicitly closed query handle. */
+static char query_closed_sentinel;
+
+/* Free the database connection when a query handle is collected. */
+static void
+query_capsule_free(
+	PyObject	*cap)
+{
+	void		*db;
+
+	db = PyCapsule_GetPointer(cap, QUERY_CAPSULE);
+	if (db && db != &query_closed_sentinel)
+		sqlite3_close(db);
+}
+
+/* Dig the database connection out of a query handle. */
+static sqlite3 *
+query_capsule_db(
+	PyObject	*cap)
+{
+	void		*db;
+
+	db = PyCapsule_GetPointer(cap, QUERY_CAPSULE);
+	if (!db)
+		return NULL;
+	if (db == &query_closed_sentinel) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"query handle is closed");
+		return NULL;
+	}
+
+	return db;
+}
+
+/* Turn the connection's last error into a Python exception. */
+static void
+query_set_db_err(
+	sqlite3		*db)
+{
+	PyErr_SetString(PyExc_RuntimeError, sqlite3_errmsg(db));
+}
+
+/* Open a read-only connection for the native query paths. */
+static PyObject *
+query_open_py(
+	PyObject	*self,
+	PyObject	*args)
+{
+	sqlite3		*db;
+	char		*uri;
+	int		err;
+
+	if (!PyArg_ParseTuple(args, "s", &uri))
+		return NULL;
+
+	err = sqlite3_open_v2(uri, &db,
+			SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+	if (err != SQLITE_OK) {
+		if (db)
+			query_set_db_err(db);
+		else
+			PyErr_SetString(PyExc_RuntimeError,
+					sqlite3_errstr(err));
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	return PyCapsule_New(db, QUERY_CAPSULE, query_capsule_free);
+}
+
+/* Close a query handle ahead of garbage collection. */
+static PyObject *
+query_close_py(
+	PyObject	*self,
+	PyObject	*args)
+{
+	PyObject	*cap;
+	sqlite3		*db;
+
+	if (!PyArg_ParseTuple(args, "O", &cap))
+		return NULL;
+
+	db = query_capsule_db(cap);
+	if (!db)
+		return NULL;
+
+	sqlite3_close(db);
+	PyCapsule_SetPointer(cap, &query_closed_sentinel);
+	Py_RETURN_NONE;
+}
+
+/* Run an aggregate query that returns up to two integer columns. */
+static int
+query_onerow(
+	sqlite3		*db,
+	const char	*sql,
+	long long	*col0,
+	long long	*col1)
+{
+	sqlite3_stmt	*stmt;
+	int		err;
+
+	err = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		return err;
+
+	err = sqlite3_step(stmt);
+	if (err == SQLITE_ROW) {
+		if (col0)
+			*col0 = sqlite3_column_int64(stmt, 0);
+		if (col1)
+			*col1 = sqlite3_column_int64(stmt, 1);
+		err = SQLITE_OK;
+	}
+	sqlite3_finalize(stmt);
+
+	return err == SQLITE_OK || err == SQLITE_DONE ? 0 : err;
+}
+
+/* Compute the filesystem summary entirely in C. */
+static PyObject *
+query_summary_py(
+	PyObject	*self,
+	PyObject	*args)
+{
+	PyObject	*cap;
+	PyObject	*ts;
+	PyObject	*o;
+	sqlite3		*db;
+	sqlite3_stmt	*stmt;
+	char		sql[256];
+	long long	extents = 0;
+	long long	extent_bytes = 0;
+	long long	inodes = 0;
+	int		err;
+
+	if (!PyArg_ParseTuple(args, "O", &cap))
+		return NULL;
+	db = query_capsule_db(cap);
+	if (!db)
+		return NULL;
+
+	/* One pass over extent_t yields both the count and the sum. */
+	snprintf(sql, sizeof(sql),
+		 "SELECT COUNT(ino), COALESCE(SUM(length), 0) FROM extent_t "
+		 "WHERE type IN (" SUMMARY_ETYPE_FMT ")",
+		 SUMMARY_ETYPE_ARGS);
+	Py_BEGIN_ALLOW_THREADS
+	err = query_onerow(db, sql, &extents, &extent_bytes);
+	Py_END_ALLOW_THREADS
+	if (err)
+		goto err_db;
+
+	snprintf(sql, sizeof(sql),
+		 "SELECT COUNT(ino) FROM inode_t WHERE ino IN "
+		 "(SELECT DISTINCT ino FROM extent_t WHERE type IN "
+		 "(" SUMMARY_ETYPE_FMT "))",
+		 SUMMARY_ETYPE_ARGS);
+	Py_BEGIN_ALLOW_THREADS
+	err = query_onerow(db, sql, &inodes, NULL);
+	Py_END_ALLOW_THREADS
+	if (err)
+		goto err_db;
+
+	err = sqlite3_prepare_v2(db,
+			"SELECT path, block_size, frag_size, total_bytes, "
+			"free_bytes, avail_bytes, total_inodes, free_inodes, "
+			"avail_inodes, path_separator, timestamp, fstype "
+			"FROM fs_t", -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		goto err_db;
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		sqlite3_finalize(stmt);
+		PyErr_SetString(PyExc_ValueError, "Database is empty.");
+		return NULL;
+	}
+
+	/* In the old days, the date was a string instead of Epoch seconds */
+	if (sqlite3_column_type(stmt, 10) == SQLITE_TEXT)
+		ts = Py_BuildValue("s",
+				(const char *)sqlite3_column_text(stmt, 10));
+	else
+		ts = Py_BuildValue("L",
+				(long long)sqlite3_column_int64(stmt, 10));
+	if (!ts) {
+		sqlite3_finalize(stmt);
+		return NULL;
+	}
+
+	o = Py_BuildValue("LLLsLLLLLLLLsNs",
+			extents, extent_bytes, inodes,
+			(const char *)sqlite3_column_text(stmt, 0),
+			(long long)sqlite3_column_int64(stmt, 1),
+			(long long)sqlite3_column_int64(stmt, 2),
+			(long long)sqlite3_column_int64(stmt, 3),
+			(long long)sqlite3_column_int64(stmt, 4),
+			(long long)sqlite3_column_int64(stmt, 5),
+			(long long)sqlite3_column_int64(stmt, 6),
+			(long long)sqlite3_column_int64(stmt, 7),
+			(long long)sqlite3_column_int64(stmt, 8),
+			(const char *)sqlite3_column_text(stmt, 9),
+			ts,
+			(const char *)sqlite3_column_text(stmt, 11));
+	sqlite3_finalize(stmt);
+
+	return o;
+err_db:
+	query_set_db_err(db);
+	return NULL;
+}
+
+/* Load one cached overview level into an array of cells. */
+static int
+query_overview_level(
+	sqlite3			*db,
+	long long		length,
+	struct overview_t	*cells,
+	long long		*nr_out)
+{
+	sqlite3_stmt	*stmt;
+	long long	nr = 0;
+	int		err;
+
+	err = sqlite3_prepare_v2(db,
+			"SELECT cell_no, files, dirs, mappings, metadata, "
+			"xattrs, symlinks, freesp FROM overview_t "
+			"WHERE length = ?", -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		return err;
+	sqlite3_bind_int64(stmt, 1, length);
+
+	while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_int64	cell = sqlite3_column_int64(stmt, 0);
+		struct overview_t	*ov;
+
+		if (cell < 0 || cell >= length) {
+			err = SQLITE_CORRUPT;
+			break;
+		}
+		ov = &cells[cell];
+		ov->files = sqlite3_column_int64(stmt, 1);
+		ov->dirs = sqlite3_column_int64(stmt, 2);
+		ov->mappings = sqlite3_column_int64(stmt, 3);
+		ov->metadata = sqlite3_column_int64(stmt, 4);
+		ov->xattrs = sqlite3_column_int64(stmt, 5);
+		ov->symlinks = sqlite3_column_int64(stmt, 6);
+		ov->freesp = sqlite3_column_int64(stmt, 7);
+		nr++;
+	}
+	sqlite3_finalize(stmt);
+	*nr_out = nr;
+
+	return err == SQLITE_DONE ? SQLITE_OK : err;
+}
+
+/*
+ * Approximate a requested overview length by re-binning the finest
+ * cached level -- the same aggregation overview_block.from_buffer does
+ * for runs of cells, so an extent spanning several base cells counts
+ * once per base cell it touched.  base_total is the fs size the base
+ * level was computed against; if total_bytes grew afterwards, the
+ * target cells past the old end stay empty.
+ */
+static void
+query_overview_rebin(
+	const struct overview_t	*base,
+	long long		base_len,
+	long long		base_total,
+	struct overview_t	*cells,
+	long long		length,
+	long long		total)
+{
+	unsigned long long	lo, hi;
+	long long		i, i0, i1, j;
+	uint64_t		*counter;
+	const uint64_t		*delta;
+	unsigned int		f;
+
+	for (j = 0; j < length; j++) {
+		lo = j * (unsigned long long)total / length;
+		hi = (j + 1) * (unsigned long long)total / length;
+		if (hi > lo)
+			hi--;		/* last byte this cell covers */
+		if (lo >= (unsigned long long)base_total)
+			continue;
+		if (hi >= (unsigned long long)base_total)
+			hi = base_total - 1;
+		i0 = lo * base_len / base_total;
+		i1 = hi * base_len / base_total;
+		if (i1 >= base_len)
+			i1 = base_len - 1;
+
+		/* overview_t is seven adjacent counters. */
+		counter = &cells[j].files;
+		for (i = i0; i <= i1; i++) {
+			delta = &base[i].files;
+			for (f = 0; f < 7; f++)
+				counter[f] += delta[f];
+		}
+	}
+}
+
+/*
+ * Fetch an entire cached overview level as one contiguous array of
+ * struct overview_t, indexed by cell number.  If that exact level is
+ * not cached, derive it from the finest level recorded in
+ * overview_base_t.  Returns None only when nothing is cached at all,
+ * in which case the caller has to generate it the slow way.
+ */
+static PyObject *
+query_overview_py(
+	PyObject	*self,
+	PyObject	*args)
+{
+	struct overview_t	*cells = NULL;
+	struct overview_t	*base = NULL;
+	PyObject	*cap;
+	PyObject	*o;
+	sqlite3		*db;
+	long long	length;
+	long long	base_len = 0;
+	long long	base_total = 0;
+	long long	total = 0;
+	long long	nr = 0;
+	int		err;
+
+	if (!PyArg_ParseTuple(args, "OL", &cap, &length))
+		return NULL;
+	db = query_capsule_db(cap);
+	if (!db)
+		return NULL;
+	if (length < 1) {
+		PyErr_SetString(PyExc_ValueError, "bad overview length");
+		return NULL;
+	}
+
+	cells = calloc(length, sizeof(struct overview_t));
+	if (!cells)
+		return PyErr_NoMemory();
+
+	Py_BEGIN_ALLOW_THREADS
+	err = query_overview_level(db, length, cells, &nr);
+	Py_END_ALLOW_THREADS
+	if (err == SQLITE_CORRUPT)
+		goto err_corrupt;
+	if (err != SQLITE_OK)
+		goto err_db;
+	if (nr == length)
+		goto done;
+
+	/*
+	 * Level not cached; re-bin the finest one.  No overview_base_t
+	 * (an old database or one with no overviews at all) means the
+	 * caller regenerates the slow way.
+	 */
+	if (query_onerow(db,
+			"SELECT length, total_bytes FROM overview_base_t",
+			&base_len, &base_total) ||
+	    base_len < 1 || base_total < 1 || base_len == length)
+		goto uncached;
+	if (query_onerow(db, "SELECT total_bytes FROM fs_t", &total, NULL) ||
+	    total < 1)
+		goto uncached;
+
+	base = calloc(base_len, sizeof(struct overview_t));
+	if (!base) {
+		free(cells);
+		return PyErr_NoMemory();
+	}
+	Py_BEGIN_ALLOW_THREADS
+	err = query_overview_level(db, base_len, base, &nr);
+	Py_END_ALLOW_THREADS
+	if (err == SQLITE_CORRUPT)
+		goto err_corrupt;
+	if (err != SQLITE_OK)
+		goto err_db;
+	if (nr != base_len)
+		goto uncached;
+
+	memset(cells, 0, length * sizeof(struct overview_t));
+	Py_BEGIN_ALLOW_THREADS
+	query_overview_rebin(base, base_len, base_total, cells, length,
+			total);
+	Py_END_ALLOW_THREADS
+	free(base);
+	base = NULL;
+
+done:
+	o = PyBytes_FromStringAndSize((char *)cells,
+			length * sizeof(struct overview_t));
+	free(cells);
+	return o;
+uncached:
+	free(base);
+	free(cells);
+	Py_RETURN_NONE;
+err_corrupt:
+	PyErr_SetString(PyExc_ValueError, "overview cell out of range");
+	free(base);
+	free(cells);
+	return NULL;
+err_db:
+	query_set_db_err(db);
+	free(base);
+	free(cells);
+	return NULL;
+}
+
+/* Result buffer that grows as rows accumulate. */
+struct qbuf {
+	char		*data;
+	size_t		used;
+	size_t		size;
+};
+
+/* Append bytes to a result buffer, growing it as needed. */
+static int
+qbuf_put(
+	struct qbuf	*buf,
+	const void	*p,
+	size_t		len)
+{
+	char		*ndata;
+	size_t		nsize;
+
+	if (buf->used + len > buf->size) {
+		nsize = buf->size ? buf->size * 2 : 65536;
+		while (nsize < buf->used + len)
+			nsize *= 2;
+		ndata = realloc(buf->data, nsize);
+		if (!ndata)
+			return ENOMEM;
+		buf->data = ndata;
+		buf->size = nsize;
+	}
+	memcpy(buf->data + buf->used, p, len);
+	buf->used += len;
+
+	return 0;
+}
+
+/*
+ * One packed extent row, as handed back to Python.  All fields are
+ * native-endian int64 so the other side can unpack with '=7q'.
+ */
+struct query_ext_rec {
+	int64_t		path;		/* offset into the path buffer */
+	int64_t		ino;
+	int64_t		p_off;
+	int64_t		l_off;		/* -1 if unknown */
+	int64_t		length;
+	int64_t		flags;
+	int64_t		type;
+};
+
+/* Query field modes for query_extents_py. */
+#define QUERY_EXT_POFF		0
+#define QUERY_EXT_LOFF		1
+
+/*
+ * Find all extents overlapping any of a set of ranges, optionally
+ * restricted to a set of extent types.  The whole result set comes back
+ * in one call as two buffers: the NUL-terminated path strings, and the
+ * packed extent records pointing into them.
+ */
+static PyObject *
+query_extents_py(
+	PyObject	*self,
+	PyObject	*args)
+{
+	struct qbuf	paths = {NULL, 0, 0};
+	struct qbuf	recs = {NULL, 0, 0};
+	struct query_ext_rec	rec;
+	PyObject	*cap;
+	PyObject	*rangeo;
+	PyObject	*typeo = Py_None;
+	PyObject	*seq = NULL;
+	PyObject	*tseq = NULL;
+	PyObject	*pathso;
+	PyObject	*recso;
+	PyObject	*o = NULL;
+	sqlite3		*db;
+	sqlite3_stmt	*stmt = NULL;
+	sqlite3_int64	*bounds = NULL;
+	const char	*fstart;
+	const char	*fend;
+	const char	*cond;
+	char		*sql = NULL;
+	char		*p;
+	size_t		sqlsz;
+	Py_ssize_t	nranges;
+	Py_ssize_t	ntypes = 0;
+	Py_ssize_t	i;
+	int		mode;
+	int		col;
+	int		err;
+
+	if (!PyArg_ParseTuple(args, "OiO|O", &cap, &mode, &rangeo, &typeo))
+		return NULL;
+	db = query_capsule_db(cap);
+	if (!db)
+		return NULL;
+
+	switch (mode) {
+	case QUERY_EXT_POFF:
+		fstart = "p_off";
+		fend = "p_end";
+		break;
+	case QUERY_EXT_LOFF:
+		fstart = "l_off";
+		fend = "l_off + length - 1";
+		break;
+	default:
+		PyErr_SetString(PyExc_ValueError, "bad query mode");
+		return NULL;
+	}
+
+	seq = PySequence_Fast(rangeo, "ranges must be a sequence");
+	if (!seq)
+		return NULL;
+	nranges = PySequence_Fast_GET_SIZE(seq);
+	if (typeo != Py_None) {
+		tseq = PySequence_Fast(typeo, "types must be a sequence");
+		if (!tseq)
+			goto err;
+		ntypes = PySequence_Fast_GET_SIZE(tseq);
+	}
+	if (!nranges)
+		goto out_empty;
+
+	/* Range endpoints; a bare number means a single-byte range. */
+	bounds = malloc(nranges * 2 * sizeof(*bounds));
+	if (!bounds) {
+		PyErr_NoMemory();
+		goto err;
+	}
+	for (i = 0; i < nranges; i++) {
+		PyObject	*r = PySequence_Fast_GET_ITEM(seq, i);
+
+		if (PyLong_Check(r)) {
+			bounds[i * 2] = PyLong_AsLongLong(r);
+			bounds[i * 2 + 1] = bounds[i * 2];
+		} else {
+			PyObject	*lo = PySequence_GetItem(r, 0);
+			PyObject	*hi = PySequence_GetItem(r, 1);
+
+			if (!lo || !hi) {
+				Py_XDECREF(lo);
+				Py_XDECREF(hi);
+				goto err;
+			}
+			bounds[i * 2] = PyLong_AsLongLong(lo);
+			bounds[i * 2 + 1] = PyLong_AsLongLong(hi);
+			Py_DECREF(lo);
+			Py_DECREF(hi);
+		}
+		if (PyErr_Occurred())
+			goto err;
+	}
+
+	sqlsz = 256 + ntypes * 8 + nranges * 96;
+	sql = malloc(sqlsz);
+	if (!sql) {
+		PyErr_NoMemory();
+		goto err;
+	}
+	p = sql;
+	p += snprintf(p, sql + sqlsz - p,
+		      "SELECT path, ino, p_off, l_off, length, flags, type "
+		      "FROM path_extent_v WHERE ");
+	if (ntypes) {
+		p += snprintf(p, sql + sqlsz - p, "type IN (");
+		for (i = 0; i < ntypes; i++)
+			p += snprintf(p, sql + sqlsz - p, "%s?",
+				      i ? ", " : "");
+		p += snprintf(p, sql + sqlsz - p, ") AND (");
+	}
+	cond = "";
+	for (i = 0; i < nranges; i++) {
+		p += snprintf(p, sql + sqlsz - p, "%s(%s <= ? AND %s >= ?)",
+			      cond, fstart, fend);
+		cond = " OR ";
+	}
+	p += snprintf(p, sql + sqlsz - p, "%s ORDER BY ino, l_off",
+		      ntypes ? ")" : "");
+
+	err = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		goto err_db;
+	col = 1;
+	for (i = 0; i < ntypes; i++) {
+		long long	tv;
+
+		tv = PyLong_AsLongLong(PySequence_Fast_GET_ITEM(tseq, i));
+		if (PyErr_Occurred())
+			goto err;
+		sqlite3_bind_int64(stmt, col++, tv);
+	}
+	for (i = 0; i < nranges; i++) {
+		sqlite3_bind_int64(stmt, col++, bounds[i * 2 + 1]);
+		sqlite3_bind_int64(stmt, col++, bounds[i * 2]);
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char	*path;
+		int		pathlen;
+
+		path = (const char *)sqlite3_column_text(stmt, 0);
+		pathlen = sqlite3_column_bytes(stmt, 0);
+		rec.path = paths.used;
+		rec.ino = sqlite3_column_int64(stmt, 1);
+		rec.p_off = sqlite3_column_int64(stmt, 2);
+		if (sqlite3_column_type(stmt, 3) == SQLITE_NULL)
+			rec.l_off = -1;
+		else
+			rec.l_off = sqlite3_column_int64(stmt, 3);
+		rec.length = sqlite3_column_int64(stmt, 4);
+		rec.flags = sqlite3_column_int64(stmt, 5);
+		rec.type = sqlite3_column_int64(stmt, 6);
+		if (qbuf_put(&paths, path ? path : "", pathlen) ||
+		    qbuf_put(&paths, "", 1) ||
+		    qbuf_put(&recs, &rec, sizeof(rec))) {
+			err = SQLITE_NOMEM;
+			break;
+		}
+	}
+	Py_END_ALLOW_THREADS
+	if (err != SQLITE_DONE) {
+		if (err == SQLITE_NOMEM)
+			PyErr_NoMemory();
+		else
+			query_set_db_err(db);
+		goto err;
+	}
+
+out_empty:
+	pathso = PyBytes_FromStringAndSize(paths.data ? paths.data : "",
+			paths.used);
+	recso = PyBytes_FromStringAndSize(recs.data ? recs.data : "",
+			recs.used);
+	if (!pathso || !recso) {
+		Py_XDECREF(pathso);
+		Py_XDECREF(recso);
+		goto err;
+	}
+	o = Py_BuildValue("(NN)", pathso, recso);
+err:
+	if (stmt)
+		sqlite3_finalize(stmt);
+	free(sql);
+	free(bounds);
+	free(paths.data);
+	free(recs.data);
+	Py_XDECREF(tseq);
+	Py_DECREF(seq);
+	return o;
+err_db:
+	query_set_db_err(db);
+	goto err;
+}
+
+/* Convert byte ranges into overview cell numbers. */
+static PyObject *
+pick_bytes_py(
+	PyObject	*self,
+	PyObject	*args)
+{
+	PyObject	*rangeo;
+	PyObject	*seq;
+	PyObject	*out;
+	PyObject	*cello;
+	long long	total_bytes;
+	long long	bytes_per_cell;
+	long long	lo;
+	long long	hi;
+	Py_ssize_t	n;
+	Py_ssize_t	i;
+
+	if (!PyArg_ParseTuple(args, "OLL", &rangeo, &total_bytes,
+			&bytes_per_cell))
+		return NULL;
+	if (bytes_per_cell < 1) {
+		PyErr_SetString(PyExc_ValueError, "bad cell size");
+		return NULL;
+	}
+
+	seq = PySequence_Fast(rangeo, "ranges must be a sequence");
+	if (!seq)
+		return NULL;
+	n = PySequence_Fast_GET_SIZE(seq);
+	out = PyList_New(n);
+	if (!out)
+		goto err;
+	for (i = 0; i < n; i++) {
+		PyObject	*r = PySequence_Fast_GET_ITEM(seq, i);
+
+		if (PyLong_Check(r)) {
+			lo = hi = PyLong_AsLongLong(r);
+			if (PyErr_Occurred())
+				goto err_out;
+			if (lo > total_bytes)
+				goto err_range;
+			cello = Py_BuildValue("L", lo / bytes_per_cell);
+		} else {
+			PyObject	*loo = PySequence_GetItem(r, 0);
+			PyObject	*hio = PySequence_GetItem(r, 1);
+
+			if (!loo || !hio) {
+				Py_XDECREF(loo);
+				Py_XDECREF(hio);
+				goto err_out;
+			}
+			lo = PyLong_AsLongLong(loo);
+			hi = PyLong_AsLongLong(hio);
+			Py_DECREF(loo);
+			Py_DECREF(hio);
+			if (PyErr_Occurred())
+				goto err_out;
+			if (lo > total_bytes || hi > total_bytes) {
+				lo = lo > total_bytes ? lo : hi;
+				goto err_range;
+			}
+			cello = Py_BuildValue("(LL)", lo / bytes_per_cell,
+					hi / bytes_per_cell);
+		}
+		if (!cello)
+			goto err_out;
+		PyList_SET_ITEM(out, i, cello);
+	}
+	Py_DECREF(seq);
+
+	return out;
+err_range:
+	PyErr_Format(PyExc_ValueError, "range %lld outside of fs", lo);
+err_out:
+	Py_DECREF(out);
+err:
+	Py_DECREF(seq);
+	return NULL;
+}
+
 static PyMethodDef compdb_methods[] = {
 	{"register", compdb_register_py, METH_VARARGS, NULL},
 	{"unregister", compdb_unregister_py, METH_VARARGS, NULL},
 	{"compressors", compdb_compressors_py, METH_NOARGS, NULL},
+	{"query_open", query_open_py, METH_VARARGS, NULL},
+	{"query_close", query_close_py, METH_VARARGS, NULL},
+	{"query_summary", query_summary_py, METH_VARARGS, NULL},
+	{"query_overview", query_overview_py, METH_VARARGS, NULL},
+	{"query_extents", query_extents_py, METH_VARARGS, NULL},
+	{"pick_bytes", pick_bytes_py, METH_VARARGS, NULL},
 	{NULL, NULL, 0, NULL}
 };
 
@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -78,6 +79,215 @@ NOOP_compress(
 	return 0;
 }
 
+/*
+ * Recompression pipeline.  Every page is independent (each carries its
+ * own compdb_block_head), so the workers claim page numbers from a
+ * shared counter, read and transform their pages in parallel, and then
+ * take turns writing the results out in page order.  The same function
+ * run on one thread is the old serial loop.
+ */
+struct shrink_ctx {
+	struct compdb_info	*cdb;
+	struct compressor_type	*inc;
+	struct compressor_type	*outc;
+	const char		*inname;
+	const char		*outname;
+	size_t			nr_pages;
+	int			fdin;
+	int			fdout;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		turn;		/* next_write advanced */
+	size_t			next_read;
+	size_t			next_write;
+	int			err;		/* exit code, 0 == ok */
+};
+
+/* Record a failure and wake anyone waiting for their turn. */
+static void
+shrink_fail(
+	struct shrink_ctx	*ctx,
+	int			code)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if (!ctx->err)
+		ctx->err = code;
+	pthread_cond_broadcast(&ctx->turn);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Pull pages through read/transform/ordered-write until they run out. */
+static void *
+shrink_thread(
+	void			*arg)
+{
+	struct shrink_ctx	*ctx = arg;
+	struct compdb_info	*cdb = ctx->cdb;
+	struct compdb_block_head	*bhead;
+	char			*bin, *bout;
+	void			*outp;
+	size_t			page;
+	size_t			outlen;
+	int			try_compress;
+	ssize_t			ret;
+
+	bin = malloc(cdb->pagesize);
+	bout = malloc(cdb->pagesize);
+	if (!bin || !bout) {
+		perror("malloc");
+		shrink_fail(ctx, 2);
+		goto out;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		if (ctx->err) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		page = ctx->next_read++;
+		pthread_mutex_unlock(&ctx->lock);
+		if (page >= ctx->nr_pages)
+			break;
+
+		/* Read buffer. */
+		dbg_printf("%s(%d) off=%zu len=%u\n", __func__, __LINE__,
+				page * cdb->pagesize, cdb->pagesize);
+		ret = pread(ctx->fdin, bin, cdb->pagesize,
+				page * cdb->pagesize);
+		if (ret < 0) {
+			perror(ctx->inname);
+			shrink_fail(ctx, 3);
+			break;
+		} else if (ret < cdb->pagesize) {
+			if (page != ctx->nr_pages - 1) {
+				printf("%s: Short page %zu read?\n",
+						ctx->inname, page);
+				shrink_fail(ctx, 3);
+				break;
+			}
+			memset(bin + ret, 0, cdb->pagesize - ret);
+		}
+
+		/* Transform buffer. */
+		outlen = cdb->pagesize;
+		outp = bin;
+		bhead = (struct compdb_block_head *)bin;
+		try_compress = 0;
+		if (page == 0) {
+			/* Do we need to change the header? */
+			if (cdb->type == DB_REGULAR || ctx->inc != ctx->outc)
+				memcpy(outp, cdb->out_file_header,
+						sizeof(cdb->out_file_header));
+		} else if (cdb->type == DB_COMPRESSED &&
+			   !memcmp(bhead->magic, COMPDB_BLOCK_MAGIC,
+					sizeof(COMPDB_BLOCK_MAGIC)) &&
+			   ntohl(bhead->offset) == page) {
+			if (ctx->inc == ctx->outc) {
+				/* Compressed page, send it along. */
+				outlen = ntohs(bhead->len) + sizeof(*bhead);
+			} else {
+				/* Changing compression types; decompress. */
+				ret = ctx->inc->decompress(bin + sizeof(*bhead),
+						bout,
+						ntohs(bhead->len),
+						cdb->pagesize);
+				if (ret <= 0) {
+					printf("%s: Decompression failed at "
+						" page %zu\n", ctx->inname,
+						page);
+					shrink_fail(ctx, 3);
+					break;
+				}
+				dbg_printf("%s(%d) off=%zu len=%d\n", __func__,
+						__LINE__, page * cdb->pagesize,
+						ntohs(bhead->len));
+				swap(bin, bout);
+				outp = bin;
+				try_compress = 1;
+			}
+		} else if (page < cdb->freestart ||
+			   page >= cdb->freestart + cdb->freelen) {
+			/* Uncompressed; try to compress. */
+			try_compress = 1;
+		}
+
+		if (try_compress) {
+			/* Try to compress this page? */
+			ret = ctx->outc->compress(bin, bout + sizeof(*bhead),
+					cdb->pagesize,
+					cdb->pagesize - sizeof(*bhead));
+			if (ret > 0) {
+				bhead = (struct compdb_block_head *)bout;
+				memcpy(bhead->magic, COMPDB_BLOCK_MAGIC,
+						sizeof(bhead->magic));
+				bhead->len = htons(ret);
+				bhead->offset = htonl(page);
+				outp = bout;
+				outlen = ret + sizeof(*bhead);
+			}
+		}
+
+		/* Wait for our turn to write. */
+		pthread_mutex_lock(&ctx->lock);
+		while (ctx->next_write != page && !ctx->err)
+			pthread_cond_wait(&ctx->turn, &ctx->lock);
+		if (ctx->err) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		/*
+		 * Truncate to where the end of the compressed block
+		 * should be so that XFS won't do speculative preallocation.
+		 */
+		ret = ftruncate(ctx->fdout, (page * cdb->pagesize) + outlen);
+		if (ret) {
+			perror(ctx->outname);
+			shrink_fail(ctx, 2);
+			break;
+		}
+
+		/* Write to disk. */
+		dbg_printf("%s(%d) off=%zu len=%zu\n", __func__, __LINE__,
+				page * cdb->pagesize, outlen);
+		ret = pwrite(ctx->fdout, outp, outlen, page * cdb->pagesize);
+		if (ret < 0) {
+			perror(ctx->outname);
+			shrink_fail(ctx, 3);
+			break;
+		} else if (ret < outlen) {
+			printf("%s: Short page %zu write?\n", ctx->outname,
+					page);
+			shrink_fail(ctx, 3);
+			break;
+		}
+
+		/*
+		 * Truncate to the end of the block to avoid short reads.
+		 */
+		if (outlen != cdb->pagesize) {
+			ret = ftruncate(ctx->fdout, (page + 1) * cdb->pagesize);
+			if (ret) {
+				perror(ctx->outname);
+				shrink_fail(ctx, 2);
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->next_write++;
+		pthread_cond_broadcast(&ctx->turn);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+out:
+	free(bout);
+	free(bin);
+	return NULL;
+}
+
 int
 main(
 	int			argc,
@@ -85,19 +295,14 @@ main(
 {
 	struct sqlite3_super	super;
 	struct compdb_info	cdb;
+	struct shrink_ctx	ctx;
 	struct stat		sb;
 	char			*name;
-	void			*bin, *bout;
-	void			*outp;
-	struct compdb_block_head	*bhead;
 	struct compressor_type	*inc;
 	struct compressor_type	*outc;
 	struct compressor_type	none_type;
 	int			fdin, fdout;
-	int			try_compress;
-	size_t			outlen;
-	size_t			page;
-	size_t			nr_pages;
+	long			nr_threads;
 	ssize_t			ret;
 
 	if (argc == 2 && !strcmp(argv[1], "-l")) {
@@ -189,127 +394,47 @@ main(
 		return 2;
 	}
 
-	/* Allocate buffers */
-	bin = malloc(cdb.pagesize);
-	if (!bin) {
-		perror("malloc");
-		return 2;
-	}
-
-	bout = malloc(cdb.pagesize);
-	if (!bout) {
-		perror("malloc");
-		return 2;
-	}
-
 	/* Copy pages */
-	nr_pages = (sb.st_size + cdb.pagesize - 1) / cdb.pagesize;
-	for (page = 0; page < nr_pages; page++) {
-		/* Read buffer. */
-		dbg_printf("%s(%d) off=%zu len=%u\n", __func__, __LINE__,
-				page * cdb.pagesize, cdb.pagesize);
-		ret = pread(fdin, bin, cdb.pagesize, page * cdb.pagesize);
-		if (ret < 0) {
-			perror(argv[1]);
-			return 3;
-		} else if (ret < cdb.pagesize && page != nr_pages - 1) {
-			printf("%s: Short page %zu read?\n", argv[1], page);
-			return 3;
-		}
-
-		/* Transform buffer. */
-		outlen = cdb.pagesize;
-		outp = bin;
-		bhead = bin;
-		try_compress = 0;
-		if (page == 0) {
-			/* Do we need to change the header? */
-			if (cdb.type == DB_REGULAR || inc != outc)
-				memcpy(outp, cdb.out_file_header,
-						sizeof(cdb.out_file_header));
-		} else if (cdb.type == DB_COMPRESSED &&
-			   !memcmp(bhead->magic, COMPDB_BLOCK_MAGIC,
-					sizeof(COMPDB_BLOCK_MAGIC)) &&
-			   ntohl(bhead->offset) == page) {
-			if (inc == outc) {
-				/* Compressed page, send it along. */
-				outlen = ntohs(bhead->len) + sizeof(*bhead);
-			} else {
-				/* Changing compression types; decompress. */
-				ret = inc->decompress(bin + sizeof(*bhead),
-						bout,
-						ntohs(bhead->len),
-						cdb.pagesize);
-				if (ret <= 0) {
-					printf("%s: Decompression failed at "
-						" page %zu\n", argv[1], page);
-					return 3;
-				}
-				dbg_printf("%s(%d) off=%zu len=%d\n", __func__,
-						__LINE__, page * cdb.pagesize,
-						ntohs(bhead->len));
-				swap(bin, bout);
-				outp = bin;
-				try_compress = 1;
-			}
-		} else if (page < cdb.freestart ||
-			   page >= cdb.freestart + cdb.freelen) {
-			/* Uncompressed; try to compress. */
-			try_compress = 1;
-		}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.cdb = &cdb;
+	ctx.inc = inc;
+	ctx.outc = outc;
+	ctx.inname = argv[1];
+	ctx.outname = argv[2];
+	ctx.fdin = fdin;
+	ctx.fdout = fdout;
+	ctx.nr_pages = (sb.st_size + cdb.pagesize - 1) / cdb.pagesize;
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.turn, NULL);
 
-		if (try_compress) {
-			/* Try to compress this page? */
-			ret = outc->compress(bin, bout + sizeof(*bhead),
-					cdb.pagesize,
-					cdb.pagesize - sizeof(*bhead));
-			if (ret > 0) {
-				bhead = bout;
-				memcpy(bhead->magic, COMPDB_BLOCK_MAGIC,
-						sizeof(bhead->magic));
-				bhead->len = htons(ret);
-				bhead->offset = htonl(page);
-				outp = bout;
-				outlen = ret + sizeof(*bhead);
-			}
-		}
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	name = getenv("SHRINKMAPPER_THREADS");
+	if (name)
+		nr_threads = strtol(name, NULL, 0);
+	if (nr_threads > 1) {
+		pthread_t	*threads;
+		long		i, started;
 
-		/*
-		 * Truncate to where the end of the compressed block
-		 * should be so that XFS won't do speculative preallocation.
-		 */
-		ret = ftruncate(fdout, (page * cdb.pagesize) + outlen);
-		if (ret) {
-			perror(argv[2]);
+		threads = calloc(nr_threads, sizeof(pthread_t));
+		if (!threads) {
+			perror("malloc");
 			return 2;
 		}
+		for (started = 0; started < nr_threads; started++)
+			if (pthread_create(&threads[started], NULL,
+					shrink_thread, &ctx))
+				break;
+		if (!started)
+			shrink_thread(&ctx);
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	} else
+		shrink_thread(&ctx);
 
-		/* Write to disk. */
-		dbg_printf("%s(%d) off=%zu len=%zu\n", __func__, __LINE__,
-				page * cdb.pagesize, outlen);
-		ret = pwrite(fdout, outp, outlen, page * cdb.pagesize);
-		if (ret < 0) {
-			perror(argv[2]);
-			return 3;
-		} else if (ret < outlen) {
-			printf("%s: Short page %zu write?\n", argv[2], page);
-			return 3;
-		}
+	if (ctx.err)
+		return ctx.err;
 
-		/*
-		 * Truncate to the end of the block to avoid short reads.
-		 */
-		if (outlen != cdb.pagesize) {
-			ret = ftruncate(fdout, (page + 1) * cdb.pagesize);
-			if (ret) {
-				perror(argv[2]);
-				return 2;
-			}
-		}
-	}
-
-	free(bout);
-	free(bin);
 	close(fdout);
 	close(fdin);
 
@@ -5,9 +5,9 @@
  */
 #undef DEBUG
 #include <libxfs.h>
-#include <repair/btree.h>
 #include <signal.h>
 #include <libgen.h>
+#include <pthread.h>
 #include "filemapper.h"
 #include "compdb.h"
 
@@ -31,17 +31,21 @@ struct xfs_extent_t
 };
 
 struct big_bmap;
+struct ino_set;
 
 struct xfsmap {
 	struct filemapper_t	base;
 
 	struct xfs_mount	*fs;
 	int			err;
-	struct big_bmap		*ino_bmap;
+	struct ino_set		*ino_seen;
 	struct big_bmap		*bbmap;
 	xfs_agnumber_t		agno;
 	struct xfs_extent_t	last_ext;
 	int			itype;
+	int			nr_threads;
+	int			rmap_scan;
+	int			dir_rescan;
 };
 #define wf_db			base.db
 #define wf_db_err		base.db_err
@@ -93,29 +97,61 @@ void xfsmapper_putbuf(struct xfs_buf *bp)
 
 /* FS-wide bitmap */
 
-#define	BBMAP_UNUSED	0
-#define BBMAP_INUSE	1
-#define BBMAP_BAD	2
-static int big_bmap_states[] = {0xDEAD, 0xBEEF, 0xBAAD};
+/*
+ * Block usage maps, stored as per-AG arrays of extent runs.  Earlier
+ * versions tracked these with xfs_repair's pointer-based btree, which
+ * costs a node allocation per range boundary and chases cold cache
+ * lines on every update.  The scan phases only ever append ranges and
+ * then query or iterate them afterwards, so an append-only run array
+ * that is sorted and coalesced on first query uses an order of
+ * magnitude less memory and keeps the hot paths in a handful of cache
+ * lines.  Each AG has its own array; the metadata thread pool hands
+ * out whole AGs, so no two threads ever touch the same array at once.
+ */
+struct bmap_run {
+	xfs_agblock_t		start;
+	xfs_agblock_t		len;
+};
+
+struct big_bmap_ag {
+	struct bmap_run		*runs;
+	size_t			nr;
+	size_t			cap;
+	int			sorted;
+};
+
 struct big_bmap {
-	struct xfs_mount	*fs;
-	struct btree_root	**bmap;
-	xfs_agblock_t		*bmap_sizes;
+	struct big_bmap_ag	*ag;
 	xfs_agnumber_t		sz;
-	int			multiplier;
+	int			err;
 };
 
 static int big_block_bmap_init(struct xfs_mount *fs, struct big_bmap **bbmap);
-static int big_inode_bmap_init(struct xfs_mount *fs, struct big_bmap **bbmap);
 static void big_bmap_destroy(struct big_bmap *bbmap);
 static void big_bmap_set(struct big_bmap *bbmap, xfs_agnumber_t agno,
-			 xfs_agblock_t offset, xfs_extlen_t blen, int state);
-static int big_bmap_test(struct big_bmap *bbmap, xfs_agnumber_t agno,
-			 xfs_agblock_t offset);
+			 xfs_agblock_t offset, xfs_extlen_t blen);
 #ifdef DEBUG
 static void big_bmap_dump(struct big_bmap *bbmap, xfs_agnumber_t agno);
 #endif
 
+/*
+ * Set of inode numbers that have already been scanned, so that hard
+ * links and the unlinked chains don't map the same inode twice.  The
+ * set is only ever probed for single inodes and never iterated, so it
+ * gets an open-addressed hash table instead of run arrays; inode
+ * numbers are too sparse in a big filesystem for a flat bitmap.
+ */
+struct ino_set {
+	uint64_t		*slots;	/* ino + 1; 0 means empty */
+	uint64_t		nr;
+	uint64_t		cap;	/* always a power of two */
+	int			err;
+};
+
+static int ino_set_init(struct ino_set **set);
+static void ino_set_destroy(struct ino_set *set);
+static int ino_set_add(struct ino_set *set, xfs_ino_t ino);
+
 /* AG data */
 
 struct xfs_ag {
@@ -652,7 +688,7 @@ insert_meta_extent(
 
 	agbno = xfs_daddr_to_agbno(wf->fs, daddr);
 	blen = XFS_B_TO_FSB(wf->fs, xext->len);
-	big_bmap_set(wf->bbmap, wf->agno, agbno, blen, 1);
+	big_bmap_set(wf->bbmap, wf->agno, agbno, blen);
 	return 0;
 }
 
@@ -818,14 +854,12 @@ walk_file_mappings(
 	int			type)
 {
 	unsigned long long	ioff;
-	xfs_agnumber_t		agno;
-	xfs_agino_t		agino;
 
-	agno = XFS_INO_TO_AGNO(ip->i_mount, ip->i_ino);
-	agino = XFS_INO_TO_AGINO(ip->i_mount, ip->i_ino);
-	if (big_bmap_test(wf->ino_bmap, agno, agino))
+	if (ino_set_add(wf->ino_seen, ip->i_ino)) {
+		if (wf->ino_seen->err && !wf->err)
+			wf->err = wf->ino_seen->err;
 		return;
-	big_bmap_set(wf->ino_bmap, agno, agino, 1, 1);
+	}
 
 	ioff = inode_poff(ip);
 	insert_extent(&wf->base, ip->i_ino, ioff, NULL,
@@ -834,6 +868,18 @@ walk_file_mappings(
 		return;
 
 	/* Walk the inode forks */
+	if (wf->rmap_scan) {
+		/*
+		 * The rmapbt scan provides every mapped extent; only
+		 * inline forks live outside of it.
+		 */
+		if (XFS_IFORK_FORMAT(ip, XFS_DATA_FORK) == XFS_DINODE_FMT_LOCAL)
+			WALK_FORK(wf, ip, type, XFS_DATA_FORK);
+		if (ip->i_d.di_forkoff &&
+		    XFS_IFORK_FORMAT(ip, XFS_ATTR_FORK) == XFS_DINODE_FMT_LOCAL)
+			WALK_FORK(wf, ip, type, XFS_ATTR_FORK);
+		return;
+	}
 	WALK_FORK(wf, ip, type, XFS_DATA_FORK);
 	WALK_FORK(wf, ip, type, XFS_ATTR_FORK);
 }
@@ -853,6 +899,7 @@ walk_fs_helper(
 	char			name[XFS_NAME_LEN + 1];
 	const char		*old_dirpath;
 	int			type, sz;
+	int			rescan, old_rescan;
 	struct xfsmap		*wf = priv_data;
 	struct xfs_inode	*inode = NULL;
 	time_t			atime, crtime, ctime, mtime;
@@ -907,26 +954,37 @@ walk_fs_helper(
 		snprintf(path, PATH_MAX, "%s/%s", wf->wf_dirpath, name);
 	else
 		path[0] = 0;
-	insert_inode(&wf->base, ino, type_codes[type], path, &atime,
-			pcrtime, &ctime, &mtime, &size);
-	if (wf->wf_db_err)
-		goto out;
-	if (dir)
+	/* Unchanged since the last scan?  Its rows are still good. */
+	rescan = inode_needs_rescan(&wf->base, ino, ctime);
+	if (rescan) {
+		insert_inode(&wf->base, ino, type_codes[type], path, &atime,
+				pcrtime, &ctime, &mtime, &size);
+		if (wf->wf_db_err)
+			goto out;
+	}
+	if (dir && wf->dir_rescan)
 		insert_dentry(&wf->base, dir, name, ino);
 	if (wf->wf_db_err)
 		goto out;
 
-	walk_file_mappings(wf, inode, type);
-	if (wf->err || wf->wf_db_err)
-		goto out;
+	if (rescan) {
+		walk_file_mappings(wf, inode, type);
+		if (wf->err || wf->wf_db_err)
+			goto out;
+	}
 
+	/* Even an unchanged directory can hide changed descendants. */
 	if (type == XFS_DIR3_FT_DIR) {
 		old_dirpath = wf->wf_dirpath;
+		old_rescan = wf->dir_rescan;
 		wf->wf_dirpath = path;
+		wf->dir_rescan = rescan;
 		err = iterate_directory(inode, walk_fs_helper, wf);
 		if (!wf->err)
 			wf->err = err;
 		wf->wf_dirpath = old_dirpath;
+		wf->dir_rescan = old_rescan;
+		checkpoint_db(&wf->base, -1);
 	}
 	if (wf->err || wf->wf_db_err)
 		goto out;
@@ -942,183 +1000,73 @@ walk_fs(
 	struct xfsmap		*wf)
 {
 	wf->wf_dirpath = "";
+	wf->dir_rescan = 1;
 	walk_fs_helper(0, "", 0, wf->fs->m_sb.sb_rootino, XFS_DIR3_FT_DIR, wf);
 }
 
 /* Handle in-core bitmaps */
-static void
-update_bmap(
-	struct btree_root	*bmap,
-	xfs_agblock_t		offset,
-	xfs_extlen_t		blen,
-	void			*new_state)
+static int
+bmap_run_cmp(
+	const void		*a,
+	const void		*b)
 {
-	int			*cur_state;
-	int			*next_state;
-	int			*prev_state;
-	unsigned long		end = offset + blen;
-	unsigned long		cur_key;
-	unsigned long		next_key;
-
-	cur_state = btree_find(bmap, offset, &cur_key);
-	if (!cur_state)
-		return;
-
-	if (offset == cur_key) {
-		/* if the start is the same as the "item" extent */
-		if (cur_state == new_state)
-			return;
-
-		/*
-		 * Note: this may be NULL if we are updating the map for
-		 * the superblock.
-		 */
-		prev_state = btree_peek_prev(bmap, NULL);
-
-		next_state = btree_peek_next(bmap, &next_key);
-		if (next_key > end) {
-			/* different end */
-			if (new_state == prev_state) {
-				/* #1: prev has same state, move offset up */
-				btree_update_key(bmap, offset, end);
-				return;
-			}
-
-			/* #4: insert new extent after, update current value */
-			btree_update_value(bmap, offset, new_state);
-			btree_insert(bmap, end, cur_state);
-			return;
-		}
-
-		/* same end (and same start) */
-		if (new_state == next_state) {
-			/* next has same state */
-			if (new_state == prev_state) {
-				/* #3: merge prev & next */
-				btree_delete(bmap, offset);
-				btree_delete(bmap, end);
-				return;
-			}
-
-			/* #8: merge next */
-			btree_update_value(bmap, offset, new_state);
-			btree_delete(bmap, end);
-			return;
-		}
-
-		/* same start, same end, next has different state */
-		if (new_state == prev_state) {
-			/* #5: prev has same state */
-			btree_delete(bmap, offset);
-			return;
-		}
+	const struct bmap_run	*ra = a;
+	const struct bmap_run	*rb = b;
 
-		/* #6: update value only */
-		btree_update_value(bmap, offset, new_state);
-		return;
-	}
-
-	/* different start, offset is in the middle of "cur" */
-	prev_state = btree_peek_prev(bmap, NULL);
-	ASSERT(prev_state != NULL);
-	if (prev_state == new_state)
-		return;
-
-	if (end == cur_key) {
-		/* end is at the same point as the current extent */
-		if (new_state == cur_state) {
-			/* #7: move next extent down */
-			btree_update_key(bmap, end, offset);
-			return;
-		}
-
-		/* #9: different start, same end, add new extent */
-		btree_insert(bmap, offset, new_state);
-		return;
-	}
-
-	/* #2: insert an extent into the middle of another extent */
-	btree_insert(bmap, offset, new_state);
-	btree_insert(bmap, end, prev_state);
+	if (ra->start < rb->start)
+		return -1;
+	if (ra->start > rb->start)
+		return 1;
+	return 0;
 }
 
-/* Given an AG and an AG block number, find the extent associated with them */
-int
-get_bmap_ext(
-	struct btree_root	*bmap,
-	xfs_agblock_t		agbno,
-	xfs_agblock_t		maxbno,
-	xfs_extlen_t		*blen)
+/* Sort an AG's run array and merge overlapping and adjacent runs. */
+static void
+big_bmap_ag_sort(
+	struct big_bmap_ag	*agmap)
 {
-	int			*statep;
-	unsigned long		key;
+	struct bmap_run		*out;
+	struct bmap_run		*r;
+	size_t			i;
 
-	statep = btree_find(bmap, agbno, &key);
-	if (!statep)
-		return -1;
+	if (agmap->sorted)
+		return;
 
-	if (key == agbno) {
-		if (blen) {
-			if (!btree_peek_next(bmap, &key))
-				return -1;
-			*blen = MIN(maxbno, key) - agbno;
+	qsort(agmap->runs, agmap->nr, sizeof(struct bmap_run), bmap_run_cmp);
+	out = agmap->runs;
+	for (i = 1; i < agmap->nr; i++) {
+		r = &agmap->runs[i];
+		if (r->start <= out->start + out->len) {
+			if (r->start + r->len > out->start + out->len)
+				out->len = r->start + r->len - out->start;
+			continue;
 		}
-		return *statep;
+		*(++out) = *r;
 	}
-
-	statep = btree_peek_prev(bmap, NULL);
-	if (!statep)
-		return -1;
-	if (blen)
-		*blen = MIN(maxbno, key) - agbno;
-
-	return *statep;
+	if (agmap->nr)
+		agmap->nr = out - agmap->runs + 1;
+	agmap->sorted = 1;
 }
 
 /* Create a big bitmap to cover the whole FS */
 static int
 big_bmap_init(
 	struct xfs_mount	*fs,
-	struct big_bmap		**bbmap,
-	int			multiplier)
+	struct big_bmap		**bbmap)
 {
 	struct big_bmap		*u;
-	xfs_agnumber_t		agno;
-	xfs_agblock_t		ag_size;
 
 	u = calloc(1, sizeof(struct big_bmap));
 	if (!u)
 		return ENOMEM;
 
-	u->fs = fs;
 	u->sz = fs->m_sb.sb_agcount;
-	u->multiplier = multiplier;
-	u->bmap = calloc(u->sz, sizeof(struct btree_root *));
-	if (!u->bmap) {
-		free(u);
-		return ENOMEM;
-	}
-	u->bmap_sizes = calloc(u->sz, sizeof(xfs_agblock_t));
-	if (!u->bmap_sizes) {
-		free(u->bmap);
+	u->ag = calloc(u->sz, sizeof(struct big_bmap_ag));
+	if (!u->ag) {
 		free(u);
 		return ENOMEM;
 	}
 
-	ag_size = fs->m_sb.sb_agblocks;
-	for (agno = 0; agno < u->sz; agno++) {
-		if (agno == u->sz - 1)
-			ag_size = (xfs_extlen_t)(fs->m_sb.sb_dblocks -
-				   (xfs_rfsblock_t)fs->m_sb.sb_agblocks * agno);
-		u->bmap_sizes[agno] = ag_size * multiplier;
-		btree_init(&u->bmap[agno]);
-		btree_clear(u->bmap[agno]);
-		btree_insert(u->bmap[agno], 0,
-				&big_bmap_states[BBMAP_UNUSED]);
-		btree_insert(u->bmap[agno], ag_size * multiplier,
-				&big_bmap_states[BBMAP_BAD]);
-	}
-
 	*bbmap = u;
 	return 0;
 }
@@ -1128,18 +1076,7 @@ big_block_bmap_init(
 	struct xfs_mount	*fs,
 	struct big_bmap		**bbmap)
 {
-	return big_bmap_init(fs, bbmap, 1);
-}
-
-static int
-big_inode_bmap_init(
-	struct xfs_mount	*fs,
-	struct big_bmap		**bbmap)
-{
-	int			m;
-
-	m = fs->m_sb.sb_blocksize / fs->m_sb.sb_inodesize;
-	return big_bmap_init(fs, bbmap, m);
+	return big_bmap_init(fs, bbmap);
 }
 
 /* Free a big block bitmap */
@@ -1150,47 +1087,51 @@ big_bmap_destroy(
 	xfs_agnumber_t		agno;
 
 	for (agno = 0; agno < bbmap->sz; agno++)
-		btree_destroy(bbmap->bmap[agno]);
-	free(bbmap->bmap);
+		free(bbmap->ag[agno].runs);
+	free(bbmap->ag);
 	free(bbmap);
 }
 
-/* Set the state of a range of big bitmap blocks */
+/* Mark a range of big bitmap blocks in use */
 static void
 big_bmap_set(
 	struct big_bmap		*bbmap,
 	xfs_agnumber_t		agno,
 	xfs_agblock_t		offset,
-	xfs_extlen_t		blen,
-	int			state)
+	xfs_extlen_t		blen)
 {
+	struct big_bmap_ag	*agmap = &bbmap->ag[agno];
+	struct bmap_run		*r;
+	size_t			cap;
+
 	assert(blen);
-	dbg_printf("%s: agno=%d offset=%d blen=%d state=%d\n", __func__,
-			agno, offset, blen, state);
-	update_bmap(bbmap->bmap[agno], offset, blen, &big_bmap_states[state]);
-}
+	dbg_printf("%s: agno=%d offset=%d blen=%d\n", __func__,
+			agno, offset, blen);
+
+	/* Walkers mostly append in order; extend the last run in place. */
+	if (agmap->nr) {
+		r = &agmap->runs[agmap->nr - 1];
+		if (offset >= r->start && offset <= r->start + r->len) {
+			if (offset + blen > r->start + r->len)
+				r->len = offset + blen - r->start;
+			return;
+		}
+	}
 
-/* Test the status of a block in a big bitmap */
-static int
-big_bmap_test(
-	struct big_bmap		*bbmap,
-	xfs_agnumber_t		agno,
-	xfs_agblock_t		offset)
-{
-	unsigned long		key = offset;
-	struct btree_root	*bmap;
-	int			*val;
-
-	bmap = bbmap->bmap[agno];
-
-	/* btree_find retrieves either the the exact key or the next highest */
-	val = btree_find(bmap, offset, &key);
-	assert(val != NULL);
-	if (offset == key)
-		return val == &big_bmap_states[BBMAP_INUSE];
-	val = btree_peek_prev(bmap, NULL);
-	assert(val != NULL);
-	return val == &big_bmap_states[BBMAP_INUSE];
+	if (agmap->nr == agmap->cap) {
+		cap = agmap->cap ? agmap->cap * 2 : 16;
+		r = realloc(agmap->runs, cap * sizeof(struct bmap_run));
+		if (!r) {
+			bbmap->err = ENOMEM;
+			return;
+		}
+		agmap->runs = r;
+		agmap->cap = cap;
+	}
+	agmap->runs[agmap->nr].start = offset;
+	agmap->runs[agmap->nr].len = blen;
+	agmap->nr++;
+	agmap->sorted = 0;
 }
 
 #ifdef DEBUG
@@ -1200,29 +1141,120 @@ big_bmap_dump(
 	struct big_bmap		*bbmap,
 	xfs_agnumber_t		agno)
 {
-	unsigned long		key;
-	xfs_agblock_t		ag_size;
-	xfs_extlen_t		len;
-	int			*val;
-	struct btree_root	*bmap;
-
-	ag_size = bbmap->fs->m_sb.sb_agblocks;
-	if (agno == bbmap->sz - 1)
-		ag_size = (xfs_extlen_t)(bbmap->fs->m_sb.sb_dblocks -
-			   (xfs_rfsblock_t)bbmap->fs->m_sb.sb_agblocks * agno);
-	ag_size *= bbmap->multiplier;
-	key = 0;
-	bmap = bbmap->bmap[agno];
-	val = btree_find(bmap, key, &key);
-	while (val != NULL && key != ag_size * bbmap->multiplier) {
-		get_bmap_ext(bmap, key, ag_size, &len);
-		printf("%s: agno=%d key=%lu len=%lu val=%x\n",
-			   __func__, agno, key, (unsigned long)len, *val);
-		val = btree_lookup_next(bmap, &key);
-	}
+	struct big_bmap_ag	*agmap = &bbmap->ag[agno];
+	size_t			i;
+
+	big_bmap_ag_sort(agmap);
+	for (i = 0; i < agmap->nr; i++)
+		printf("%s: agno=%d start=%lu len=%lu\n", __func__, agno,
+			   (unsigned long)agmap->runs[i].start,
+			   (unsigned long)agmap->runs[i].len);
 }
 #endif
 
+/* Create a set to record scanned inodes */
+static int
+ino_set_init(
+	struct ino_set		**set)
+{
+	struct ino_set		*u;
+
+	u = calloc(1, sizeof(struct ino_set));
+	if (!u)
+		return ENOMEM;
+
+	u->cap = 1ULL << 16;
+	u->slots = calloc(u->cap, sizeof(uint64_t));
+	if (!u->slots) {
+		free(u);
+		return ENOMEM;
+	}
+
+	*set = u;
+	return 0;
+}
+
+static void
+ino_set_destroy(
+	struct ino_set		*set)
+{
+	free(set->slots);
+	free(set);
+}
+
+static uint64_t
+ino_set_hash(
+	struct ino_set		*set,
+	uint64_t		key)
+{
+	return (key * 0x9E3779B97F4A7C15ULL) & (set->cap - 1);
+}
+
+/* Double the table and rehash everything into it. */
+static void
+ino_set_grow(
+	struct ino_set		*set)
+{
+	struct ino_set		big;
+	uint64_t		slot;
+	uint64_t		i;
+
+	big.nr = set->nr;
+	big.cap = set->cap * 2;
+	big.err = 0;
+	big.slots = calloc(big.cap, sizeof(uint64_t));
+	if (!big.slots) {
+		set->err = ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < set->cap; i++) {
+		if (!set->slots[i])
+			continue;
+		slot = ino_set_hash(&big, set->slots[i] - 1);
+		while (big.slots[slot])
+			slot = (slot + 1) & (big.cap - 1);
+		big.slots[slot] = set->slots[i];
+	}
+
+	free(set->slots);
+	set->slots = big.slots;
+	set->cap = big.cap;
+}
+
+/*
+ * Record an inode in the set.  Returns nonzero if it was already there
+ * (or if we've run out of memory, in which case set->err is latched).
+ */
+static int
+ino_set_add(
+	struct ino_set		*set,
+	xfs_ino_t		ino)
+{
+	uint64_t		key = (uint64_t)ino + 1;
+	uint64_t		slot;
+
+	if (set->err)
+		return 1;
+
+	slot = ino_set_hash(set, ino);
+	while (set->slots[slot]) {
+		if (set->slots[slot] == key)
+			return 1;
+		slot = (slot + 1) & (set->cap - 1);
+	}
+	set->slots[slot] = key;
+	set->nr++;
+
+	/* Keep the load factor under 3/4. */
+	if (set->nr + (set->nr / 2) >= set->cap) {
+		ino_set_grow(set);
+		if (set->err)
+			return 1;
+	}
+	return 0;
+}
+
 /* Walk an AG's bitmap, attaching extents for the in use blocks to the inode */
 static void
 __walk_ag_bitmap(
@@ -1233,37 +1265,28 @@ __walk_ag_bitmap(
 	int			dtype)
 {
 	struct xfs_mount	*fs = wf->fs;
-	unsigned long		key;
-	xfs_agblock_t		ag_size;
+	struct big_bmap_ag	*agmap = &bbmap->ag[agno];
+	struct bmap_run		*r;
 	xfs_fsblock_t		s;
-	xfs_extlen_t		len;
-	int			*val;
-	struct btree_root	*bmap;
-
-	ag_size = fs->m_sb.sb_agblocks;
-	if (agno == bbmap->sz - 1)
-		ag_size = (xfs_extlen_t)(fs->m_sb.sb_dblocks -
-			   (xfs_rfsblock_t)fs->m_sb.sb_agblocks * agno);
-	ag_size *= bbmap->multiplier;
-	key = 0;
-	bmap = bbmap->bmap[agno];
-	val = btree_find(bmap, key, &key);
-	while (val != NULL && key != ag_size) {
-		get_bmap_ext(bmap, key, ag_size, &len);
-		if (val != &big_bmap_states[BBMAP_INUSE]) {
-			val = btree_lookup_next(bmap, &key);
-			continue;
-		}
+	size_t			i;
+
+	if (bbmap->err && !wf->err)
+		wf->err = bbmap->err;
+	if (wf->err)
+		return;
 
-		dbg_printf("%s: ino=%ld agno=%d key=%lu len=%lu val=%x\n",
-			   __func__, ino, agno, key, (unsigned long)len, *val);
-		s = XFS_AGB_TO_FSB(fs, agno, key);
+	big_bmap_ag_sort(agmap);
+	for (i = 0; i < agmap->nr; i++) {
+		r = &agmap->runs[i];
+		dbg_printf("%s: ino=%ld agno=%d start=%lu len=%lu\n",
+			   __func__, ino, agno, (unsigned long)r->start,
+			   (unsigned long)r->len);
+		s = XFS_AGB_TO_FSB(fs, agno, r->start);
 		insert_extent(&wf->base, ino, XFS_FSBLOCK_TO_BYTES(fs, s), NULL,
-				XFS_FSB_TO_B(fs, len), EXTENT_SHARED,
+				XFS_FSB_TO_B(fs, r->len), EXTENT_SHARED,
 				extent_codes[dtype]);
 		if (wf->err || wf->wf_db_err)
 			break;
-		val = btree_lookup_next(bmap, &key);
 	}
 }
 
@@ -1513,6 +1536,91 @@ walk_ag_rmapbt_nodes(
 	return walk_ag_btree_nodes(fs, ino, agno, rootbno, XFS_RMAP_BTREE_REF,
 			&xfs_rmapbt_metadata_ops, fn, priv_data, NULL);
 }
+
+/* Turn a reverse-mapping record into a file extent. */
+static int
+emit_rmap_extent(
+	struct xfs_btree_cur	*cur,
+	union xfs_btree_rec	*rec,
+	void			*priv)
+{
+	struct xfsmap		*wf = priv;
+	struct xfs_rmap_irec	irec;
+	xfs_fsblock_t		fsbno;
+	uint64_t		p_off, len, loff;
+	int			flags;
+	int			error;
+
+	error = xfs_rmap_btrec_to_irec(rec, &irec);
+	if (error)
+		return error;
+
+	/* AG metadata owners are already covered by the metafiles. */
+	if (XFS_RMAP_NON_INODE_OWNER(irec.rm_owner))
+		return 0;
+
+	fsbno = XFS_AGB_TO_FSB(cur->bc_mp, cur->bc_private.a.agno,
+			irec.rm_startblock);
+	p_off = XFS_FSBLOCK_TO_BYTES(cur->bc_mp, fsbno);
+	len = XFS_FSB_TO_B(cur->bc_mp, irec.rm_blockcount);
+
+	if (irec.rm_flags & XFS_RMAP_BMBT_BLOCK) {
+		insert_extent(&wf->base, irec.rm_owner, p_off, NULL, len,
+				0, EXT_TYPE_EXTENT);
+	} else if (irec.rm_flags & XFS_RMAP_ATTR_FORK) {
+		insert_extent(&wf->base, irec.rm_owner, p_off, NULL, len,
+				0, EXT_TYPE_XATTR);
+	} else {
+		flags = 0;
+		if (irec.rm_flags & XFS_RMAP_UNWRITTEN)
+			flags |= EXTENT_UNWRITTEN;
+		loff = XFS_FSB_TO_B(cur->bc_mp, irec.rm_offset);
+		/*
+		 * The rmapbt doesn't know the owner's inode type, so
+		 * every data fork mapping goes in as a file extent;
+		 * directories and symlinks are retyped from inode_t
+		 * once the scan finishes.
+		 */
+		insert_extent(&wf->base, irec.rm_owner, p_off, &loff, len,
+				flags, EXT_TYPE_FILE);
+	}
+	return wf->wf_db_err ? -1 : 0;
+}
+
+/*
+ * Build extent_t straight out of this AG's rmapbt.  One sequential
+ * btree scan replaces reading every owner's bmap fork.
+ */
+static int
+walk_ag_rmapbt_records(
+	struct xfsmap		*wf,
+	xfs_agnumber_t		agno)
+{
+	struct xfs_btree_cur	*cur;
+	struct xfs_buf		*agbp;
+	union xfs_btree_irec	low;
+	union xfs_btree_irec	high;
+	int			error;
+
+	error = libxfs_alloc_read_agf(wf->fs, NULL, agno, 0, &agbp);
+	if (error)
+		return error;
+	cur = libxfs_rmapbt_init_cursor(wf->fs, NULL, agbp, agno);
+
+	memset(&low, 0, sizeof(low));
+	memset(&high, 0, sizeof(high));
+	high.r.rm_startblock = -1U;
+	high.r.rm_owner = -1ULL;
+	high.r.rm_offset = -1ULL;
+	high.r.rm_flags = -1U;
+	error = xfs_btree_query_range(cur, &low, &high, emit_rmap_extent,
+			wf);
+
+	libxfs_btree_del_cursor(cur, XFS_BTREE_ERROR);
+	libxfs_trans_brelse(NULL, agbp);
+
+	return error;
+}
 #endif
 
 #ifndef XFS_REFC_CRC_MAGIC
@@ -1767,6 +1875,7 @@ walk_unlinked_inode_chain(
 	char			name[PATH_MAX];
 
 	wf->wf_dirpath = "/" STR_METADATA_DIR "/" STR_UNLINKED_DIR;
+	wf->dir_rescan = 1;
 	while (agino != NULLAGINO && agino != 0) {
 		ino = XFS_AGINO_TO_INO(wf->fs, agno, agino);
 		snprintf(name, PATH_MAX, "%lu", ino);
@@ -1796,31 +1905,366 @@ walk_unlinked_inode_chain(
 #define INJECT_GROUP(ino, path, type) \
 	INJECT_METADATA(INO_GROUPS_DIR, "/" STR_METADATA_DIR "/" STR_GROUPS_DIR, (ino), (path), (type))
 
-/* Invent a FS tree for metadata. */
+/* Bitmaps for the aggregate metadata files */
+struct meta_bmaps {
+	struct big_bmap		*ag;
+	struct big_bmap		*agfl;
+	struct big_bmap		*bnobt;
+	struct big_bmap		*freesp;
+	struct big_bmap		*cntbt;
+	struct big_bmap		*inobt;
+	struct big_bmap		*finobt;
+	struct big_bmap		*itable;
+	struct big_bmap		*rmapbt;
+	struct big_bmap		*refcountbt;
+	struct big_bmap		*cow;
+};
+
+/*
+ * The inode cache underneath libxfs_iget was never built for concurrent
+ * lookups, so the unlinked inode chains are walked one at a time.
+ */
+static pthread_mutex_t	xfs_iget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* How many fake inodes does each AG's metadata group consume? */
+static int64_t
+metadata_inos_per_ag(
+	struct xfs_mount	*fs)
+{
+	/* group dir, sb, agfl, bnobt, freesp, cntbt, inobt, itable */
+	int64_t			nr = 8;
+
+	if (xfs_sb_version_hasfinobt(&fs->m_sb))
+		nr++;
+#ifdef XFS_RMAP_CRC_MAGIC
+	if (xfs_sb_version_hasrmapbt(&fs->m_sb))
+		nr++;
+#endif
+#ifdef XFS_REFC_CRC_MAGIC
+	if (xfs_sb_version_hasreflink(&fs->m_sb))
+		nr += 2;
+#endif
+	return nr;
+}
+
+/* Walk one AG's metadata, attaching it to that AG's group directory. */
 static void
-walk_metadata(
-	struct xfsmap		*wf)
+walk_ag_metadata(
+	struct xfsmap		*wf,
+	struct xfs_ag		*ags,
+	xfs_agnumber_t		agno,
+	int64_t			group_ino,
+	int			w,
+	struct meta_bmaps	*bmaps)
 {
 	struct xfs_mount	*fs = wf->fs;
-	struct big_bmap		*bmap_ag, *bmap_agfl, *bmap_freesp, *bmap_bnobt,
-				*bmap_cntbt, *bmap_inobt, *bmap_finobt,
-				*bmap_itable, *bmap_rmapbt, *bmap_refcountbt,
-				*bmap_cow;
-	struct xfs_ag		*ags = NULL;
 	struct xfs_agf		*agf;
 	struct xfs_agi		*agi;
 	__be32			*freelist;
 	char			path[PATH_MAX + 1];
-	uint64_t		loff;
-	int64_t			ino, group_ino;
+	int64_t			ino;
 	unsigned long		i, len;
 	xfs_fsblock_t		s;
-	xfs_agnumber_t		agno;
 	xfs_agblock_t		left_inobt_leaf_agbno = 0;
 	xfs_agblock_t		left_bnobt_leaf_agbno = 0;
+	int			err;
+
+	agf = XFS_BUF_TO_AGF(ags[agno].agf);
+	agi = XFS_BUF_TO_AGI(ags[agno].agi);
+	wf->agno = agno;
+
+	/* set up per-group virtual files */
+	snprintf(path, PATH_MAX, "%0*d", w, agno);
+	INJECT_GROUP(group_ino, path, XFS_DIR3_FT_DIR);
+	ino = group_ino - 1;
+
+	snprintf(path, PATH_MAX, "/%s/%s/%0*d", STR_METADATA_DIR,
+			STR_GROUPS_DIR, w, agno);
+
+	/* Record the superblock+agf+agi+agfl blocks */
+	s = XFS_AGB_TO_FSB(fs, agno, 0);
+	len = 4 * fs->m_sb.sb_sectsize / fs->m_sb.sb_blocksize;
+	if (len < 1)
+		len = 1;
+	big_bmap_set(bmaps->ag, agno, 0, len);
+	INJECT_METADATA(group_ino, path, ino, STR_SB_FILE,
+			XFS_DIR3_XT_METADATA);
+	insert_extent(&wf->base, ino, XFS_FSBLOCK_TO_BYTES(fs, s),
+			NULL, 4 * fs->m_sb.sb_sectsize, EXTENT_SHARED,
+			extent_codes[XFS_DIR3_XT_METADATA]);
+	if (wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* AG free list */
+	freelist = XFS_BUF_TO_AGFL_BNO(fs, ags[agno].agfl);
+	for (i = be32_to_cpu(agf->agf_flfirst);
+	     i <= be32_to_cpu(agf->agf_fllast); i++)
+		big_bmap_set(bmaps->agfl, agno,
+				be32_to_cpu(freelist[i]), 1);
+
+	INJECT_METADATA(group_ino, path, ino, STR_FL_FILE,
+			XFS_DIR3_XT_METADATA);
+	walk_ag_bitmap(wf, ino, bmaps->agfl, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* bnobt */
+	wf->bbmap = bmaps->bnobt;
+	INJECT_METADATA(group_ino, path, ino, STR_BNOBT_FILE,
+			XFS_DIR3_XT_METADATA);
+	err = walk_ag_allocbt_nodes(fs, ino, agno,
+			be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNO]),
+			insert_meta_extent, wf, &left_bnobt_leaf_agbno);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* free space */
+	wf->bbmap = bmaps->freesp;
+	INJECT_METADATA(group_ino, path, ino, STR_FREESP_FILE,
+			XFS_DIR3_XT_FREESP);
+	err = walk_ag_bnobt_records(fs, ino, agno,
+			left_bnobt_leaf_agbno, insert_meta_extent, wf);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_freesp_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* cntbt */
+	wf->bbmap = bmaps->cntbt;
+	INJECT_METADATA(group_ino, path, ino, STR_CNTBT_FILE,
+			XFS_DIR3_XT_METADATA);
+	err = walk_ag_allocbt_nodes(fs, ino, agno,
+			be32_to_cpu(agf->agf_roots[XFS_BTNUM_CNT]),
+			insert_meta_extent, wf, NULL);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* inobt */
+	wf->bbmap = bmaps->inobt;
+	INJECT_METADATA(group_ino, path, ino, STR_INOBT_FILE,
+			XFS_DIR3_XT_METADATA);
+	err = walk_ag_inobt_nodes(fs, ino, agno,
+			be32_to_cpu(agi->agi_root),
+			insert_meta_extent, wf, &left_inobt_leaf_agbno);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* finobt */
+	if (!xfs_sb_version_hasfinobt(&fs->m_sb))
+		goto no_finobt;
+	wf->bbmap = bmaps->finobt;
+	INJECT_METADATA(group_ino, path, ino, STR_FINOBT_FILE,
+			XFS_DIR3_XT_METADATA);
+	err = walk_ag_inobt_nodes(fs, ino, agno,
+			be32_to_cpu(agi->agi_free_root),
+			insert_meta_extent, wf, NULL);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+no_finobt:
+
+	/* inode blocks */
+	wf->bbmap = bmaps->itable;
+	INJECT_METADATA(group_ino, path, ino, STR_ITABLE_FILE,
+			XFS_DIR3_XT_METADATA);
+	err = walk_ag_inode_blocks(fs, ino, agno,
+			left_inobt_leaf_agbno, insert_meta_extent, wf);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* rmapbt */
+	if (!xfs_sb_version_hasrmapbt(&fs->m_sb))
+		goto no_rmapbt;
+#ifdef XFS_RMAP_CRC_MAGIC
+	wf->bbmap = bmaps->rmapbt;
+	INJECT_METADATA(group_ino, path, ino, STR_RMAPBT_FILE,
+			XFS_DIR3_XT_METADATA);
+	err = walk_ag_rmapbt_nodes(fs, ino, agno,
+			be32_to_cpu(agf->agf_roots[XFS_BTNUM_RMAP]),
+			insert_meta_extent, wf);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* In fast-scan mode, file extents come out of the rmapbt too. */
+	if (wf->rmap_scan) {
+		err = walk_ag_rmapbt_records(wf, agno);
+		if (!wf->err)
+			wf->err = err;
+		if (wf->err || wf->wf_db_err)
+			goto out;
+	}
+#endif
+no_rmapbt:
+
+	/* refcountbt */
+	if (!xfs_sb_version_hasreflink(&fs->m_sb))
+		goto no_refcountbt;
+#ifdef XFS_REFC_CRC_MAGIC
+	wf->bbmap = bmaps->refcountbt;
+	INJECT_METADATA(group_ino, path, ino, STR_REFCOUNTBT_FILE,
+			XFS_DIR3_XT_METADATA);
+	err = walk_ag_refcountbt_nodes(fs, ino, agno,
+			be32_to_cpu(agf->agf_refcount_root),
+			insert_meta_extent, wf);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+
+	/* CoW staging */
+	wf->bbmap = bmaps->cow;
+	INJECT_METADATA(group_ino, path, ino, STR_COW_FILE,
+			XFS_DIR3_XT_METADATA);
+	err = walk_ag_cow_extents(wf, ino, agno, insert_meta_extent);
+	if (!wf->err)
+		wf->err = err;
+	if (wf->err)
+		goto out;
+	walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+	if (wf->err || wf->wf_db_err)
+		goto out;
+	ino--;
+#endif
+no_refcountbt:
+
+	/* Unlinked inodes. */
+	pthread_mutex_lock(&xfs_iget_lock);
+	for (i = 0; i < XFS_AGI_UNLINKED_BUCKETS; i++) {
+		walk_unlinked_inode_chain(wf, agno, \
+				be32_to_cpu(agi->agi_unlinked[i]));
+		if (wf->err || wf->wf_db_err)
+			break;
+	}
+	pthread_mutex_unlock(&xfs_iget_lock);
+out:
+	return;
+}
+
+/* AG scanning thread pool */
+struct ag_pool {
+	pthread_mutex_t		lock;
+	struct xfsmap		*wf;
+	struct xfs_ag		*ags;
+	struct meta_bmaps	*bmaps;
+	int64_t			inos_per_ag;
 	int			w;
-	bool			added_unlinked = false;
+	xfs_agnumber_t		next_agno;
 	int			err;
+	int			db_err;
+};
+
+/*
+ * Scan AGs until they run out.  Each thread takes the next unscanned AG
+ * rather than working from a static partition, so skewed AG sizes don't
+ * leave threads idle.  Every thread walks with its own struct xfsmap so
+ * that the per-walk scratch state doesn't need locking; the database
+ * records all funnel through the shared writer thread.
+ */
+static void *
+walk_ag_metadata_thread(
+	void			*arg)
+{
+	struct ag_pool		*pool = arg;
+	struct xfsmap		twf;
+	xfs_agnumber_t		agno;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->err || pool->db_err ||
+		    pool->next_agno >= pool->wf->fs->m_sb.sb_agcount) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		agno = pool->next_agno++;
+		pthread_mutex_unlock(&pool->lock);
+
+		twf = *pool->wf;
+		twf.err = 0;
+		twf.wf_db_err = 0;
+		/*
+		 * A checkpoint commit assumes everything enqueued before it
+		 * describes whole inodes, which isn't true with several
+		 * walkers enqueueing concurrently.
+		 */
+		twf.base.ckpt_enabled = 0;
+		walk_ag_metadata(&twf, pool->ags, agno,
+				INO_GROUPS_DIR - 1 - agno * pool->inos_per_ag,
+				pool->w, pool->bmaps);
+
+		if (twf.err || twf.wf_db_err) {
+			pthread_mutex_lock(&pool->lock);
+			if (!pool->err)
+				pool->err = twf.err;
+			if (!pool->db_err)
+				pool->db_err = twf.wf_db_err;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* Invent a FS tree for metadata. */
+static void
+walk_metadata(
+	struct xfsmap		*wf)
+{
+	struct xfs_mount	*fs = wf->fs;
+	struct meta_bmaps	bmaps;
+	struct xfs_ag		*ags = NULL;
+	struct xfs_agi		*agi;
+	char			path[PATH_MAX + 1];
+	uint64_t		loff;
+	unsigned long		i;
+	xfs_agnumber_t		agno;
+	int			w;
+	int			nr_threads;
+	bool			added_unlinked = false;
 
 	/* Create hidden inodes */
 #define H(ino, name, type) {(ino), STR_##name, XFS_DIR3_##type}
@@ -1835,9 +2279,7 @@ walk_metadata(
 	};
 #undef H
 
-	bmap_ag = bmap_agfl = bmap_freesp = bmap_bnobt = bmap_cntbt =
-			bmap_inobt = bmap_finobt = bmap_itable = bmap_rmapbt =
-			bmap_refcountbt = NULL;
+	memset(&bmaps, 0, sizeof(bmaps));
 
 	wf->err = read_ags(fs, &ags);
 	if (wf->err)
@@ -1888,287 +2330,138 @@ walk_metadata(
 	}
 
 	/* Bitmaps for aggregate metafiles */
-	wf->err = big_block_bmap_init(fs, &bmap_ag);
+	wf->err = big_block_bmap_init(fs, &bmaps.ag);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_agfl);
+	wf->err = big_block_bmap_init(fs, &bmaps.agfl);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_bnobt);
+	wf->err = big_block_bmap_init(fs, &bmaps.bnobt);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_freesp);
+	wf->err = big_block_bmap_init(fs, &bmaps.freesp);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_cntbt);
+	wf->err = big_block_bmap_init(fs, &bmaps.cntbt);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_inobt);
+	wf->err = big_block_bmap_init(fs, &bmaps.inobt);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_finobt);
+	wf->err = big_block_bmap_init(fs, &bmaps.finobt);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_itable);
+	wf->err = big_block_bmap_init(fs, &bmaps.itable);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_rmapbt);
+	wf->err = big_block_bmap_init(fs, &bmaps.rmapbt);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_refcountbt);
+	wf->err = big_block_bmap_init(fs, &bmaps.refcountbt);
 	if (wf->err)
 		goto out;
-	wf->err = big_block_bmap_init(fs, &bmap_cow);
+	wf->err = big_block_bmap_init(fs, &bmaps.cow);
 	if (wf->err)
 		goto out;
 
-	ino = INO_GROUPS_DIR - 1;
 	snprintf(path, PATH_MAX, "%d", fs->m_sb.sb_agcount);
 	w = strlen(path);
 	wf->itype = XFS_DIR3_XT_METADATA;
 	/* Iterate all AG metadata... */
-	for (agno = 0; agno < fs->m_sb.sb_agcount; agno++) {
-		agf = XFS_BUF_TO_AGF(ags[agno].agf);
-		agi = XFS_BUF_TO_AGI(ags[agno].agi);
-		wf->agno = agno;
-
-		/* set up per-group virtual files */
-		snprintf(path, PATH_MAX, "%0*d", w, agno);
-		group_ino = ino;
-		ino--;
-		INJECT_GROUP(group_ino, path, XFS_DIR3_FT_DIR);
-
-		snprintf(path, PATH_MAX, "/%s/%s/%0*d", STR_METADATA_DIR,
-				STR_GROUPS_DIR, w, agno);
-
-		/* Record the superblock+agf+agi+agfl blocks */
-		s = XFS_AGB_TO_FSB(fs, agno, 0);
-		len = 4 * fs->m_sb.sb_sectsize / fs->m_sb.sb_blocksize;
-		if (len < 1)
-			len = 1;
-		big_bmap_set(bmap_ag, agno, 0, len, 1);
-		INJECT_METADATA(group_ino, path, ino, STR_SB_FILE,
-				XFS_DIR3_XT_METADATA);
-		insert_extent(&wf->base, ino, XFS_FSBLOCK_TO_BYTES(fs, s),
-				NULL, 4 * fs->m_sb.sb_sectsize, EXTENT_SHARED,
-				extent_codes[XFS_DIR3_XT_METADATA]);
-		if (wf->wf_db_err)
-			goto out;
-		ino--;
-
-		/* AG free list */
-		freelist = XFS_BUF_TO_AGFL_BNO(fs, ags[agno].agfl);
-		for (i = be32_to_cpu(agf->agf_flfirst);
-		     i <= be32_to_cpu(agf->agf_fllast); i++)
-			big_bmap_set(bmap_agfl, agno,
-					be32_to_cpu(freelist[i]), 1, 1);
-
-		INJECT_METADATA(group_ino, path, ino, STR_FL_FILE,
-				XFS_DIR3_XT_METADATA);
-		walk_ag_bitmap(wf, ino, bmap_agfl, agno);
-		if (wf->err || wf->wf_db_err)
+	nr_threads = wf->nr_threads;
+	if (nr_threads < 1)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((xfs_agnumber_t)nr_threads > fs->m_sb.sb_agcount)
+		nr_threads = fs->m_sb.sb_agcount;
+	/* Without the writer thread, nobody serializes database access. */
+	if (!wf->base.writer)
+		nr_threads = 1;
+	if (nr_threads > 1) {
+		struct ag_pool	pool;
+		pthread_t	*threads;
+		int		t, started;
+
+		memset(&pool, 0, sizeof(pool));
+		pthread_mutex_init(&pool.lock, NULL);
+		pool.wf = wf;
+		pool.ags = ags;
+		pool.bmaps = &bmaps;
+		pool.inos_per_ag = metadata_inos_per_ag(fs);
+		pool.w = w;
+		threads = calloc(nr_threads, sizeof(*threads));
+		if (!threads) {
+			pthread_mutex_destroy(&pool.lock);
+			wf->err = ENOMEM;
 			goto out;
-		ino--;
-
-		/* bnobt */
-		wf->bbmap = bmap_bnobt;
-		INJECT_METADATA(group_ino, path, ino, STR_BNOBT_FILE,
-				XFS_DIR3_XT_METADATA);
-		err = walk_ag_allocbt_nodes(fs, ino, agno,
-				be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNO]),
-				insert_meta_extent, wf, &left_bnobt_leaf_agbno);
-		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_bitmap(wf, ino, wf->bbmap, agno);
-		if (wf->err || wf->wf_db_err)
-			goto out;
-		ino--;
-
-		/* free space */
-		wf->bbmap = bmap_freesp;
-		INJECT_METADATA(group_ino, path, ino, STR_FREESP_FILE,
-				XFS_DIR3_XT_FREESP);
-		err = walk_ag_bnobt_records(fs, ino, agno,
-				left_bnobt_leaf_agbno, insert_meta_extent, wf);
-		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_freesp_bitmap(wf, ino, wf->bbmap, agno);
-		if (wf->err || wf->wf_db_err)
-			goto out;
-		ino--;
-
-		/* cntbt */
-		wf->bbmap = bmap_cntbt;
-		INJECT_METADATA(group_ino, path, ino, STR_CNTBT_FILE,
-				XFS_DIR3_XT_METADATA);
-		err = walk_ag_allocbt_nodes(fs, ino, agno,
-				be32_to_cpu(agf->agf_roots[XFS_BTNUM_CNT]),
-				insert_meta_extent, wf, NULL);
-		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_bitmap(wf, ino, wf->bbmap, agno);
-		if (wf->err || wf->wf_db_err)
-			goto out;
-		ino--;
-
-		/* inobt */
-		wf->bbmap = bmap_inobt;
-		INJECT_METADATA(group_ino, path, ino, STR_INOBT_FILE,
-				XFS_DIR3_XT_METADATA);
-		err = walk_ag_inobt_nodes(fs, ino, agno,
-				be32_to_cpu(agi->agi_root),
-				insert_meta_extent, wf, &left_inobt_leaf_agbno);
-		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_bitmap(wf, ino, wf->bbmap, agno);
-		if (wf->err || wf->wf_db_err)
-			goto out;
-		ino--;
-
-		/* finobt */
-		if (!xfs_sb_version_hasfinobt(&fs->m_sb))
-			goto no_finobt;
-		wf->bbmap = bmap_finobt;
-		INJECT_METADATA(group_ino, path, ino, STR_FINOBT_FILE,
-				XFS_DIR3_XT_METADATA);
-		err = walk_ag_inobt_nodes(fs, ino, agno,
-				be32_to_cpu(agi->agi_free_root),
-				insert_meta_extent, wf, NULL);
-		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_bitmap(wf, ino, wf->bbmap, agno);
-		if (wf->err || wf->wf_db_err)
-			goto out;
-		ino--;
-no_finobt:
-
-		/* inode blocks */
-		wf->bbmap = bmap_itable;
-		INJECT_METADATA(group_ino, path, ino, STR_ITABLE_FILE,
-				XFS_DIR3_XT_METADATA);
-		err = walk_ag_inode_blocks(fs, ino, agno,
-				left_inobt_leaf_agbno, insert_meta_extent, wf);
-		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_bitmap(wf, ino, wf->bbmap, agno);
-		if (wf->err || wf->wf_db_err)
-			goto out;
-		ino--;
-
-		/* rmapbt */
-		if (!xfs_sb_version_hasrmapbt(&fs->m_sb))
-			goto no_rmapbt;
-#ifdef XFS_RMAP_CRC_MAGIC
-		wf->bbmap = bmap_rmapbt;
-		INJECT_METADATA(group_ino, path, ino, STR_RMAPBT_FILE,
-				XFS_DIR3_XT_METADATA);
-		err = walk_ag_rmapbt_nodes(fs, ino, agno,
-				be32_to_cpu(agf->agf_roots[XFS_BTNUM_RMAP]),
-				insert_meta_extent, wf);
-		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_bitmap(wf, ino, wf->bbmap, agno);
-		if (wf->err || wf->wf_db_err)
-			goto out;
-		ino--;
-#endif
-no_rmapbt:
-
-		/* refcountbt */
-		if (!xfs_sb_version_hasreflink(&fs->m_sb))
-			goto no_refcountbt;
-#ifdef XFS_REFC_CRC_MAGIC
-		wf->bbmap = bmap_refcountbt;
-		INJECT_METADATA(group_ino, path, ino, STR_REFCOUNTBT_FILE,
-				XFS_DIR3_XT_METADATA);
-		err = walk_ag_refcountbt_nodes(fs, ino, agno,
-				be32_to_cpu(agf->agf_refcount_root),
-				insert_meta_extent, wf);
-		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_bitmap(wf, ino, wf->bbmap, agno);
-		if (wf->err || wf->wf_db_err)
-			goto out;
-		ino--;
-
-		/* CoW staging */
-		wf->bbmap = bmap_cow;
-		INJECT_METADATA(group_ino, path, ino, STR_COW_FILE,
-				XFS_DIR3_XT_METADATA);
-		err = walk_ag_cow_extents(wf, ino, agno, insert_meta_extent);
+		}
+		started = 0;
+		for (t = 0; t < nr_threads; t++) {
+			if (pthread_create(&threads[t], NULL,
+					   walk_ag_metadata_thread, &pool))
+				break;
+			started++;
+		}
+		if (!started)
+			walk_ag_metadata_thread(&pool);
+		for (t = 0; t < started; t++)
+			pthread_join(threads[t], NULL);
+		free(threads);
+		pthread_mutex_destroy(&pool.lock);
 		if (!wf->err)
-			wf->err = err;
-		if (wf->err)
-			goto out;
-		walk_ag_bitmap(wf, ino, wf->bbmap, agno);
+			wf->err = pool.err;
+		if (!wf->wf_db_err)
+			wf->wf_db_err = pool.db_err;
 		if (wf->err || wf->wf_db_err)
 			goto out;
-		ino--;
-#endif
-no_refcountbt:
+	} else {
+		int64_t	inos_per_ag = metadata_inos_per_ag(fs);
 
-		/* Unlinked inodes. */
-		for (i = 0; i < XFS_AGI_UNLINKED_BUCKETS; i++) {
-			walk_unlinked_inode_chain(wf, agno, \
-					be32_to_cpu(agi->agi_unlinked[i]));
+		for (agno = 0; agno < fs->m_sb.sb_agcount; agno++) {
+			walk_ag_metadata(wf, ags, agno,
+					INO_GROUPS_DIR - 1 -
+					agno * inos_per_ag, w, &bmaps);
 			if (wf->err || wf->wf_db_err)
 				goto out;
 		}
 	}
 
 	/* Emit extents for the overall files */
-	walk_bitmap(wf, INO_SB_FILE, bmap_ag);
+	walk_bitmap(wf, INO_SB_FILE, bmaps.ag);
 	if (wf->err || wf->wf_db_err)
 		goto out;
-	walk_bitmap(wf, INO_FL_FILE, bmap_agfl);
+	walk_bitmap(wf, INO_FL_FILE, bmaps.agfl);
 	if (wf->err || wf->wf_db_err)
 		goto out;
-	walk_bitmap(wf, INO_BNOBT_FILE, bmap_bnobt);
+	walk_bitmap(wf, INO_BNOBT_FILE, bmaps.bnobt);
 	if (wf->err || wf->wf_db_err)
 		goto out;
-	walk_freesp_bitmap(wf, INO_FREESP_FILE, bmap_freesp);
+	walk_freesp_bitmap(wf, INO_FREESP_FILE, bmaps.freesp);
 	if (wf->err || wf->wf_db_err)
 		goto out;
-	walk_bitmap(wf, INO_CNTBT_FILE, bmap_cntbt);
+	walk_bitmap(wf, INO_CNTBT_FILE, bmaps.cntbt);
 	if (wf->err || wf->wf_db_err)
 		goto out;
-	walk_bitmap(wf, INO_INOBT_FILE, bmap_inobt);
+	walk_bitmap(wf, INO_INOBT_FILE, bmaps.inobt);
 	if (wf->err || wf->wf_db_err)
 		goto out;
 	if (xfs_sb_version_hasfinobt(&fs->m_sb)) {
-		walk_bitmap(wf, INO_FINOBT_FILE, bmap_finobt);
+		walk_bitmap(wf, INO_FINOBT_FILE, bmaps.finobt);
 		if (wf->err || wf->wf_db_err)
 			goto out;
 	}
-	walk_bitmap(wf, INO_ITABLE_FILE, bmap_itable);
+	walk_bitmap(wf, INO_ITABLE_FILE, bmaps.itable);
 	if (wf->err || wf->wf_db_err)
 		goto out;
 	if (xfs_sb_version_hasrmapbt(&fs->m_sb)) {
-		walk_bitmap(wf, INO_RMAPBT_FILE, bmap_rmapbt);
+		walk_bitmap(wf, INO_RMAPBT_FILE, bmaps.rmapbt);
 		if (wf->err || wf->wf_db_err)
 			goto out;
 	}
 	if (xfs_sb_version_hasreflink(&fs->m_sb)) {
-		walk_bitmap(wf, INO_REFCOUNTBT_FILE, bmap_refcountbt);
+		walk_bitmap(wf, INO_REFCOUNTBT_FILE, bmaps.refcountbt);
 		if (wf->err || wf->wf_db_err)
 			goto out;
-		walk_bitmap(wf, INO_COW_FILE, bmap_cow);
+		walk_bitmap(wf, INO_COW_FILE, bmaps.cow);
 		if (wf->err || wf->wf_db_err)
 			goto out;
 	}
@@ -2184,38 +2477,55 @@ no_refcountbt:
 			goto out;
 	}
 out:
-	if (bmap_cow)
-		big_bmap_destroy(bmap_cow);
-	if (bmap_refcountbt)
-		big_bmap_destroy(bmap_refcountbt);
-	if (bmap_rmapbt)
-		big_bmap_destroy(bmap_rmapbt);
-	if (bmap_itable)
-		big_bmap_destroy(bmap_itable);
-	if (bmap_finobt)
-		big_bmap_destroy(bmap_finobt);
-	if (bmap_inobt)
-		big_bmap_destroy(bmap_inobt);
-	if (bmap_cntbt)
-		big_bmap_destroy(bmap_cntbt);
-	if (bmap_freesp)
-		big_bmap_destroy(bmap_freesp);
-	if (bmap_bnobt)
-		big_bmap_destroy(bmap_bnobt);
-	if (bmap_agfl)
-		big_bmap_destroy(bmap_agfl);
-	if (bmap_ag)
-		big_bmap_destroy(bmap_ag);
+	if (bmaps.cow)
+		big_bmap_destroy(bmaps.cow);
+	if (bmaps.refcountbt)
+		big_bmap_destroy(bmaps.refcountbt);
+	if (bmaps.rmapbt)
+		big_bmap_destroy(bmaps.rmapbt);
+	if (bmaps.itable)
+		big_bmap_destroy(bmaps.itable);
+	if (bmaps.finobt)
+		big_bmap_destroy(bmaps.finobt);
+	if (bmaps.inobt)
+		big_bmap_destroy(bmaps.inobt);
+	if (bmaps.cntbt)
+		big_bmap_destroy(bmaps.cntbt);
+	if (bmaps.freesp)
+		big_bmap_destroy(bmaps.freesp);
+	if (bmaps.bnobt)
+		big_bmap_destroy(bmaps.bnobt);
+	if (bmaps.agfl)
+		big_bmap_destroy(bmaps.agfl);
+	if (bmaps.ag)
+		big_bmap_destroy(bmaps.ag);
 	if (ags)
 		free_ags(fs, ags);
 	return;
 }
 
+/*
+ * The rmapbt scan inserts every data fork mapping as a file extent; now
+ * that inode_t is complete, retype the ones that belong to directories
+ * and symlinks.
+ */
+static void
+fixup_rmap_extent_types(
+	struct xfsmap		*wf)
+{
+	flush_extents(&wf->base);
+	if (wf->wf_db_err)
+		return;
+	run_batch_query(&wf->base,
+"UPDATE extent_t SET type = 1 WHERE type = 0 AND l_off IS NOT NULL AND ino IN (SELECT ino FROM inode_t WHERE type = 1);\
+UPDATE extent_t SET type = 5 WHERE type = 0 AND l_off IS NOT NULL AND ino IN (SELECT ino FROM inode_t WHERE type = 3);");
+}
+
 static void
 usage(void)
 {
 	fprintf(stderr, _(
-		"Usage: %s [-ifrV] [-l logdev] dbfile device\n"
+		"Usage: %s [-ifOrRSV] [-l logdev] [-t nr_threads] dbfile device\n"
 		), progname);
 	exit(1);
 }
@@ -2249,6 +2559,12 @@ main(
 	unsigned long long	total_bytes, free_bytes, total_inodes,
 				free_inodes, fakeinos;
 	int			c;
+	int			nr_threads = 0;
+	int			rmap_scan = 0;
+	int			incremental = 0;
+	int			resume = 0;
+	int			spill = 0;
+	int			optimize = 0;
 	int			db_err, err, err2;
 
 	err = 0;
@@ -2256,14 +2572,32 @@ main(
 	x.isreadonly = (LIBXFS_ISREADONLY | LIBXFS_ISINACTIVE);
 	x.isdirect = 0;
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "fl:")) != EOF) {
+	while ((c = getopt(argc, argv, "fil:OrRSt:")) != EOF) {
 		switch (c) {
 		case 'f':
 			x.disfile = 1;
 			break;
+		case 'i':
+			incremental = 1;
+			break;
 		case 'l':
 			x.logname = optarg;
 			break;
+		case 'O':
+			optimize = 1;
+			break;
+		case 'r':
+			rmap_scan = 1;
+			break;
+		case 'R':
+			resume = 1;
+			break;
+		case 'S':
+			spill = 1;
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
 		case '?':
 			usage();
 			/*NOTREACHED*/
@@ -2371,11 +2705,13 @@ _("%s: cannot init perag data (%d). Continuing anyway.\n"),
 
 	/* Open things */
 	memset(&wf, 0, sizeof(wf));
-	db_err = truncate(dbfile, 0);
-	if (db_err && errno != ENOENT) {
-		fprintf(stderr, "%s %s", strerror(errno),
-			_("while truncating database"));
-		goto out;
+	if (!incremental && !resume) {
+		db_err = truncate(dbfile, 0);
+		if (db_err && errno != ENOENT) {
+			fprintf(stderr, "%s %s", strerror(errno),
+				_("while truncating database"));
+			goto out;
+		}
 	}
 
 	total_bytes = fs->m_sb.sb_dblocks * fs->m_sb.sb_blocksize;
@@ -2396,13 +2732,80 @@ _("%s: cannot init perag data (%d). Continuing anyway.\n"),
 		goto out;
 	}
 
+	if (rmap_scan && !xfs_sb_version_hasrmapbt(&fs->m_sb)) {
+		fprintf(stderr,
+_("%s: no reverse-mapping btree; doing a regular scan.\n"),
+			fsdev);
+		rmap_scan = 0;
+	}
+
+	/*
+	 * The rmapbt scan emits every owner's extents regardless of
+	 * whether the inode changed, which would duplicate the rows kept
+	 * for unchanged inodes.
+	 */
+	if ((incremental || resume) && rmap_scan) {
+		fprintf(stderr,
+_("%s: reverse-mapping scan cannot be incremental; doing an inode scan.\n"),
+			fsdev);
+		rmap_scan = 0;
+	}
+
+	/* Spilled insertions never clear old rows, so full scans only. */
+	if (spill && (incremental || resume)) {
+		fprintf(stderr,
+_("%s: disabling spill files for incremental scans.\n"),
+			dbfile);
+		spill = 0;
+	}
+
 	wf.wf_iconv = iconv_open("UTF-8", "UTF-8");
 	wf.wf_db = db;
 	wf.fs = fs;
+	wf.nr_threads = nr_threads;
+	wf.rmap_scan = rmap_scan;
+
+	/*
+	 * Neither the rmapbt scan nor the parallel AG walk delivers each
+	 * inode's extents as one contiguous run, so stick with the
+	 * post-scan statistics pass in those modes.  The spill loader
+	 * re-sorts the extents into per-inode runs, which puts the
+	 * parallel walk (but not the rmapbt scan, whose rows aren't
+	 * correctly typed until after the load) back in play.
+	 */
+	if (rmap_scan || (nr_threads != 1 && !spill))
+		disable_streaming_stats(&wf.base);
 
 	/* Prepare and clean out database. */
-	prepare_db(&wf.base);
+	if (resume && prepare_db_resume(&wf.base)) {
+		fprintf(stderr,
+_("%s: no checkpoint to resume; doing a full scan.\n"),
+			dbfile);
+		resume = 0;
+	}
+	if (!resume && incremental && prepare_db_incremental(&wf.base)) {
+		fprintf(stderr,
+_("%s: no usable previous scan; doing a full scan.\n"),
+			dbfile);
+		incremental = 0;
+	}
+	if (!resume && !incremental)
+		prepare_db(&wf.base);
 	CHECK_ERROR("while preparing database");
+
+	/*
+	 * The rmapbt scan delivers extents long after the owning inode
+	 * rows, so there's no point in the walk at which a commit leaves
+	 * the database in a resumable state.  Checkpoints are just as
+	 * useless in spill mode, where nothing reaches the database until
+	 * the load phase.
+	 */
+	if (spill) {
+		fm_spill_start(&wf.base, dbfile);
+	} else if (!rmap_scan) {
+		enable_checkpoints(&wf.base);
+		CHECK_ERROR("while enabling scan checkpoints");
+	}
 	wf.wf_db_err = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, &errm);
 	if (errm) {
 		fprintf(stderr, "%s %s", errm, "while starting transaction");
@@ -2429,14 +2832,30 @@ _("%s: cannot init perag data (%d). Continuing anyway.\n"),
 	CHECK_ERROR("while storing fs stats");
 
 	/* Walk the filesystem */
-	wf.err = big_inode_bmap_init(fs, &wf.ino_bmap);
-	CHECK_ERROR("while allocating scanned inode bitmap");
+	wf.err = ino_set_init(&wf.ino_seen);
+	CHECK_ERROR("while allocating scanned inode set");
+	fm_writer_start(&wf.base);
+	CHECK_ERROR("while starting database writer");
+	fm_phase_start(&wf.base, "walk_fs");
 	walk_fs(&wf);
+	fm_phase_stop(&wf.base, "walk_fs");
 	CHECK_ERROR("while analyzing filesystem");
 
 	/* Walk the metadata */
+	fm_phase_start(&wf.base, "walk_metadata");
 	walk_metadata(&wf);
+	fm_phase_stop(&wf.base, "walk_metadata");
 	CHECK_ERROR("while analyzing metadata");
+	fm_writer_stop(&wf.base);
+	CHECK_ERROR("while draining database writer");
+	fm_spill_load(&wf.base);
+	CHECK_ERROR("while bulk-loading spilled records");
+	if (wf.rmap_scan) {
+		fixup_rmap_extent_types(&wf);
+		CHECK_ERROR("while retyping rmap extents");
+	}
+	prune_db(&wf.base);
+	CHECK_ERROR("while pruning deleted inodes");
 
 	/* Generate indexes and finalize. */
 	index_db(&wf.base);
@@ -2445,6 +2864,10 @@ _("%s: cannot init perag data (%d). Continuing anyway.\n"),
 	CHECK_ERROR("while finalizing database");
 	calc_inode_stats(&wf.base);
 	CHECK_ERROR("while calculating inode statistics");
+	if (optimize) {
+		optimize_db(&wf.base);
+		CHECK_ERROR("while optimizing database for queries");
+	}
 
 	wf.wf_db_err = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &errm);
 	if (errm) {
@@ -2462,11 +2885,9 @@ _("%s: cannot init perag data (%d). Continuing anyway.\n"),
 	}
 	CHECK_ERROR("while starting overview cache database transaction");
 
-	/* Cache overviews. */
-	cache_overview(&wf.base, 2048);
-	CHECK_ERROR("while caching CLI overview");
+	/* Cache overviews at every zoom level. */
 	cache_overview(&wf.base, 65536);
-	CHECK_ERROR("while caching GUI overview");
+	CHECK_ERROR("while caching overviews");
 
 	wf.wf_db_err = sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &errm);
 	if (errm) {
@@ -2477,11 +2898,12 @@ _("%s: cannot init perag data (%d). Continuing anyway.\n"),
 	CHECK_ERROR("while flushing overview cache database transaction");
 
 out:
-	if (wf.ino_bmap)
-		big_bmap_destroy(wf.ino_bmap);
+	if (wf.ino_seen)
+		ino_set_destroy(wf.ino_seen);
 	if (wf.wf_iconv)
 		iconv_close(wf.wf_iconv);
 
+	cleanup_db(&wf.base);
 	err2 = sqlite3_close(db);
 	if (err2)
 		fprintf(stderr, "%s %s", sqlite3_errstr(err2),